@@ -10,14 +10,12 @@ Friend of avltree class which contains functions only used in testing.
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <assert.h>
 
 using std::max;
 
-#include <iostream>
-using std::cout;
-using std::endl;
-
 // A class template to test some of the internals of the AVL tree implementation.
 // Is declared friend of avltree so has access to these.
 template<typename K, typename V>
@@ -28,7 +26,8 @@ private:
 public:
 
   // Count the total number of nodes in the tree.
-  static unsigned int count_nodes(const avltree<K, V>& tree)
+  template <typename... Params>
+  static unsigned int count_nodes(const avltree<K, V, Params...>& tree)
   {
     if (tree.root)
       return count_descendants(tree.root);
@@ -37,17 +36,66 @@ public:
   }
 
   // Check the tree is AVL.
-  static bool is_avl(const avltree<K, V>& tree)
+  template <typename... Params>
+  static bool is_avl(const avltree<K, V, Params...>& tree)
   {
     return is_avl(tree.root);
   }
 
   // Check the tree's balance factors are correct.
-  static bool valid_balance_factors(const avltree<K, V>& tree)
+  template <typename... Params>
+  static bool valid_balance_factors(const avltree<K, V, Params...>& tree)
   {
     return valid_balance_factors(tree.root);
   }
 
+  // The height of the tree, and the largest difference between the heights of a node's two sides.
+  template <typename... Params>
+  static unsigned int height(const avltree<K, V, Params...>& tree)
+  {
+    return subtree_height(tree.root);
+  }
+  template <typename... Params>
+  static int max_imbalance(const avltree<K, V, Params...>& tree)
+  {
+    return max_imbalance(tree.root);
+  }
+
+  // Check every child's parent link points back at its parent.
+  template <typename... Params>
+  static bool valid_parent_links(const avltree<K, V, Params...>& tree)
+  {
+    return !tree.root || (tree.root->parent == nullptr && valid_parent_links(tree.root));
+  }
+
+  // Check every node of an `order_statistics` tree holds the size of its subtree.
+  template <typename... Params>
+  static bool valid_subtree_sizes(const avltree<K, V, Params...>& tree)
+  {
+    return valid_subtree_sizes(tree.root);
+  }
+
+  // Check a version of a `persistent_avltree` is AVL, with the right heights and sizes kept in
+  // its nodes.
+  template <typename Version>
+  static bool valid_version(const Version& version)
+  {
+    return valid_heights(version._root) && valid_subtree_sizes(version._root);
+  }
+
+  // Check a `compact_avltree` is an ordered AVL tree with correct balance factors, and that its
+  // slots are all either in the tree or on the free list.
+  template <typename Compact>
+  static bool valid_compact(const Compact& tree)
+  {
+    std::size_t reached = 0;
+    std::size_t free_slots = 0;
+    for (std::uint32_t slot = tree._free; slot != Compact::nil; slot = tree._nodes[slot].child[0])
+      ++free_slots;
+    return compact_subtree_height(tree, tree._root, reached) >= 0 && reached == tree.size()
+           && reached + free_slots == tree._nodes.size() && tree._values.size() == tree._nodes.size();
+  }
+
   // Test the functions in this class.
   static void test_meta_functions()
   {
@@ -84,46 +132,118 @@ public:
   }
 
 private:
-  static bool is_avl(const shared_ptr<typename avltree<K, V>::node> root_node)
+  template <typename NodePtr>
+  static bool is_avl(const NodePtr& root_node)
   {
     if (!root_node) return true;  // Base case; an empty tree is always AVL.
     bool left_is_avl, right_is_avl;
     unsigned int left_height, right_height;
-    left_is_avl = is_avl(root_node->left_child);
-    left_height = subtree_height(root_node->left_child);
-    right_is_avl = is_avl(root_node->right_child);
-    right_height = subtree_height(root_node->right_child);
-    if (root_node->parent.lock() == nullptr)
-    {
-      if (DBG) { cout << "left subtree: " << left_height << " | right subtree: " << right_height << endl; }
-      if (DBG) { cout << "left_is_avl: " << left_is_avl << " | right_is_avl: " << right_is_avl << endl; }
-    }
+    left_is_avl = is_avl(root_node->child[0]);
+    left_height = subtree_height(root_node->child[0]);
+    right_is_avl = is_avl(root_node->child[1]);
+    right_height = subtree_height(root_node->child[1]);
     return left_is_avl && right_is_avl && (abs(left_height - right_height) <= 1u);
   }
 
-  static bool valid_balance_factors(const shared_ptr<typename avltree<K, V>::node> node)
+  template <typename NodePtr>
+  static bool valid_balance_factors(const NodePtr& node)
+  {
+    if (!node) return true;
+    const int left_height = static_cast<int>(subtree_height(node->child[0]));
+    const int right_height = static_cast<int>(subtree_height(node->child[1]));
+    return (left_height - right_height == node->balance_factor)
+            && valid_balance_factors(node->child[0]) && valid_balance_factors(node->child[1]);
+  }
+
+  template <typename NodePtr>
+  static int max_imbalance(const NodePtr& node)
+  {
+    if (!node) return 0;
+    return std::max(std::abs(static_cast<int>(node->balance_factor)),
+                    std::max(max_imbalance(node->child[0]), max_imbalance(node->child[1])));
+  }
+
+  template <typename NodePtr>
+  static bool valid_parent_links(const NodePtr& node)
   {
     if (!node) return true;
-    if (DBG) { cout << "left_height: " << subtree_height(node->left_child) << " | right_height: "
-         << subtree_height(node->right_child) << " | balance_factor: " << static_cast<int>(node->balance_factor) << endl; }
-    return (subtree_height(node->left_child) - subtree_height(node->right_child) == node->balance_factor)
-            && valid_balance_factors(node->left_child) && valid_balance_factors(node->right_child);
+    if (node->child[0] && node->child[0]->parent != node) return false;
+    if (node->child[1] && node->child[1]->parent != node) return false;
+    return valid_parent_links(node->child[0]) && valid_parent_links(node->child[1]);
+  }
+
+  template <typename NodePtr>
+  static bool valid_heights(const NodePtr& node)
+  {
+    if (!node) return true;
+    const unsigned int left_height = subtree_height(node->child[0]);
+    const unsigned int right_height = subtree_height(node->child[1]);
+    return max(left_height, right_height) - std::min(left_height, right_height) <= 1u
+           && static_cast<int>(node->height) == 1 + static_cast<int>(max(left_height, right_height))
+           && valid_heights(node->child[0]) && valid_heights(node->child[1]);
+  }
+
+  template <typename NodePtr>
+  static bool valid_subtree_sizes(const NodePtr& node)
+  {
+    if (!node) return true;
+    return node->size == count_descendants(node) && valid_subtree_sizes(node->child[0])
+           && valid_subtree_sizes(node->child[1]);
+  }
+
+  // Whether a key policy with `valid_link` has what it should in `key`, hanging from `parent`.
+  template <typename Keys, typename Stored>
+  static auto compact_link_valid(const Keys& keys, const Stored& key, const Stored* parent, int)
+    -> decltype(keys.valid_link(key, parent))
+  { return keys.valid_link(key, parent); }
+  template <typename Keys, typename Stored>
+  static bool compact_link_valid(const Keys&, const Stored&, const Stored*, long) { return true; }
+
+  // The height of a `compact_avltree` subtree, or -1 if it is out of order, out of balance, or its
+  // keys aren't linked up as the key policy expects.
+  template <typename Compact>
+  static int compact_subtree_height(const Compact& tree, std::uint32_t index, std::size_t& reached)
+  {
+    if (index == Compact::nil) return 0;
+    if (index >= tree._nodes.size()) return -1;
+    ++reached;
+    const auto& node = tree._nodes[index];
+    if (index == tree._root && !compact_link_valid(tree._keys, node.key, decltype(&node.key)(nullptr), 0))
+      return -1;
+    for (int side = 0; side < 2; ++side)
+    {
+      const std::uint32_t child = node.child[side];
+      if (child == Compact::nil)
+        continue;
+      if (child >= tree._nodes.size() || !compact_link_valid(tree._keys, tree._nodes[child].key, &node.key, 0)
+          || (side == 0 ? !tree._keys.less(tree._nodes[child].key, node.key)
+                        : !tree._keys.less(node.key, tree._nodes[child].key)))
+        return -1;
+    }
+    const int left_height = compact_subtree_height(tree, node.child[0], reached);
+    const int right_height = compact_subtree_height(tree, node.child[1], reached);
+    if (left_height < 0 || right_height < 0 || left_height - right_height != node.balance_factor
+        || node.balance_factor < -1 || node.balance_factor > 1)
+      return -1;
+    return 1 + max(left_height, right_height);
   }
 
-  static unsigned int count_descendants(const shared_ptr<typename avltree<K, V>::node> node)
+  template <typename NodePtr>
+  static unsigned int count_descendants(const NodePtr& node)
   {
-    unsigned int left_count = node->left_child ? count_descendants(node->left_child) : 0;
-    unsigned int right_count = node->right_child ? count_descendants(node->right_child) : 0;
+    unsigned int left_count = node->child[0] ? count_descendants(node->child[0]) : 0;
+    unsigned int right_count = node->child[1] ? count_descendants(node->child[1]) : 0;
     return 1u + left_count + right_count;
   }
 
-  static unsigned int subtree_height(const shared_ptr<typename avltree<K, V>::node> node)
+  template <typename NodePtr>
+  static unsigned int subtree_height(const NodePtr& node)
   {
     if (!node) return 0u;  // no subtree root -> height = 0.
     unsigned int left_height, right_height;
     left_height = right_height = 0u;
-    left_height = subtree_height(node->left_child);
-    right_height = subtree_height(node->right_child);
+    left_height = subtree_height(node->child[0]);
+    right_height = subtree_height(node->child[1]);
     return 1 + max(left_height, right_height);
   }
 };
@@ -0,0 +1,41 @@
+/*
+avltree-tracing.h
+Copyright (c) Eromid (Olly) 2017
+
+A tracing policy for avltree which prints each rebalancing step, for debugging.
+*/
+
+#ifndef AVLTREE_TRACING_H
+#define AVLTREE_TRACING_H
+
+#include <iostream>
+
+#include "avltree.h"
+
+// Print each step to `std::clog`, one line each: the description, then the values involved. Keys
+// are printed when nodes are rotated, so they must support `operator<<`; values never are.
+//
+//   avltree<int, string, std::allocator<std::pair<const int, string>>, no_augmentation,
+//           stream_tracing> traced;
+struct stream_tracing : no_tracing
+{
+  template <typename... Details>
+  static void trace(const char* what, const Details&... details)
+  {
+    std::clog << what;
+    _print(details...);
+    std::clog << '\n';
+  }
+
+private:
+  static void _print() {}
+
+  template <typename Detail, typename... Rest>
+  static void _print(const Detail& detail, const Rest&... rest)
+  {
+    std::clog << ' ' << detail;
+    _print(rest...);
+  }
+};
+
+#endif  // AVLTREE_TRACING_H
@@ -10,7 +10,14 @@ A template for an AVL tree - a self balancing binary search tree.
 
 #include <memory>
 #include <cinttypes>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "optional.h"
 
@@ -18,656 +25,2558 @@ A template for an AVL tree - a self balancing binary search tree.
 #define RIGHT_HEAVY (-1)
 #define BALANCED (0)
 
-using std::shared_ptr;
-using std::make_shared;
-using std::weak_ptr;
-
-// Set DBG true to enable detailed output.
-#define DBG false
-#include <iostream>
-using std::cout;
-using std::endl;
-
 // Forward declaration of test_helper class template so we can declare its friendship.
 // The test_helper class contains some meta functionality to check the implementation is valid.
 template<typename K, typename V>
 class test_helper;
 
+// Declared here so that the parallel algorithms in parallel-avltree.h can work on the nodes.
+template <typename Tree>
+class parallel_avltree;
+
+// Augmentation policies for `avltree`, which keep extra data about each subtree in its root node.
+// A policy has a `data` struct, which every node inherits, and a static `update(node)` which
+// recomputes a node's data from its own key and value and the data of its children, `child[0]` and
+// `child[1]` (either may be null). The tree calls it bottom-up on every node whose subtree changes.
+
+// The default policy: nodes carry nothing extra.
+struct no_augmentation
+{
+  struct data {};
+  template <typename Node>
+  static void update(Node&) {}
+};
+
+// Keep the number of nodes in each subtree; `rank` and `select` use them to work with positions
+// in key order in O(log n).
+struct order_statistics
+{
+  struct data
+  {
+    data() : size(1) {}
+    std::size_t size;
+  };
+
+  // The number of nodes in a subtree, which may be empty.
+  template <typename Node>
+  static std::size_t size_of(const Node* subtree_root) { return subtree_root ? subtree_root->size : 0; }
+
+  template <typename Node>
+  static void update(Node& n) { n.size = 1 + size_of(n.child[0]) + size_of(n.child[1]); }
+};
+
+// Mark the elements inserted or given a new value since `avltree::for_each_changed` last visited
+// them, and the subtrees which hold any, so that the visit only goes down those. Values changed in
+// place through `find` or an iterator aren't marked.
+struct dirty_tracking
+{
+  struct data
+  {
+    data() : changed(true), subtree_changed(true) {}
+    bool changed;          // This element is new or has a new value.
+    bool subtree_changed;  // This element or one below it has.
+  };
+
+  template <typename Node>
+  static bool subtree_changed(const Node* subtree_root) { return subtree_root && subtree_root->subtree_changed; }
+
+  template <typename Node>
+  static void update(Node& n)
+  {
+    n.subtree_changed = n.changed || subtree_changed(n.child[0]) || subtree_changed(n.child[1]);
+  }
+};
+
+// Keep an aggregate of the elements in each subtree (a sum, a maximum, ...), which lets
+// `range_aggregate` combine the elements with keys in a range in O(log n). `Op` describes it:
+//   value_type                 The type of the aggregate.
+//   identity()                 The aggregate of no elements.
+//   lift(key, value)           The aggregate of one element.
+//   combine(a, b)              The aggregate of a's elements followed by b's; must be associative.
+// The aggregates are only updated when the tree changes a value, so change values with `insert`
+// or `emplace` rather than through `find` or an iterator.
+template <typename Op>
+struct subtree_aggregate
+{
+  using op_type = Op;
+  using value_type = typename Op::value_type;
+
+  struct data { value_type aggregate; };
+
+  template <typename Node>
+  static void update(Node& n)
+  {
+    value_type result = Op::lift(n.key, n.value);
+    if (n.child[0])
+      result = Op::combine(n.child[0]->aggregate, result);
+    if (n.child[1])
+      result = Op::combine(result, n.child[1]->aggregate);
+    n.aggregate = result;
+  }
+};
+
+// `subtree_aggregate` operations for the sum and the maximum of the values.
+template <typename T>
+struct value_sum
+{
+  using value_type = T;
+  static T identity() { return T(); }
+  template <typename Key>
+  static T lift(const Key&, const T& value) { return value; }
+  static T combine(const T& a, const T& b) { return a + b; }
+};
+
+template <typename T>
+struct value_max
+{
+  using value_type = T;
+  static T identity() { return std::numeric_limits<T>::lowest(); }
+  template <typename Key>
+  static T lift(const Key&, const T& value) { return value; }
+  static T combine(const T& a, const T& b) { return a < b ? b : a; }
+};
+
+// Tracing policies for `avltree`, which hear about each step the tree takes while rebalancing.
+// `trace(what, details...)` is called with a description of the step and any values it involves
+// (sides, and the keys of rotated nodes); avltree-tracing.h has a policy which prints them. The
+// other hooks report events as they happen, for counting. Every tree holds its own policy object.
+// A policy derives from `no_tracing` and hides the hooks it wants.
+
+// The default policy: no tracing. The calls compile to nothing.
+struct no_tracing
+{
+  template <typename... Details>
+  static void trace(const char*, const Details&...) {}
+
+  // A single rotation, including each of the two making up a double rotation.
+  static void rotated() {}
+  static void double_rotated() {}
+
+  // A retrace after an insertion or deletion which updated the balance of `length` nodes.
+  static void insertion_retraced(std::size_t /* length */) {}
+  static void deletion_retraced(std::size_t /* length */) {}
+
+  // A search by key which visited `length` nodes.
+  static void searched(std::size_t /* length */) {}
+
+  static void node_allocated() {}
+  static void node_freed() {}
+};
+
+// Counts of what a tree did while it was collecting stats, see `collect_stats`.
+struct avltree_stats
+{
+  // Lengths of `max_length` or more are counted together, in the last bucket.
+  static const std::size_t max_length = 64;
+
+  avltree_stats() : single_rotations(0), double_rotations(0), allocations(0), deallocations(0),
+    insertion_retraces(), deletion_retraces(), searches() {}
+
+  std::size_t single_rotations;
+  std::size_t double_rotations;
+  std::size_t allocations;
+  std::size_t deallocations;
+
+  // Histograms by length: the number of retraces updating i nodes, and of searches visiting i.
+  std::size_t insertion_retraces[max_length];
+  std::size_t deletion_retraces[max_length];
+  std::size_t searches[max_length];
+};
+
+// A tracing policy counting rotations, retraces, searches and node allocations, which
+// `avltree::stats()` reads. Searching the tree updates the counts, so a tree collecting stats
+// mustn't be searched from more than one thread at a time.
+class collect_stats : public no_tracing
+{
+public:
+  void rotated() { ++_rotations; }
+  void double_rotated() { ++_counts.double_rotations; }
+  void insertion_retraced(std::size_t length) { ++_counts.insertion_retraces[_bucket(length)]; }
+  void deletion_retraced(std::size_t length) { ++_counts.deletion_retraces[_bucket(length)]; }
+  void searched(std::size_t length) { ++_counts.searches[_bucket(length)]; }
+  void node_allocated() { ++_counts.allocations; }
+  void node_freed() { ++_counts.deallocations; }
+
+  collect_stats() : _rotations(0) {}
+
+  avltree_stats stats() const
+  {
+    avltree_stats snapshot = _counts;
+    snapshot.single_rotations = _rotations - 2 * _counts.double_rotations;
+    return snapshot;
+  }
+
+  void reset() { *this = collect_stats(); }
+
+private:
+  static std::size_t _bucket(std::size_t length)
+  {
+    return length < avltree_stats::max_length ? length : avltree_stats::max_length - 1;
+  }
+
+  std::size_t _rotations;
+  avltree_stats _counts;
+};
+
+// Comparison policies for `avltree`. A policy is called as `compare(a, b)` on two keys, or on a key
+// and a search argument of another type, either way round. It is either a less-than predicate
+// returning `bool`, for which the tree tells apart "after" and "equivalent" with a second call, or
+// a three-way comparison returning a negative, zero or positive value (an `int`, or a C++20
+// ordering) as `a` is before, equivalent to or after `b`, which costs one call per level.
+
+// Compare with `<`, for any pair of types which support it, like `std::less<>` in C++14.
+struct key_less
+{
+  template <typename A, typename B>
+  bool operator()(const A& a, const B& b) const { return a < b; }
+};
+
+// Compare with the `compare` member of the keys, as `std::string` and `std::string_view` have.
+// If only `b` has one (`a` is a string literal, say), it is called the other way round. In C++20,
+// `std::compare_three_way` does the same with `operator<=>`.
+struct member_compare
+{
+  template <typename A, typename B>
+  int operator()(const A& a, const B& b) const { return _compare(a, b, 0); }
+
+private:
+  template <typename A, typename B>
+  static auto _compare(const A& a, const B& b, int) -> decltype(static_cast<int>(a.compare(b)))
+  { return a.compare(b); }
+  template <typename A, typename B>
+  static int _compare(const A& a, const B& b, long)
+  {
+    const int order = b.compare(a);
+    return (order < 0) - (order > 0);
+  }
+};
+
+// Whether `a` is before `b` under `compare`, a policy of either kind, in one call. For searches
+// outside the tree, such as `frozen_avltree`'s, to order keys as the tree does.
+template <typename Compare, typename A, typename B>
+bool key_before(const Compare& compare, const A& a, const B& b, std::true_type) { return compare(a, b); }
+template <typename Compare, typename A, typename B>
+bool key_before(const Compare& compare, const A& a, const B& b, std::false_type) { return compare(a, b) < 0; }
+template <typename Compare, typename A, typename B>
+bool key_before(const Compare& compare, const A& a, const B& b)
+{
+  return key_before(compare, a, b, std::is_same<decltype(compare(a, b)), bool>());
+}
+
 // A class template implementing an AVL tree - a kind of self balancing binary search tree.
 // The class supports the typical operations; insertion, removal and search.
 // No exceptions are thrown. The class uses an 'optional' type to return results of searching
 // since the key might not be present in the tree.
 //
-// Key type (K) should have well defined strict ordering, implemented with comparison operators
-// '<' and '>'.
+// Key type (K) should have a well defined strict ordering, by default implemented with '<'.
 // The value type (V) can be anything.
-template <typename K, typename V>
+// The allocator type (Alloc) is rebound to allocate the tree's nodes. It defaults to
+// `std::allocator`; `node_pool_allocator` (node-pool.h) draws all the nodes from one pool instead.
+// The augmentation policy (Augment) adds data to every node, see `no_augmentation` (the default)
+// and `order_statistics` above.
+// The tracing policy (Tracer) is told about each rebalancing step, see `no_tracing` (the default)
+// and `collect_stats` above.
+// The comparison policy (Compare) orders the keys, see `key_less` (the default) and
+// `member_compare` above.
+template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>,
+          typename Augment = no_augmentation, typename Tracer = no_tracing, typename Compare = key_less>
 class avltree
 {
 public:
 
+  // The augmentation policy the tree was made with.
+  using augment_type = Augment;
+
+  // Bidirectional iterators over the key-value pairs in key order, defined below. Dereferencing
+  // one gives a `std::pair<const K&, V&>` (`const V&` for a `const_iterator`) referring into the
+  // node. An iterator stays valid until the element it refers to is removed.
+  template <bool Const>
+  class basic_iterator;
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+
+  // A pair of iterators which can be used in a range-based for loop.
+  template <typename Iterator>
+  class range_view
+  {
+  public:
+    range_view(Iterator first, Iterator last) : _first(first), _last(last) {}
+    Iterator begin() const { return _first; }
+    Iterator end() const { return _last; }
+    bool empty() const { return _first == _last; }
+  private:
+    Iterator _first;
+    Iterator _last;
+  };
+
+  // Create an empty tree whose nodes will be allocated with a copy of `alloc`.
+  explicit avltree(const Alloc& alloc = Alloc()) : _alloc(alloc), root(nullptr), _node_count(0),
+    _count_stale(false), _balance_slack(0), _out_of_balance(false) {}
+
+  // Create a tree holding the key-value pairs in [first, last), which must be sorted by key (if a
+  // key is repeated, the last of its values is kept). The tree is built directly in linear time.
+  // The elements are anything with `first` and `second` members, such as `std::pair<K, V>`.
+  template <typename ForwardIt>
+  avltree(ForwardIt first, ForwardIt last, const Alloc& alloc = Alloc()) : _alloc(alloc),
+    root(nullptr), _node_count(0), _count_stale(false), _balance_slack(0), _out_of_balance(false)
+  { assign_sorted(first, last); }
+
+  // Take the nodes of another tree, leaving it empty.
+  avltree(avltree&& other) : _alloc(other._alloc), root(other.root), _node_count(other._node_count),
+    _count_stale(other._count_stale), _compare(other._compare), _balance_slack(other._balance_slack),
+    _out_of_balance(other._out_of_balance)
+  {
+    other.root = nullptr;
+    other._node_count = 0;
+    other._count_stale = false;
+    other._out_of_balance = false;
+  }
+
+  // Copy another tree node for node in O(n). The copy has the same shape, balance factors and
+  // augmented data, so no keys are compared and nothing is rebalanced. Its allocator comes from
+  // `select_on_container_copy_construction`, which gives a `node_pool_allocator` a fresh pool.
+  avltree(const avltree& other);
+
+  // As above, allocating the copy's nodes with a copy of `alloc`.
+  avltree(const avltree& other, const Alloc& alloc);
+
+  // Replace the contents with a copy of another tree's, made as by the copy constructor.
+  avltree& operator=(const avltree& other);
+
+  // Swap nodes (and allocators) with another tree; ours are destroyed along with it.
+  avltree& operator=(avltree&& other);
+
+  // Destroy all the nodes in the tree, as `clear` does.
+  ~avltree() { clear(); }
+
+  // The allocator used for the tree's nodes.
+  Alloc get_allocator() const { return Alloc(_alloc); }
+
+  // The comparison policy ordering the keys.
+  Compare key_comp() const { return _compare; }
+
   // Add a key-value pair to the tree.
   //   K& key: The key.
   //   T& value: The value associated with the key.
   void insert(const K& key, const V& value);
 
+  // Add a key-value pair to the tree, forwarding them into the node: rvalues are moved rather
+  // than copied, including the value over the existing one if the key is already present. A key
+  // of another type (here and in `emplace` and `try_emplace`) is converted to K before searching.
+  template <typename KeyArg, typename ValueArg>
+  void insert(KeyArg&& key, ValueArg&& value);
+
+  // As `insert`, searching from the element at `hint`, an iterator into this tree, rather than from
+  // the root (`end()` starts from the last element). The search climbs from the hint only until the
+  // key's place is below it, then descends, so a key close to the hint in order costs a few
+  // comparisons instead of one per level; keys arriving in increasing order, each inserted with the
+  // iterator returned for the one before, find their place in O(1) comparisons. Any hint gives the
+  // right result. Returns an iterator to the element.
+  template <typename KeyArg, typename ValueArg>
+  iterator insert(const_iterator hint, KeyArg&& key, ValueArg&& value);
+
+  // Insert or overwrite the value stored under `key`, constructing it from `args`. When the key is
+  // new the value is built in place inside its node. Returns a pointer to the stored value and
+  // whether a new node was made.
+  template <typename KeyArg, typename... Args>
+  std::pair<V*, bool> emplace(KeyArg&& key, Args&&... args);
+
+  // Insert a value constructed from `args` under `key` only if the key isn't already present; if
+  // it is, nothing is constructed and the existing value is untouched. Returns a pointer to the
+  // stored value and whether a new node was made.
+  template <typename KeyArg, typename... Args>
+  std::pair<V*, bool> try_emplace(KeyArg&& key, Args&&... args);
+
   
   // Find the value associated with a given key. Returns an `optional` struct since the key isn't
   // guaranteed to be present in the tree.
   optional<V> get(const K& key) const;
 
+  // As `get`, but referring to the value stored in the tree rather than copying it. The reference
+  // stays valid until the key is removed.
+  template <typename Q>
+  optional<const V&> get_ref(const Q& key) const
+  {
+    const V* value = find(key);
+    return value ? optional<const V&>(*value) : optional<const V&>();
+  }
+
+  // Find the value associated with a given key without copying anything. Returns a pointer to the
+  // value stored in the tree, or nullptr if the key isn't present. The pointer stays valid until
+  // the key is removed.
+  V* find(const K& key) { return _find_value(key); }
+  const V* find(const K& key) const { return _find_value(key); }
+
+  // Heterogeneous lookup: find by any type Q which `Compare` can compare with K either way round
+  // (with `key_less`, using '<'; with `member_compare`, `compare`), e.g. `std::string_view` for a
+  // tree with `std::string` keys, without building a temporary K.
+  template <typename Q>
+  V* find(const Q& key) { return _find_value(key); }
+
+  // As `find`, searching from the element at `hint` as the hinted `insert` does.
+  template <typename Q>
+  V* find(const_iterator hint, const Q& key) { return _find_value_near(hint._node, key); }
+  template <typename Q>
+  const V* find(const_iterator hint, const Q& key) const { return _find_value_near(hint._node, key); }
+  template <typename Q>
+  const V* find(const Q& key) const { return _find_value(key); }
+
+
+  // Look up every key in [first, last), writing an `optional<V>` for each to `out` in order, as
+  // `get` would. Groups of searches advance together a level at a time, prefetching each one's
+  // next node, so that their cache misses overlap instead of following one another. Returns the
+  // output iterator past the last result.
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) const;
 
   // Remove node from the tree with given key. Doesn't matter if the node isn't there.
   void remove(const K& key);
 
+  // Remove the element at `position`, which must not be `end()`, without searching for its key.
+  // Returns an iterator to the element after it.
+  iterator erase(const_iterator position);
+
+  // Replace the contents of the tree with the key-value pairs in [first, last), sorted by key.
+  // A perfectly balanced tree is built in O(n) without any searching, rotating or retracing; if
+  // the allocator can reserve (like `node_pool_allocator`) the nodes are placed contiguously in
+  // key order. Should the input turn out not to be sorted, the rest of it is inserted one at a
+  // time from the first out-of-order key.
+  template <typename ForwardIt>
+  void assign_sorted(ForwardIt first, ForwardIt last);
+
+  // Insert (or overwrite) every key-value pair in [first, last); the elements are anything with
+  // `first` and `second` members. A batch sorted by key is merged into the tree in one descent:
+  // each node splits the batch between its two subtrees, only the subtrees that get keys are
+  // visited, and a subtree is rebalanced once after all its keys are in. That costs
+  // O(m log(n / m + 1)) for m keys rather than O(m log n). If a key is repeated, its last value is
+  // kept. Unsorted batches are inserted one at a time.
+  template <typename ForwardIt>
+  void insert_batch(ForwardIt first, ForwardIt last);
+
+  // Remove every key in [first, last) that is in the tree. A batch sorted by key is removed in one
+  // descent like `insert_batch`; an unsorted one one key at a time.
+  template <typename ForwardIt>
+  void erase_batch(ForwardIt first, ForwardIt last);
+
+  // Move every element of `right`, whose keys must all be above this tree's, onto the end of this
+  // tree, leaving `right` empty. Takes O(log n) if the trees' allocators are equal (the nodes just
+  // change hands), otherwise `right` is copied in first.
+  void join(avltree&& right);
+
+  // As above, with the element (key, value) in between, its key above this tree's keys and below
+  // `right`'s.
+  void join(const K& key, const V& value, avltree&& right);
+
+  // Move the elements with keys not less than `key` into a new tree, which is returned, and keep
+  // the rest. The nodes are relinked along one path in O(log n). An `order_statistics` tree reads
+  // the two sizes from its nodes; other trees don't know them, so the next `size()` of each tree
+  // counts its elements, in O(n).
+  template <typename Q>
+  avltree split(const Q& key);
+
+  // Set operations with another tree, which is left empty. A key in both trees keeps this tree's
+  // value. They split and join subtrees rather than searching for keys one by one, which costs
+  // O(m log(n / m + 1)) for trees of m and n >= m elements. As for `join`, if the allocators
+  // differ `other` is copied in first.
+  //   set_union         this tree gets the keys in either tree
+  //   set_intersection  this tree keeps the keys in both
+  //   set_difference    this tree keeps its keys which aren't in `other`
+  void set_union(avltree&& other);
+  void set_intersection(avltree&& other);
+  void set_difference(avltree&& other);
+
+  // Relax the balance for a burst of writes. With a slack of s > 0, a node's two sides may differ
+  // in height by up to 1 + s levels, rather than 1, before an insert or removal rotates it. Each
+  // rotation still fixes its node with a single or double rotation, so far fewer updates rotate.
+  // Searches may go a few levels deeper; the height stays O(s log n). `rebalance` restores strict
+  // AVL balance, and so does setting the slack back to 0, the default. Joins, splits, set
+  // operations and sorted batches rebalance the trees they are given first. The slack is capped at
+  // `max_balance_slack`.
+  void set_balance_slack(int slack);
+  int balance_slack() const { return _balance_slack; }
+  static const int max_balance_slack = 32;
+
+  // Restore strict AVL balance after relaxed updates. Each node out of balance is joined back
+  // together with its two subtrees, bottom-up, in O(1 + difference in their heights). If an update
+  // left the tree out of AVL balance since it was last balanced, this visits every node, in O(n).
+  // Otherwise it does nothing.
+  void rebalance();
+
+  // The number of elements in the tree, in O(1); except that the first call after a `split` of a
+  // tree without `order_statistics` counts them again, in O(n).
+  std::size_t size() const
+  {
+    if (_count_stale)
+    {
+      _node_count = _count_nodes(root, std::false_type());
+      _count_stale = false;
+    }
+    return _node_count;
+  }
+
+  // What the tree has done since it was made (or the stats were reset), if its tracing policy is
+  // `collect_stats`.
+  template <typename T = Tracer>
+  auto stats() const -> decltype(std::declval<const T&>().stats()) { return _tracer.stats(); }
+  template <typename T = Tracer>
+  auto reset_stats() -> decltype(std::declval<T&>().reset()) { _tracer.reset(); }
+
+  // Whether the tree has no elements.
+  bool empty() const { return !root; }
+
+  // Destroy every element, leaving the tree empty. When there is nothing to destroy in a node (K,
+  // V and the augmented data are trivially destructible) and the allocator can release all its
+  // memory at once, as a `node_pool_allocator` whose pool only this tree uses can, the nodes are
+  // dropped together instead of being freed one by one.
+  void clear();
+
+  // The number of keys in the tree less than `key`, in O(log n). Needs the `order_statistics`
+  // augmentation.
+  template <typename Q>
+  std::size_t rank(const Q& key) const;
+
+  // Call `visit(key, value)` on each element inserted or given a new value since the last call
+  // (or since the tree was made), in key order, and clear their marks. Only the subtrees holding
+  // such elements are walked, so k changes cost O(k log(n / k + 1)). Needs the `dirty_tracking`
+  // augmentation.
+  template <typename Visit>
+  void for_each_changed(Visit visit);
+
+  // The element with `index` smaller keys in the tree (the first is at 0), or `end()` if index is
+  // not less than `size()`, in O(log n). Needs the `order_statistics` augmentation.
+  iterator select(std::size_t index) { return iterator(_select_node(index), &root); }
+  const_iterator select(std::size_t index) const { return const_iterator(_select_node(index), &root); }
+
+  // The aggregate of the elements with keys in [lo, hi), in O(log n); the identity if there are
+  // none. Needs a `subtree_aggregate` augmentation.
+  template <typename Q, typename A = Augment>
+  typename A::value_type range_aggregate(const Q& lo, const Q& hi) const;
+
+  // Iterators to the element with the smallest key, and one past the largest.
+  iterator begin() { return iterator(_first_node(), &root); }
+  const_iterator begin() const { return const_iterator(_first_node(), &root); }
+  const_iterator cbegin() const { return begin(); }
+  iterator end() { return iterator(nullptr, &root); }
+  const_iterator end() const { return const_iterator(nullptr, &root); }
+  const_iterator cend() const { return end(); }
+
+  // The first element whose key is not less than `key`, or `end()` if there isn't one. Like `find`
+  // these take any key type Q comparable with K.
+  template <typename Q>
+  iterator lower_bound(const Q& key) { return iterator(_lower_bound_node(key), &root); }
+  template <typename Q>
+  const_iterator lower_bound(const Q& key) const { return const_iterator(_lower_bound_node(key), &root); }
+
+  // The first element whose key is greater than `key`, or `end()` if there isn't one.
+  template <typename Q>
+  iterator upper_bound(const Q& key) { return iterator(_upper_bound_node(key), &root); }
+  template <typename Q>
+  const_iterator upper_bound(const Q& key) const { return const_iterator(_upper_bound_node(key), &root); }
+
+  // The elements with a key equal to `key`: an empty range, or just the one.
+  template <typename Q>
+  std::pair<iterator, iterator> equal_range(const Q& key)
+  { return std::pair<iterator, iterator>(lower_bound(key), upper_bound(key)); }
+  template <typename Q>
+  std::pair<const_iterator, const_iterator> equal_range(const Q& key) const
+  { return std::pair<const_iterator, const_iterator>(lower_bound(key), upper_bound(key)); }
+
+  // The elements with keys in [lo, hi), in key order. Empty unless lo < hi.
+  template <typename Q>
+  range_view<iterator> range(const Q& lo, const Q& hi)
+  {
+    return _less(lo, hi) ? range_view<iterator>(lower_bound(lo), lower_bound(hi))
+                   : range_view<iterator>(end(), end());
+  }
+  template <typename Q>
+  range_view<const_iterator> range(const Q& lo, const Q& hi) const
+  {
+    return _less(lo, hi) ? range_view<const_iterator>(lower_bound(lo), lower_bound(hi))
+                   : range_view<const_iterator>(end(), end());
+  }
+
 protected:
 
+  // The two sides of a node, used to index its children.
+  enum { LEFT = 0, RIGHT = 1 };
+
+  // The balance factor a node has if its subtree on the given side is one level taller;
+  // LEFT_HEAVY for LEFT, RIGHT_HEAVY for RIGHT.
+  static int8_t _heavy(int side) { return static_cast<int8_t>(1 - 2 * side); }
+
   // A node in the tree, containing the key, some value, and pointers to the two children as well
   // as a `balance factor` used to keep the tree balanced (as an AVL tree).
   // `node` is an implementation detail, it shouldn't be returned or accessible by users of the
   // template.
-  struct node
+  // The tree owns its nodes; a node's children are owned through its links, and the parent link
+  // is just an observer (null for the root).
+  struct node : Augment::data
   {
-    // Create a new node with a given key and value, under given parent node.
-    node(K key, V value, shared_ptr<node> parent) : key(key), value(value), parent(parent),
+    // Create a new node under given parent node, with key and value constructed from the given
+    // arguments.
+    template <typename KeyArg, typename... Args>
+    node(node* parent, KeyArg&& key, Args&&... args) : key(std::forward<KeyArg>(key)),
+      value(std::forward<Args>(args)...), child{nullptr, nullptr}, parent(parent),
       balance_factor(0) {}
     // The key
     K key;
     V value;
-    shared_ptr<node> left_child;
-    shared_ptr<node> right_child;
-    weak_ptr<node> parent;
+    // The children, indexed by side: child[LEFT] and child[RIGHT].
+    node* child[2];
+    node* parent;
     int8_t balance_factor;
-  
-    // returns true if the node is the left child of its parent.
-    bool is_left_child() const;
 
-    // returns true if the node is the right child of its parent.
-    bool is_right_child() const;
+    // The side (LEFT or RIGHT) of its parent this node hangs from. Must not be called on the root.
+    // Found by comparing pointers, no keys are compared.
+    int side() const { return parent->child[RIGHT] == this; }
 
     // Get the sibling node of a parent or nullptr if there is none.
-    shared_ptr<node> sibling() const;
-
-    // Assuming tree is AVL and both children have correct balance factors...
-    void correct_balance();
-
-    friend void set_left_child(shared_ptr<node> parent_node, shared_ptr<node> child)
-    {
-      parent_node->left_child = child;
-      if (child) { child->parent = parent_node; }
-    }
+    node* sibling() const { return parent ? parent->child[!side()] : nullptr; }
 
-    friend void set_right_child(shared_ptr<node> parent_node, shared_ptr<node> child)
+    friend void set_child(node* parent_node, int side, node* child)
     {
-      parent_node->right_child = child;
+      parent_node->child[side] = child;
       if (child) { child->parent = parent_node; }
     }
   };
 
+  using node_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<node>;
+  using node_alloc_traits = std::allocator_traits<node_allocator>;
+
+  // The allocator nodes are made with.
+  node_allocator _alloc;
+
   // A pointer to the root `node` of the tree. If this is null, then the tree is empty.
-  shared_ptr<node> root;
+  node* root;
+
+  // The number of nodes in the tree, kept up to date by `_create_node` and `_destroy_node`. After
+  // a `split` of a tree which doesn't keep subtree sizes, it is stale (`_count_stale`) until `size()`
+  // counts the nodes again.
+  mutable std::size_t _node_count;
+  mutable bool _count_stale;
+
+  // This tree's tracing policy. Searches report to it too, hence mutable.
+  mutable Tracer _tracer;
+
+  // This tree's comparison policy.
+  Compare _compare;
+
+  // The balance slack, and whether relaxed updates may have left a node out of AVL balance.
+  int _balance_slack;
+  bool _out_of_balance;
+
+  // Whether `Compare` is a less-than predicate for A and B, rather than a three-way comparison.
+  template <typename A, typename B>
+  using _is_predicate = std::is_same<decltype(std::declval<const Compare&>()(std::declval<const A&>(),
+                                                                            std::declval<const B&>())), bool>;
+
+  // Negative, zero or positive as `a` is before, equivalent to or after `b`. One call to a
+  // three-way `Compare`; a predicate is called again, with the arguments swapped, when `a` isn't
+  // before `b`.
+  template <typename A, typename B>
+  int _order(const A& a, const B& b) const { return _order(a, b, _is_predicate<A, B>()); }
+  template <typename A, typename B>
+  int _order(const A& a, const B& b, std::true_type) const { return _compare(a, b) ? -1 : _compare(b, a); }
+  template <typename A, typename B>
+  int _order(const A& a, const B& b, std::false_type) const
+  {
+    const auto order = _compare(a, b);
+    return order < 0 ? -1 : order > 0;
+  }
+
+  // Whether `a` is before `b`, in one call to `Compare`.
+  template <typename A, typename B>
+  bool _less(const A& a, const B& b) const { return key_before(_compare, a, b); }
+
+  // Whether the nodes carry augmented data which must be kept up to date.
+  static const bool _augmented = !std::is_same<Augment, no_augmentation>::value;
+
+  // Note that `changed` has a new value: mark it, if the tree tracks changes, and update the
+  // augmented data from it up.
+  void _value_changed(node* changed)
+  {
+    _mark_changed(*changed, std::is_base_of<dirty_tracking, Augment>());
+    _update_path(changed);
+  }
+  static void _mark_changed(node& n, std::true_type) { n.changed = true; }
+  static void _mark_changed(node&, std::false_type) {}
+
+  // The in-order walk of `for_each_changed` below `subtree_root`.
+  template <typename Visit>
+  static void _visit_changed(node* subtree_root, Visit& visit);
+
+  // Recompute the augmented data of `changed` (may be null) and each of its ancestors, bottom-up.
+  static void _update_path(node* changed)
+  {
+    if (_augmented)
+      for (; changed; changed = changed->parent)
+        Augment::update(*changed);
+  }
+
+
+  // Allocate and construct a node with the tree's allocator.
+  template <typename... Args>
+  node* _create_node(node* parent, Args&&... args);
+
+  // Destroy and deallocate a single node; its children are untouched.
+  void _destroy_node(node* dead_node);
+
+  // Destroy every node in the subtree rooted at `subtree_root`. The count goes down by one for
+  // each; nothing else about the tree changes, since `root` may point anywhere in the middle of a
+  // set operation.
+  void _destroy_subtree(node* subtree_root);
+
+  // Destroy every node of the tree, leaving it empty.
+  void _destroy_all()
+  {
+    _destroy_subtree(root);
+    root = nullptr;
+    _node_count = 0;
+    _count_stale = false;
+    _out_of_balance = false;
+  }
+
+  // Copy the subtree rooted at `subtree_root` (may be null) into nodes of this tree, keeping the
+  // balance factors and augmented data. Returns the copy's root, which has no parent.
+  node* _copy_subtree(const node* subtree_root);
+
+  // The key an insertion stores and searches with: `key` itself if it is a K, otherwise a K made
+  // from it. Searching with anything else could find a place, or a match, for a different key from
+  // the one stored (an `int` tree given 3.5, say).
+  template <typename KeyArg>
+  static typename std::conditional<std::is_same<typename std::decay<KeyArg>::type, K>::value, KeyArg&&, K>::type
+  _stored_key(KeyArg&& key)
+  {
+    using stored = typename std::conditional<std::is_same<typename std::decay<KeyArg>::type, K>::value,
+                                             KeyArg&&, K>::type;
+    return static_cast<stored>(std::forward<KeyArg>(key));
+  }
+
+  // Insert a node for `key` with a value constructed from `args` if the key isn't present. Returns
+  // the node with that key and whether it is new. The arguments are only used if it is.
+  template <typename KeyArg, typename... Args>
+  std::pair<node*, bool> _try_emplace_node(KeyArg&& key, Args&&... args)
+  {
+    auto&& stored = _stored_key(std::forward<KeyArg>(key));
+    int order;
+    node* target = _node_search(stored, order);
+    return _try_emplace_at(target, order, std::forward<decltype(stored)>(stored), std::forward<Args>(args)...);
+  }
+
+  // The rest of `_try_emplace_node` once the key has been searched for: `target` and `order` are
+  // what the search returned.
+  template <typename KeyArg, typename... Args>
+  std::pair<node*, bool> _try_emplace_at(node* target, int order, KeyArg&& key, Args&&... args);
+
+  // Unlink `target` from the tree, rebalance, and destroy it.
+  void _remove_node(node* target);
+
+  // Merge the sorted key-value pairs [first, last) into `subtree_root`, a detached subtree (no
+  // parent) of the given height. Returns the new subtree root; `new_height` gets its height.
+  template <typename ForwardIt>
+  node* _merge_insert(node* subtree_root, int height, ForwardIt first, ForwardIt last, int& new_height);
+
+  // As `_merge_insert`, removing the sorted keys [first, last) instead.
+  template <typename ForwardIt>
+  node* _merge_erase(node* subtree_root, int height, ForwardIt first, ForwardIt last, int& new_height);
+
+  // Remove the nodes `doomed(n)` picks from `subtree_root`, a detached subtree of the given height
+  // whose root `search(n)` accepts, looking only into the subtrees whose roots `search` accepts
+  // too. `doomed` sees the nodes searched in key order, and is told of each node before it is
+  // destroyed. The rest are joined back together as in `_merge_erase`, so removing k nodes costs
+  // O(k log(n / k + 1)) when `search` rejects the subtrees without any to remove. Returns the new
+  // subtree root; `new_height` gets its height.
+  template <typename Search, typename Doomed>
+  node* _erase_where(node* subtree_root, int height, Search& search, Doomed& doomed, int& new_height);
+
+  // Join two subtrees of the given heights (either may be empty) and `pivot`, whose key is above
+  // every key in `left` and below every key in `right`, into one balanced subtree. Each subtree is
+  // either detached or already that child of the pivot. Returns the root of the result; `height`
+  // gets its height. Takes O(1 + difference in heights) steps. Rotations at the top of a detached
+  // subtree set `root`, so callers reset it afterwards.
+  node* _join(node* left, int left_height, node* pivot, node* right, int right_height, int& height);
 
+  // As `_join`, without a pivot.
+  node* _join(node* left, int left_height, node* right, int right_height, int& height);
+
+  // Unlink the node with the largest key from the detached, non-empty subtree `subtree_root` of
+  // the given height and return it, updating `subtree_root` and `height` to the rest of it.
+  node* _split_last(node*& subtree_root, int& height);
+
+  // Split the detached subtree of the given height around `key`, into the subtrees of smaller and
+  // larger keys and their heights. Returns the node with the key, detached, if there is one.
+  template <typename Q>
+  node* _split(node* subtree_root, int height, const Q& key, node*& left, int& left_height, node*& right,
+               int& right_height);
+
+  // The set operations on two detached subtrees of the given heights, `a`'s nodes winning ties.
+  // Unused nodes are destroyed. Return the root of the result; `height` gets its height.
+  node* _union(node* a, int a_height, node* b, int b_height, int& height);
+  node* _intersection(node* a, int a_height, node* b, int b_height, int& height);
+  node* _difference(node* a, int a_height, node* b, int b_height, int& height);
+
+  // Take every node of `other`, leaving it empty, and return its detached root (with its height),
+  // adding the nodes to this tree's count. If the allocators differ, the nodes are copies.
+  node* _take_nodes(avltree& other, int& height);
+
+  // The number of nodes in a subtree; read off the root for `order_statistics` trees.
+  // Share the count between this tree and `right`, the part split off into another tree: from the
+  // subtree sizes if there are any, otherwise by leaving both for `size()` to count.
+  void _count_split(avltree& right, std::true_type)
+  {
+    right._node_count = _count_nodes(right.root, std::true_type());
+    _node_count -= right._node_count;
+  }
+  void _count_split(avltree& right, std::false_type) { _count_stale = right._count_stale = true; }
+
+  static std::size_t _count_nodes(const node* subtree_root, std::true_type)
+  { return order_statistics::size_of(subtree_root); }
+  static std::size_t _count_nodes(const node* subtree_root, std::false_type)
+  {
+    return subtree_root ? 1 + _count_nodes(subtree_root->child[LEFT], std::false_type())
+                            + _count_nodes(subtree_root->child[RIGHT], std::false_type()) : 0;
+  }
+
+  // Detach and return a node's child on one side (may be null).
+  static node* _take_child(node* parent_node, int side);
+
+  // The height of a subtree, read off the balance factors along one path.
+  static int _height(node* subtree_root);
+
+  // The height of a node's subtree on one side, given the height of the node's own subtree.
+  static int _child_height(const node* parent_node, int height, int side)
+  { return height - 1 - std::max(0, -_heavy(side) * parent_node->balance_factor); }
+
+  // Link nodes[0..count), sorted by key, into a perfectly balanced subtree under `parent`, setting
+  // the balance factors on the way. Returns the subtree root; `height` gets the subtree height.
+  static node* _build_balanced(node* const* nodes, std::size_t count, node* parent, int& height);
+
+  // The retrace under relaxed balance: the height of the subtree on `side` of `parent` changed by
+  // `delta`. The balance factors are updated on the way up, rotating a node past the slack.
+  void _relaxed_retrace(node* parent, int side, int delta);
+
+  // How much the height of the subtree rooted at `subtree_root` changes if it is rotated to
+  // `side`, worked out from its balance factor and that of the child coming up.
+  static int _rotated_height_change(const node* subtree_root, int side);
+
+  // `rebalance` below `subtree_root`; `height` gets the subtree's height.
+  void _rebalance(node* subtree_root, int& height);
+
+  // Ask the allocator to set aside room for `count` nodes, if it knows how.
+  template <typename A>
+  static auto _reserve_nodes(A& alloc, std::size_t count, int) -> decltype(alloc.reserve(count), void())
+  { alloc.reserve(count); }
+  template <typename A>
+  static void _reserve_nodes(A&, std::size_t, long) {}
+
+  // Ask the allocator to release all its memory at once, if the nodes don't need destroying
+  // (`trivial`) and it knows how. Returns whether it did.
+  template <typename A>
+  static auto _release_nodes(A& alloc, std::true_type, int) -> decltype(alloc.release_all())
+  { return alloc.release_all(); }
+  template <typename A, typename Trivial>
+  static bool _release_nodes(A&, Trivial, long) { return false; }
+
+  // Put `new_child` (may be null) where `old_child` hangs from its parent, or at the root.
+  void _replace_child(node* old_child, node* new_child);
+
+  // The number of searches `get_many` runs together; enough to cover a miss to main memory.
+  static const std::size_t _search_lanes = 32;
+
+  // Start fetching the node into cache, where the compiler allows.
+  static void _prefetch(const node* n)
+  {
+#if defined(__GNUC__)
+    __builtin_prefetch(n);
+#else
+    (void)n;
+#endif
+  }
 
   // Find a node with the given key; a helper for insertion, retrieval and removal.
   // Returns:
   //   1. If the tree is empty --> null pointer.
   //   2. If the key exists --> A pointer to the node with that key.
   //   2. If the key doesn't exist, but the tree isn't empty --> a pointer to its parent.
-  shared_ptr<node> _node_search(K key) const;
+  // `order` gets the key's order against the node returned (as `_order`): zero if it was found,
+  // otherwise the side of the node the key would go on, so callers needn't compare again.
+  template <typename Q>
+  node* _node_search(const Q& key, int& order) const;
+
+  // As `_node_search`, starting from `finger` (any node of the tree; the last node if null) rather
+  // than the root. Climbs from the finger to the lowest node whose subtree must hold the key's
+  // place, comparing only with the nodes it ascends to from the near side, then descends.
+  template <typename Q>
+  node* _finger_search(node* finger, const Q& key, int& order) const;
+
+  // `_find_value` by a finger search.
+  template <typename Q>
+  V* _find_value_near(node* finger, const Q& key) const
+  {
+    int order;
+    node* found_node = _finger_search(finger, key, order);
+    return found_node && order == 0 ? &found_node->value : nullptr;
+  }
+
+  // The value stored under the given key, or nullptr if there isn't one.
+  template <typename Q>
+  V* _find_value(const Q& key) const;
+
+  // The nodes `lower_bound` and `upper_bound` return iterators to; nullptr for `end()`.
+  template <typename Q>
+  node* _lower_bound_node(const Q& key) const;
+  template <typename Q>
+  node* _upper_bound_node(const Q& key) const;
+
+  // The node `select` returns an iterator to.
+  node* _select_node(std::size_t index) const;
+
+  // The node with the smallest key, or nullptr if the tree is empty.
+  node* _first_node() const { return root ? _outermost(root, LEFT) : nullptr; }
+
+  // The node furthest down the given side of a subtree: the one with its smallest key for LEFT, its
+  // largest for RIGHT.
+  static node* _outermost(node* subtree_root, int side);
+
+  // The node with the next key towards `side` (the next larger key for RIGHT, the next smaller one
+  // for LEFT), or nullptr if there isn't one.
+  static node* _step(node* current, int side);
 
 
   // After insertion retrace from this node back to the root, check for imbalance and correct it.
-  void _retrace_insertion(shared_ptr<node> inserted_node);
+  void _retrace_insertion(node* inserted_node);
   
   // After deletion retrace from this node back to the root, check for imbalance and correct it.
-  // The balance_factor_change argument indicates which side the child of the subtree root had
-  // a child removed.
-  void _retrace_deletion(shared_ptr<node> subtree_root, int8_t balance_factor_change);
+  // `shortened_side` is the side of subtree_root whose subtree lost a level.
+  void _retrace_deletion(node* subtree_root, int shortened_side);
+
+  // Rotate the subtree rooted at old_subtree_root so that it moves down to the given side, and
+  // its child on the other side takes its place. Returns a pointer to the new root of the
+  // subtree. A LEFT rotation is a left rotation, a RIGHT rotation a right rotation.
+  node* _rotate(node* old_subtree_root, int side);
+
+  // Rotate the child of old_subtree_root on the far side away from `side`, then old_subtree_root
+  // towards `side`. Returns a pointer to the new root of the subtree. A RIGHT double rotation is a
+  // left-right rotation, a LEFT double rotation a right-left rotation.
+  node* _double_rotate(node* old_subtree_root, int side);
+
+  // Perform a left rotation to rebablance a subtree rooted at old_subtree_root, returning
+  // a pointer to the new root of the subtree.
+  node* _left_rotate(node* old_subtree_root) { return _rotate(old_subtree_root, LEFT); }
+
+  // Perform a right rotation to rebablance a subtree rooted at old_subtree_root, returning
+  // a pointer to the new root of the subtree.
+  node* _right_rotate(node* old_subtree_root) { return _rotate(old_subtree_root, RIGHT); }
+
+  // Perform a left-right rotation to rebablance a subtree rooted at old_subtree_root, returning
+  // a pointer to the new root of the subtree.
+  node* _left_right_rotate(node* old_subtree_root) { return _double_rotate(old_subtree_root, RIGHT); }
+
+  // Perform a right-left rotation to rebablance a subtree rooted at old_subtree_root, returning
+  // a pointer to the new root of the subtree.
+  node* _right_left_rotate(node* old_subtree_root) { return _double_rotate(old_subtree_root, LEFT); }
+
+  // The test_helper class contains some meta functionality to check the implementation is valid.
+  template <typename, typename> friend class test_helper;
+
+  template <typename> friend class parallel_avltree;
+
+  template <typename, typename, typename, typename> friend class bounded_avltree;
+};
+
+
+
+// ============================================================================================ //
+// |                                  `avltree` iterators                                     | //
+// ============================================================================================ //
+
+// An iterator holds the node it is at (nullptr at the end) and where the tree keeps its root, so
+// that stepping back from the end can find the last node. Steps follow the child and parent links.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <bool Const>
+class avltree<K, V, Alloc, Augment, Tracer, Compare>::basic_iterator
+{
+public:
+  using mapped_type = typename std::conditional<Const, const V, V>::type;
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = std::pair<const K, V>;
+  using difference_type = std::ptrdiff_t;
+  using reference = std::pair<const K&, mapped_type&>;
+
+  // `operator->` hands out a pointer to a temporary pair of references.
+  struct pointer
+  {
+    reference element;
+    const reference* operator->() const { return &element; }
+  };
+
+  basic_iterator() : _node(nullptr), _root(nullptr) {}
+
+  // A `const_iterator` can be made from an `iterator`.
+  template <bool OtherConst, typename = typename std::enable_if<Const && !OtherConst>::type>
+  basic_iterator(const basic_iterator<OtherConst>& other) : _node(other._node), _root(other._root) {}
+
+  reference operator*() const { return reference(_node->key, _node->value); }
+  pointer operator->() const { return pointer{**this}; }
+
+  // The key and value of the element, without building a pair.
+  const K& key() const { return _node->key; }
+  mapped_type& value() const { return _node->value; }
+
+  basic_iterator& operator++()
+  {
+    _node = _step(_node, RIGHT);
+    return *this;
+  }
+  basic_iterator& operator--()
+  {
+    _node = _node ? _step(_node, LEFT) : _outermost(*_root, RIGHT);
+    return *this;
+  }
+  basic_iterator operator++(int) { basic_iterator old = *this; ++*this; return old; }
+  basic_iterator operator--(int) { basic_iterator old = *this; --*this; return old; }
+
+  friend bool operator==(const basic_iterator& a, const basic_iterator& b) { return a._node == b._node; }
+  friend bool operator!=(const basic_iterator& a, const basic_iterator& b) { return a._node != b._node; }
+
+private:
+  friend class avltree;
+  template <bool> friend class basic_iterator;
+
+  basic_iterator(node* at, node* const* root_link) : _node(at), _root(root_link) {}
+
+  node* _node;
+  node* const* _root;
+};
+
+
+
+// ============================================================================================ //
+// |                              `avltree` method definitions                                | //
+// ============================================================================================ //
+
+// Reserve room for every node first, so a pool hands them out from one block.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+avltree<K, V, Alloc, Augment, Tracer, Compare>::avltree(const avltree& other) :
+  _alloc(node_alloc_traits::select_on_container_copy_construction(other._alloc)), root(nullptr),
+  _node_count(0), _count_stale(false), _compare(other._compare), _balance_slack(other._balance_slack),
+  _out_of_balance(other._out_of_balance)
+{
+  _reserve_nodes(_alloc, other.size(), 0);
+  root = _copy_subtree(other.root);
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+avltree<K, V, Alloc, Augment, Tracer, Compare>::avltree(const avltree& other, const Alloc& alloc) :
+  _alloc(alloc), root(nullptr), _node_count(0), _count_stale(false), _compare(other._compare),
+  _balance_slack(other._balance_slack), _out_of_balance(other._out_of_balance)
+{
+  _reserve_nodes(_alloc, other.size(), 0);
+  root = _copy_subtree(other.root);
+}
+
+// Copy, then swap the copy in, so our old nodes are destroyed along with it.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+avltree<K, V, Alloc, Augment, Tracer, Compare>& avltree<K, V, Alloc, Augment, Tracer, Compare>::operator=(const avltree& other)
+{
+  if (this != &other)
+    *this = avltree(other);
+  return *this;
+}
+
+// Move-assign by swapping, so our old nodes are destroyed along with the other tree.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+avltree<K, V, Alloc, Augment, Tracer, Compare>& avltree<K, V, Alloc, Augment, Tracer, Compare>::operator=(avltree&& other)
+{
+  std::swap(_alloc, other._alloc);
+  std::swap(root, other.root);
+  std::swap(_node_count, other._node_count);
+  std::swap(_count_stale, other._count_stale);
+  std::swap(_compare, other._compare);
+  std::swap(_balance_slack, other._balance_slack);
+  std::swap(_out_of_balance, other._out_of_balance);
+  return *this;
+}
+
+// Insert a node with a given key, or overwrite the value if the key exists.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::insert(const K& key, const V& value)
+{
+  std::pair<node*, bool> result = _try_emplace_node(key, value);
+  if (!result.second)  // The key exists already, we update its value.
+  {
+    result.first->value = value;
+    _value_changed(result.first);
+  }
+}
+
+// Insert a node with a given key forwarding the arguments, or forward the value over an existing
+// one.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename KeyArg, typename ValueArg>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::insert(KeyArg&& key, ValueArg&& value)
+{
+  std::pair<node*, bool> result = _try_emplace_node(std::forward<KeyArg>(key),
+                                                    std::forward<ValueArg>(value));
+  if (!result.second)  // The key exists already, only the value was left to assign.
+  {
+    result.first->value = std::forward<ValueArg>(value);
+    _value_changed(result.first);
+  }
+}
+
+// As the unhinted `insert`, with a finger search.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename KeyArg, typename ValueArg>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::iterator
+avltree<K, V, Alloc, Augment, Tracer, Compare>::insert(const_iterator hint, KeyArg&& key, ValueArg&& value)
+{
+  auto&& stored = _stored_key(std::forward<KeyArg>(key));
+  int order;
+  node* target = _finger_search(hint._node, stored, order);
+  std::pair<node*, bool> result = _try_emplace_at(target, order, std::forward<decltype(stored)>(stored),
+                                                  std::forward<ValueArg>(value));
+  if (!result.second)
+  {
+    result.first->value = std::forward<ValueArg>(value);
+    _value_changed(result.first);
+  }
+  return iterator(result.first, &root);
+}
+
+// Insert a node with a value built in place, or replace the value of an existing node.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename KeyArg, typename... Args>
+std::pair<V*, bool> avltree<K, V, Alloc, Augment, Tracer, Compare>::emplace(KeyArg&& key, Args&&... args)
+{
+  std::pair<node*, bool> result = _try_emplace_node(std::forward<KeyArg>(key),
+                                                    std::forward<Args>(args)...);
+  if (!result.second)  // The arguments haven't been used, build the replacement value from them.
+  {
+    result.first->value = V(std::forward<Args>(args)...);
+    _value_changed(result.first);
+  }
+  return std::pair<V*, bool>(&result.first->value, result.second);
+}
+
+// Insert a node with a value built in place, unless the key exists already.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename KeyArg, typename... Args>
+std::pair<V*, bool> avltree<K, V, Alloc, Augment, Tracer, Compare>::try_emplace(KeyArg&& key, Args&&... args)
+{
+  std::pair<node*, bool> result = _try_emplace_node(std::forward<KeyArg>(key),
+                                                    std::forward<Args>(args)...);
+  return std::pair<V*, bool>(&result.first->value, result.second);
+}
+
+// Get (maybe) a node with a given key.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+optional<V> avltree<K, V, Alloc, Augment, Tracer, Compare>::get(const K& key) const
+{
+  int order;
+  node* found_node = _node_search(key, order);
+  if (found_node && order == 0)
+    return optional<V>(found_node->value);
+  return optional<V>();
+}
+
+// Remove a node with given key from the tree
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::remove(const K& key)
+{
+  int order;
+  node* target = _node_search(key, order);
+  // does the target node exist?
+  if (target && order == 0)
+    _remove_node(target);
+}
+
+// The successor is found before the node goes; removal relinks nodes without moving any, so it
+// stays where it is.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::iterator
+avltree<K, V, Alloc, Augment, Tracer, Compare>::erase(const_iterator position)
+{
+  node* next = _step(position._node, RIGHT);
+  _remove_node(position._node);
+  return iterator(next, &root);
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_remove_node(node* target)
+{
+  // removed node has 2 children?
+  if (target->child[LEFT] && target->child[RIGHT])
+  {
+    _tracer.trace("remove: node has two children, replacing it with its successor");
+    // find in-order successor (node with smallest key that is > than this key)
+    node* successor = _outermost(target->child[RIGHT], LEFT);
+
+    // The successor's node is moved into the removed node's position, so no keys or values are
+    // copied. It has at most a right child (if it had left-child, it wouldn't be in-order
+    // successor!), which takes its old place.
+    node* retrace_from;
+    int shortened_side;
+    if (successor->parent == target)
+    {
+      _tracer.trace("remove: successor is the right child, moving it up");
+      retrace_from = successor;
+      shortened_side = RIGHT;
+    }
+    else
+    {
+      _tracer.trace("remove: reseating the successor's right child where the successor lived");
+      retrace_from = successor->parent;
+      shortened_side = LEFT;
+      set_child(successor->parent, LEFT, successor->child[RIGHT]);
+      set_child(successor, RIGHT, target->child[RIGHT]);
+    }
+    set_child(successor, LEFT, target->child[LEFT]);
+    successor->balance_factor = target->balance_factor;
+    _replace_child(target, successor);
+    _retrace_deletion(retrace_from, shortened_side);
+    _update_path(retrace_from);
+  }
+  else
+  {
+    // The node has at most one child, which is moved into its position.
+    node* orphan = target->child[target->child[LEFT] ? LEFT : RIGHT];
+    node* parent = target->parent;
+    if (!parent)  // If the root is being deleted, the orphan (if any) becomes the new root.
+    {
+      _tracer.trace("remove: node was the root, its child is the new root");
+      _replace_child(target, orphan);
+    }
+    else
+    {
+      _tracer.trace("remove: node has at most one child, retracing from its parent");
+      const int side = target->side();
+      set_child(parent, side, orphan);
+      _retrace_deletion(parent, side);
+      _update_path(parent);
+    }
+  }
+  _destroy_node(target);
+}
+
+// Build a balanced tree from sorted input: make the nodes in key order, then link them up.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::assign_sorted(ForwardIt first, ForwardIt last)
+{
+  _destroy_all();
+  const std::size_t count = static_cast<std::size_t>(std::distance(first, last));
+  if (count == 0)
+    return;
+  _reserve_nodes(_alloc, count, 0);
+  std::vector<node*> nodes;
+  nodes.reserve(count);
+  for (; first != last; ++first)
+  {
+    const int order = nodes.empty() ? 1 : _order(first->first, nodes.back()->key);
+    if (order <= 0)
+    {
+      if (order == 0)  // repeated key, the later value wins
+      {
+        nodes.back()->value = first->second;
+        continue;
+      }
+      break;  // out of order, fall back to inserting the rest
+    }
+    nodes.push_back(_create_node(nullptr, first->first, first->second));
+  }
+  int height;
+  root = _build_balanced(nodes.data(), nodes.size(), nullptr, height);
+  for (; first != last; ++first)
+    insert(first->first, first->second);
+}
+
+// Apply a batch of insertions: merged in one descent if sorted, otherwise one at a time.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::insert_batch(ForwardIt first, ForwardIt last)
+{
+  using element = typename std::iterator_traits<ForwardIt>::value_type;
+  if (!std::is_sorted(first, last, [this](const element& a, const element& b) { return _less(a.first, b.first); }))
+  {
+    for (; first != last; ++first)
+      insert(first->first, first->second);
+    return;
+  }
+  // The merge works on detached subtrees, the whole tree included.
+  rebalance();
+  node* subtree_root = root;
+  int height;
+  subtree_root = _merge_insert(subtree_root, _height(subtree_root), first, last, height);
+  root = subtree_root;
+}
+
+// Apply a batch of removals: merged in one descent if sorted, otherwise one at a time.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::erase_batch(ForwardIt first, ForwardIt last)
+{
+  using element = typename std::iterator_traits<ForwardIt>::value_type;
+  if (!std::is_sorted(first, last, [this](const element& a, const element& b) { return _less(a, b); }))
+  {
+    for (; first != last; ++first)
+      remove(*first);
+    return;
+  }
+  rebalance();
+  node* subtree_root = root;
+  int height;
+  subtree_root = _merge_erase(subtree_root, _height(subtree_root), first, last, height);
+  root = subtree_root;
+}
+
+// Split the batch around the subtree root's key, merge each part into the matching subtree, then
+// join the two results back together under the root. A subtree with no keys for it is left linked
+// to the root and never visited. An empty subtree with keys for it gets the batch's middle key as
+// its root, so a run of new keys comes out balanced.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_merge_insert(node* subtree_root, int height, ForwardIt first, ForwardIt last,
+                                   int& new_height)
+{
+  using element = typename std::iterator_traits<ForwardIt>::value_type;
+  if (first == last)
+  {
+    new_height = height;
+    return subtree_root;
+  }
+
+  ForwardIt lower, upper;  // the batch keys equal to the subtree root's are [lower, upper)
+  if (!subtree_root)
+  {
+    const ForwardIt middle = std::next(first, (std::distance(first, last) - 1) / 2);
+    lower = std::partition_point(first, middle,
+                                 [&](const element& e) { return _less(e.first, middle->first); });
+    upper = std::partition_point(middle, last,
+                                 [&](const element& e) { return !_less(middle->first, e.first); });
+    subtree_root = _create_node(nullptr, middle->first, std::prev(upper)->second);
+    height = 1;
+  }
+  else
+  {
+    const K& key = subtree_root->key;
+    lower = std::partition_point(first, last, [&](const element& e) { return _less(e.first, key); });
+    upper = lower;
+    while (upper != last && !_less(key, upper->first))
+      ++upper;
+    if (lower != upper)  // The key exists already, we update its value with the last one given.
+    {
+      subtree_root->value = std::prev(upper)->second;
+      _mark_changed(*subtree_root, std::is_base_of<dirty_tracking, Augment>());  // `_join` updates it
+    }
+  }
+
+  int left_height = _child_height(subtree_root, height, LEFT);
+  int right_height = _child_height(subtree_root, height, RIGHT);
+  node* left = subtree_root->child[LEFT];
+  node* right = subtree_root->child[RIGHT];
+  if (first != lower)
+    left = _merge_insert(_take_child(subtree_root, LEFT), left_height, first, lower, left_height);
+  if (upper != last)
+    right = _merge_insert(_take_child(subtree_root, RIGHT), right_height, upper, last, right_height);
+  return _join(left, left_height, subtree_root, right, right_height, new_height);
+}
+
+// As `_merge_insert`; a subtree root whose key is in the batch is destroyed and its two merged
+// subtrees joined without it.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_merge_erase(node* subtree_root, int height, ForwardIt first, ForwardIt last,
+                                  int& new_height)
+{
+  using element = typename std::iterator_traits<ForwardIt>::value_type;
+  if (first == last || !subtree_root)
+  {
+    new_height = height;
+    return subtree_root;
+  }
+
+  const K& key = subtree_root->key;
+  const ForwardIt lower = std::partition_point(first, last, [&](const element& e) { return _less(e, key); });
+  ForwardIt upper = lower;
+  while (upper != last && !_less(key, *upper))
+    ++upper;
+
+  int left_height = _child_height(subtree_root, height, LEFT);
+  int right_height = _child_height(subtree_root, height, RIGHT);
+  node* left = subtree_root->child[LEFT];
+  node* right = subtree_root->child[RIGHT];
+  if (first != lower)
+    left = _merge_erase(_take_child(subtree_root, LEFT), left_height, first, lower, left_height);
+  if (upper != last)
+    right = _merge_erase(_take_child(subtree_root, RIGHT), right_height, upper, last, right_height);
+  if (lower != upper)
+  {
+    _take_child(subtree_root, LEFT);
+    _take_child(subtree_root, RIGHT);
+    _destroy_node(subtree_root);
+    return _join(left, left_height, right, right_height, new_height);
+  }
+  return _join(left, left_height, subtree_root, right, right_height, new_height);
+}
+
+// A child which `search` rejects stays linked to its parent, and is never visited.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Search, typename Doomed>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_erase_where(node* subtree_root, int height, Search& search,
+                                                              Doomed& doomed, int& new_height)
+{
+  int left_height = _child_height(subtree_root, height, LEFT);
+  int right_height = _child_height(subtree_root, height, RIGHT);
+  node* left = subtree_root->child[LEFT];
+  node* right = subtree_root->child[RIGHT];
+  if (left && search(*left))
+    left = _erase_where(_take_child(subtree_root, LEFT), left_height, search, doomed, left_height);
+  const bool remove_root = doomed(*subtree_root);
+  if (right && search(*right))
+    right = _erase_where(_take_child(subtree_root, RIGHT), right_height, search, doomed, right_height);
+  if (remove_root)
+  {
+    _take_child(subtree_root, LEFT);
+    _take_child(subtree_root, RIGHT);
+    _destroy_node(subtree_root);
+    return _join(left, left_height, right, right_height, new_height);
+  }
+  return _join(left, left_height, subtree_root, right, right_height, new_height);
+}
+
+// If the heights are close the pivot simply takes both subtrees. Otherwise it goes down the inner
+// edge of the taller subtree to the first node no more than one level taller than the shorter
+// subtree, takes that node's place with it and the shorter subtree as children, and the taller
+// subtree is retraced as after an insertion from there.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_join(node* left, int left_height, node* pivot, node* right, int right_height,
+                            int& height)
+{
+  pivot->parent = nullptr;
+  if (std::abs(left_height - right_height) <= 1)
+  {
+    // A subtree still hanging from the pivot is left alone, saving a write to a node nobody read.
+    if (pivot->child[LEFT] != left)
+      set_child(pivot, LEFT, left);
+    if (pivot->child[RIGHT] != right)
+      set_child(pivot, RIGHT, right);
+    pivot->balance_factor = static_cast<int8_t>(left_height - right_height);
+    height = 1 + std::max(left_height, right_height);
+    Augment::update(*pivot);
+    return pivot;
+  }
+
+  const int side = (left_height > right_height) ? LEFT : RIGHT;  // the taller subtree's side
+  node* const taller = side == LEFT ? left : right;
+  node* const shorter = side == LEFT ? right : left;
+  const int taller_height = std::max(left_height, right_height);
+  const int shorter_height = std::min(left_height, right_height);
+  taller->parent = nullptr;
+
+  node* parent;
+  node* current = taller;
+  int current_height = taller_height;
+  do
+  {
+    parent = current;
+    current_height = _child_height(current, current_height, !side);
+    current = current->child[!side];
+  } while (current_height > shorter_height + 1);
+
+  // current_height is shorter_height or one more, so the pivot's subtree is one level taller than
+  // the one it replaces.
+  set_child(pivot, side, current);
+  set_child(pivot, !side, shorter);
+  pivot->balance_factor = static_cast<int8_t>(_heavy(side) * (current_height - shorter_height));
+  set_child(parent, !side, pivot);
+  Augment::update(*pivot);
+
+  // Retrace the growth. Unlike after an insertion, the child being rotated up may be balanced, in
+  // which case the rotated subtree is still a level taller and the retrace goes on.
+  for (current = pivot; current->parent; )
+  {
+    parent = current->parent;
+    const int grown_side = current->side();
+    const int8_t heavy = _heavy(grown_side);
+    parent->balance_factor += heavy;
+    if (parent->balance_factor == BALANCED)
+      break;
+    else if (parent->balance_factor == heavy)
+    {
+      current = parent;
+      continue;
+    }
+    if (current->balance_factor == -heavy)
+      current = _double_rotate(parent, !grown_side);
+    else
+      current = _rotate(parent, !grown_side);
+    if (current->balance_factor == BALANCED)
+      break;
+  }
+  const bool grew = !current->parent && current->balance_factor != BALANCED;
+  _update_path(pivot);
+  while (current->parent)
+    current = current->parent;
+  height = taller_height + (grew ? 1 : 0);
+  return current;
+}
+
+// Use the largest node of the left subtree as the pivot.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_join(node* left, int left_height, node* right, int right_height, int& height)
+{
+  if (!left)
+  {
+    height = right_height;
+    return right;
+  }
+  if (!right)
+  {
+    height = left_height;
+    return left;
+  }
+  node* pivot = _split_last(left, left_height);
+  return _join(left, left_height, pivot, right, right_height, height);
+}
+
+// Take the right tree's nodes, then a pivot-less join, or a join around a new node.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::join(avltree&& right)
+{
+  rebalance();
+  int left_height = _height(root);
+  int right_height;
+  node* right_root = _take_nodes(right, right_height);
+  int height;
+  node* joined = _join(root, left_height, right_root, right_height, height);
+  root = joined;
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::join(const K& key, const V& value, avltree&& right)
+{
+  rebalance();
+  int left_height = _height(root);
+  int right_height;
+  node* right_root = _take_nodes(right, right_height);
+  node* left_root = root;
+  node* pivot = _create_node(nullptr, key, value);
+  int height;
+  node* joined = _join(left_root, left_height, pivot, right_root, right_height, height);
+  root = joined;
+}
+
+// Split the whole tree, put the node with the key (if any) back at the start of the right part,
+// and hand the right part to a new tree. The part's count is read from the subtree sizes if there
+// are any; otherwise both counts are left for `size()` to redo, so the split stays O(log n).
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+avltree<K, V, Alloc, Augment, Tracer, Compare> avltree<K, V, Alloc, Augment, Tracer, Compare>::split(const Q& key)
+{
+  rebalance();
+  avltree result(_alloc);
+  result._balance_slack = _balance_slack;
+  node* left;
+  node* right;
+  int left_height, right_height;
+  node* found = _split(root, _height(root), key, left, left_height, right, right_height);
+  if (found)
+    right = _join(nullptr, 0, found, right, right_height, right_height);
+  root = left;
+  result.root = right;
+  _count_split(result, std::is_base_of<order_statistics, Augment>());
+  return result;
+}
+
+// Split `b` around `a`'s root, then unite `a`'s subtrees with `b`'s parts and join them back.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::set_union(avltree&& other)
+{
+  rebalance();
+  int other_height;
+  node* other_root = _take_nodes(other, other_height);
+  node* tree_root = root;
+  int height;
+  node* result = _union(tree_root, _height(tree_root), other_root, other_height, height);
+  root = result;
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::set_intersection(avltree&& other)
+{
+  rebalance();
+  int other_height;
+  node* other_root = _take_nodes(other, other_height);
+  node* tree_root = root;
+  int height;
+  node* result = _intersection(tree_root, _height(tree_root), other_root, other_height, height);
+  root = result;
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::set_difference(avltree&& other)
+{
+  rebalance();
+  int other_height;
+  node* other_root = _take_nodes(other, other_height);
+  node* tree_root = root;
+  int height;
+  node* result = _difference(tree_root, _height(tree_root), other_root, other_height, height);
+  root = result;
+}
+
+// Detach the root's subtrees, split the one the key is in, and join the other with the root and
+// the near part of the split.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_split(node* subtree_root, int height, const Q& key, node*& left,
+                                              int& left_height, node*& right, int& right_height)
+{
+  if (!subtree_root)
+  {
+    left = right = nullptr;
+    left_height = right_height = 0;
+    return nullptr;
+  }
+  int child_left_height = _child_height(subtree_root, height, LEFT);
+  int child_right_height = _child_height(subtree_root, height, RIGHT);
+  node* child_left = _take_child(subtree_root, LEFT);
+  node* child_right = _take_child(subtree_root, RIGHT);
+  const int order = _order(key, subtree_root->key);
+  if (order < 0)
+  {
+    node* found = _split(child_left, child_left_height, key, left, left_height, right, right_height);
+    right = _join(right, right_height, subtree_root, child_right, child_right_height, right_height);
+    return found;
+  }
+  else if (order > 0)
+  {
+    node* found = _split(child_right, child_right_height, key, left, left_height, right, right_height);
+    left = _join(child_left, child_left_height, subtree_root, left, left_height, left_height);
+    return found;
+  }
+  left = child_left;
+  left_height = child_left_height;
+  right = child_right;
+  right_height = child_right_height;
+  subtree_root->balance_factor = BALANCED;
+  return subtree_root;
+}
+
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_union(node* a, int a_height, node* b, int b_height, int& height)
+{
+  if (!a || !b)
+  {
+    height = a ? a_height : b_height;
+    return a ? a : b;
+  }
+  node* b_left;
+  node* b_right;
+  int b_left_height, b_right_height;
+  node* duplicate = _split(b, b_height, a->key, b_left, b_left_height, b_right, b_right_height);
+  if (duplicate)
+    _destroy_node(duplicate);
+  int left_height = _child_height(a, a_height, LEFT);
+  int right_height = _child_height(a, a_height, RIGHT);
+  node* left = _union(_take_child(a, LEFT), left_height, b_left, b_left_height, left_height);
+  node* right = _union(_take_child(a, RIGHT), right_height, b_right, b_right_height, right_height);
+  return _join(left, left_height, a, right, right_height, height);
+}
+
+// As `_union`, keeping `a`'s root only if `b` had its key.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_intersection(node* a, int a_height, node* b, int b_height, int& height)
+{
+  if (!a || !b)
+  {
+    _destroy_subtree(a);
+    _destroy_subtree(b);
+    height = 0;
+    return nullptr;
+  }
+  node* b_left;
+  node* b_right;
+  int b_left_height, b_right_height;
+  node* duplicate = _split(b, b_height, a->key, b_left, b_left_height, b_right, b_right_height);
+  int left_height = _child_height(a, a_height, LEFT);
+  int right_height = _child_height(a, a_height, RIGHT);
+  node* left = _intersection(_take_child(a, LEFT), left_height, b_left, b_left_height, left_height);
+  node* right = _intersection(_take_child(a, RIGHT), right_height, b_right, b_right_height, right_height);
+  if (duplicate)
+  {
+    _destroy_node(duplicate);
+    return _join(left, left_height, a, right, right_height, height);
+  }
+  _destroy_node(a);
+  return _join(left, left_height, right, right_height, height);
+}
+
+// As `_union`, keeping `a`'s root only if `b` didn't have its key.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_difference(node* a, int a_height, node* b, int b_height, int& height)
+{
+  if (!a || !b)
+  {
+    _destroy_subtree(b);
+    height = a ? a_height : 0;
+    return a;
+  }
+  node* b_left;
+  node* b_right;
+  int b_left_height, b_right_height;
+  node* duplicate = _split(b, b_height, a->key, b_left, b_left_height, b_right, b_right_height);
+  int left_height = _child_height(a, a_height, LEFT);
+  int right_height = _child_height(a, a_height, RIGHT);
+  node* left = _difference(_take_child(a, LEFT), left_height, b_left, b_left_height, left_height);
+  node* right = _difference(_take_child(a, RIGHT), right_height, b_right, b_right_height, right_height);
+  if (duplicate)
+  {
+    _destroy_node(duplicate);
+    _destroy_node(a);
+    return _join(left, left_height, right, right_height, height);
+  }
+  return _join(left, left_height, a, right, right_height, height);
+}
+
+// Nodes can only change trees if this tree's allocator can free them.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_take_nodes(avltree& other, int& height)
+{
+  other.rebalance();
+  node* taken;
+  if (_alloc == other._alloc)
+  {
+    taken = other.root;
+    _node_count += other._node_count;
+    _count_stale = _count_stale || other._count_stale;
+  }
+  else
+  {
+    avltree copy(_alloc);
+    copy.assign_sorted(other.begin(), other.end());
+    taken = copy.root;
+    _node_count += copy._node_count;
+    copy.root = nullptr;
+    copy._node_count = 0;
+    other._destroy_all();
+  }
+  other.root = nullptr;
+  other._node_count = 0;
+  other._count_stale = false;
+  height = _height(taken);
+  return taken;
+}
+
+// Split down the right edge, joining each left subtree back with its root on the way up.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_split_last(node*& subtree_root, int& height)
+{
+  node* const top = subtree_root;
+  if (!top->child[RIGHT])
+  {
+    subtree_root = _take_child(top, LEFT);
+    height -= 1;
+    return top;
+  }
+  int left_height = _child_height(top, height, LEFT);
+  int right_height = _child_height(top, height, RIGHT);
+  node* left = _take_child(top, LEFT);
+  node* right = _take_child(top, RIGHT);
+  node* last = _split_last(right, right_height);
+  subtree_root = _join(left, left_height, top, right, right_height, height);
+  return last;
+}
+
+// Unlink the child in both directions.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_take_child(node* parent_node, int side)
+{
+  node* child = parent_node->child[side];
+  parent_node->child[side] = nullptr;
+  if (child) { child->parent = nullptr; }
+  return child;
+}
+
+// Follow the taller child down to a leaf, counting the levels.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+int avltree<K, V, Alloc, Augment, Tracer, Compare>::_height(node* subtree_root)
+{
+  int height = 0;
+  for (; subtree_root; ++height)
+    subtree_root = subtree_root->child[subtree_root->balance_factor < 0 ? RIGHT : LEFT];
+  return height;
+}
+
+// The middle node becomes the subtree root, the two halves (which differ in size by at most one)
+// its subtrees. Recursion depth is the tree height.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_build_balanced(node* const* nodes, std::size_t count, node* parent, int& height)
+{
+  if (count == 0)
+  {
+    height = 0;
+    return nullptr;
+  }
+  const std::size_t left_count = (count - 1) / 2;
+  node* subtree_root = nodes[left_count];
+  int left_height, right_height;
+  subtree_root->parent = parent;
+  subtree_root->child[LEFT] = _build_balanced(nodes, left_count, subtree_root, left_height);
+  subtree_root->child[RIGHT] = _build_balanced(nodes + left_count + 1, count - left_count - 1,
+                                               subtree_root, right_height);
+  subtree_root->balance_factor = static_cast<int8_t>(left_height - right_height);
+  height = 1 + std::max(left_height, right_height);
+  Augment::update(*subtree_root);
+  return subtree_root;
+}
+
+// Allocate and construct a node with the tree's allocator.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename... Args>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_create_node(node* parent, Args&&... args)
+{
+  node* new_node = node_alloc_traits::allocate(_alloc, 1);
+  node_alloc_traits::construct(_alloc, new_node, parent, std::forward<Args>(args)...);
+  ++_node_count;
+  _tracer.node_allocated();
+  return new_node;
+}
 
-  // Perform a left rotation to rebablance a subtree rooted at old_subtree_root, returning
-  // a pointer to the new root of the subtree.
-  shared_ptr<node> _left_rotate(shared_ptr<node> old_subtree_root);
+// Destroy and deallocate a single node.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_destroy_node(node* dead_node)
+{
+  node_alloc_traits::destroy(_alloc, dead_node);
+  node_alloc_traits::deallocate(_alloc, dead_node, 1);
+  --_node_count;
+  _tracer.node_freed();
+}
 
-  // Perform a right rotation to rebablance a subtree rooted at old_subtree_root, returning
-  // a pointer to the new root of the subtree.
-  shared_ptr<node> _right_rotate(shared_ptr<node> old_subtree_root);
+// Destroy a subtree bottom-up, walking back up through the parent links rather than recursing.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_destroy_subtree(node* subtree_root)
+{
+  if (!subtree_root)
+    return;
+  node* const stop = subtree_root->parent;
+  node* current = subtree_root;
+  while (current != stop)
+  {
+    if (current->child[LEFT])
+      current = current->child[LEFT];
+    else if (current->child[RIGHT])
+      current = current->child[RIGHT];
+    else  // a leaf, detach it from its parent and destroy it
+    {
+      node* parent = current->parent;
+      if (parent != stop)
+        parent->child[current->side()] = nullptr;
+      _destroy_node(current);
+      current = parent;
+    }
+  }
+}
 
-  // Perform a left-right rotation to rebablance a subtree rooted at old_subtree_root, returning
-  // a pointer to the new root of the subtree.
-  shared_ptr<node> _left_right_rotate(shared_ptr<node> old_subtree_root);
+// Pre-order, walking back up through the parent links rather than recursing: each node is copied
+// on the way down, and a node whose children are both copied (or absent) is left for its parent.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_copy_subtree(const node* subtree_root)
+{
+  if (!subtree_root)
+    return nullptr;
+  const auto copy = [this](node* parent, const node* original) {
+    node* new_node = _create_node(parent, original->key, original->value);
+    new_node->balance_factor = original->balance_factor;
+    static_cast<typename Augment::data&>(*new_node) = static_cast<const typename Augment::data&>(*original);
+    return new_node;
+  };
+  node* const copy_root = copy(nullptr, subtree_root);
+  const node* from = subtree_root;
+  node* to = copy_root;
+  while (true)
+  {
+    const int side = (from->child[LEFT] && !to->child[LEFT]) ? LEFT : RIGHT;
+    if (from->child[side] && !to->child[side])
+    {
+      to->child[side] = copy(to, from->child[side]);
+      from = from->child[side];
+      to = to->child[side];
+    }
+    else if (from == subtree_root)
+      break;
+    else
+    {
+      from = from->parent;
+      to = to->parent;
+    }
+  }
+  return copy_root;
+}
 
-  // Perform a right-left rotation to rebablance a subtree rooted at old_subtree_root, returning
-  // a pointer to the new root of the subtree.
-  shared_ptr<node> _right_left_rotate(shared_ptr<node> old_subtree_root);
+// Without a bulk release, destroy the nodes one by one; the tracer hears of every node either way.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::clear()
+{
+  if (!root)
+    return;
+  if (!_release_nodes(_alloc, std::integral_constant<bool, std::is_trivially_destructible<node>::value>(), 0))
+  {
+    _destroy_all();
+    return;
+  }
+  for (size(); _node_count; --_node_count)
+    _tracer.node_freed();
+  root = nullptr;
+  _out_of_balance = false;
+}
 
-  // The test_helper class contains some meta functionality to check the implementation is valid.
-  friend class test_helper<K, V>;
-};
+// Hang a new node from the node the search stopped at if the key wasn't found.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename KeyArg, typename... Args>
+std::pair<typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*, bool>
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_try_emplace_at(node* target, int order, KeyArg&& key,
+                                                                 Args&&... args)
+{
+  if (!target)    // Base case, we have an empty tree, the inserted node is the new root.
+  {
+    root = _create_node(nullptr, std::forward<KeyArg>(key), std::forward<Args>(args)...);
+    Augment::update(*root);
+    return std::pair<node*, bool>(root, true);
+  }
+  else if (order == 0)  // The key exists already.
+    return std::pair<node*, bool>(target, false);
 
+  // The new node goes on the side of the search's last node that the key would be on.
+  const int side = (order < 0) ? LEFT : RIGHT;
+  target->child[side] = _create_node(target, std::forward<KeyArg>(key), std::forward<Args>(args)...);
+  target = target->child[side];
+  Augment::update(*target);
+  _retrace_insertion(target);
+  _update_path(target->parent);
+  return std::pair<node*, bool>(target, true);
+}
 
+// Hang `new_child` where `old_child` was, fixing up the links in both directions.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_replace_child(node* old_child, node* new_child)
+{
+  node* parent = old_child->parent;
+  if (!parent)
+    root = new_child;
+  else
+    parent->child[old_child->side()] = new_child;
+  if (new_child) { new_child->parent = parent; }
+}
 
-// ============================================================================================ //
-// |                              `avltree` method definitions                                | //
-// ============================================================================================ //
+// Find a node with given key; returning null if there are no nodes, a pointer to the would-be
+// parent if the node doesn't exist, or a pointer to the node itself if it does.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_node_search(const Q& key, int& order) const
+{
+  // Base case, we have an empty tree.
+  order = 0;
+  if (!root)
+  {
+    _tracer.searched(0);
+    return nullptr;
+  }
+  // Iterative search. We follow branch directions based on comparing the keys, once per level.
+  node* current = root;
+  for (std::size_t length = 1;; ++length)
+  {
+    order = _order(key, current->key);
+    node* next = order == 0 ? nullptr : current->child[order > 0];
+    if (!next)
+    {
+      _tracer.searched(length);
+      return current;
+    }
+    current = next;
+  }
+}
 
-// Insert a node with a given key.
-template <typename K, typename V>
-void avltree<K,V>::insert(const K& key, const V& value)
+// The finger's subtree holds every key between the nearest ancestors it hangs left and right of.
+// Climbing towards the key, the ancestors the subtree hangs on the far side of are behind the
+// finger and are passed without comparing; the first one it hangs on the near side of bounds it.
+// If the key is before that bound, its place is below the last node it was found to be past;
+// otherwise the bound is the new place to climb from.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_finger_search(node* finger, const Q& key, int& order) const
 {
-  shared_ptr<node> target = _node_search(key);
-  if (!target)    // Base case, we have an empty tree, the inserted node is the new root.
-    root = make_shared<node>(key, value, nullptr);
-  else if (target->key == key)  // The key exists already, we update its value.
-    target->value = value;
-  else if (target->key > key)  // new node is left child
+  if (!finger)
+  {
+    if (!root)
+      return _node_search(key, order);
+    finger = _outermost(root, RIGHT);
+  }
+  std::size_t length = 1;
+  order = _order(key, finger->key);
+  node* start = finger;  // The last node the key was compared with on the way up.
+  if (order != 0)
   {
-    target->left_child = make_shared<node>(key, value, target);
-    _retrace_insertion(target->left_child);
+    const int side = order > 0;  // The direction from the finger to the key.
+    for (node* current = finger;;)
+    {
+      while (current->parent && current->side() == side)
+        current = current->parent;
+      if (!current->parent)
+        break;  // Nothing bounds the subtree on this side.
+      node* bound = current->parent;
+      ++length;
+      const int bound_order = _order(key, bound->key);
+      if (bound_order != 0 && (bound_order > 0) != side)
+        break;  // The key is between `start` and the bound.
+      start = current = bound;
+      order = bound_order;
+      if (order == 0)
+        break;
+    }
   }
-  else // new node is right child
+  // Descend from `start`, as `_node_search` does.
+  node* current = start;
+  while (order != 0)
   {
-    target->right_child = make_shared<node>(key, value, target);
-    _retrace_insertion(target->right_child);
+    node* next = current->child[order > 0];
+    if (!next)
+      break;
+    current = next;
+    ++length;
+    order = _order(key, current->key);
   }
+  _tracer.searched(length);
+  return current;
 }
 
-// Get (maybe) a node with a given key.
-template <typename K, typename V>
-optional<V> avltree<K, V>::get(const K& key) const
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Visit>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::for_each_changed(Visit visit)
 {
-  shared_ptr<node> found_node = _node_search(key);
-  if (found_node && (key == found_node->key))
-    return optional<V>(found_node->value);
-  return optional<V>();
+  static_assert(std::is_base_of<dirty_tracking, Augment>::value, "for_each_changed needs dirty_tracking");
+  _visit_changed(root, visit);
 }
 
-// Remove a node with given key from the tree
-template <typename K, typename V>
-void avltree<K, V>::remove(const K& key)
+// Skip the subtrees with nothing changed; everything visited ends up unmarked.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Visit>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_visit_changed(node* subtree_root, Visit& visit)
 {
-  shared_ptr<node> target = _node_search(key);
-  // does the target node exist?
-  if (!(target && (key == target->key)))
+  if (!Augment::subtree_changed(subtree_root))
     return;
+  _visit_changed(subtree_root->child[LEFT], visit);
+  if (subtree_root->changed)
+  {
+    subtree_root->changed = false;
+    visit(static_cast<const K&>(subtree_root->key), static_cast<const V&>(subtree_root->value));
+  }
+  _visit_changed(subtree_root->child[RIGHT], visit);
+  subtree_root->subtree_changed = false;
+}
 
-  // removed node has >0 children?
-  if (target->left_child || target->right_child)
+// Count the nodes passed on the left while searching for the key.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+std::size_t avltree<K, V, Alloc, Augment, Tracer, Compare>::rank(const Q& key) const
+{
+  static_assert(std::is_base_of<order_statistics, Augment>::value, "rank needs order_statistics");
+  std::size_t smaller = 0;
+  for (node* current = root; current; )
   {
-    // removed node has 2 children?
-    if (target->left_child && target->right_child)
+    if (_less(current->key, key))
     {
-      if (DBG) { cout << "removing node with 2 children... " << endl; }
-      // find in-order successor (node with smallest key that is > than this key)
-      shared_ptr<node> successor = target->right_child;
-      shared_ptr<node> successor_parent;
-      while (successor->left_child)
-        successor = successor->left_child;
-      successor_parent = successor->parent.lock();
-
-      // successor has a right child? (if it had left-child, it wouldn't be in-order successor!)
-      if (successor->right_child)
-      {
-        if (DBG) { cout << "In order successor has a right child, reseating this to successor node." << endl; }
-        // We need to reseat this child where "successor" lived.
-        if (successor->is_left_child())
-          set_left_child(successor_parent, successor->right_child);
-        else // successor is a right child
-          set_right_child(successor_parent, successor->right_child);
-      }
-      else  // Successor had no children, can just be removed.
-      {
-        if (DBG) { cout << "successor had no children, removing it." << endl; }
-        if (successor->is_left_child())
-          successor_parent->left_child = nullptr;
-        else // successor is a right child
-          successor_parent->right_child = nullptr;
-      }
-      // We are moving this node's key and value to our deleted node lived, and deleting this.
-      target->key = successor->key;
-      target->value = successor->value;
-      if (successor->is_left_child())
-      {
-        _retrace_deletion(successor_parent, -LEFT_HEAVY);
-      }
-      else
-      {
-        _retrace_deletion(successor_parent, -RIGHT_HEAVY);
-      }
+      smaller += Augment::size_of(current->child[LEFT]) + 1;
+      current = current->child[RIGHT];
     }
-    // removed node has 1 child?
+    else
+      current = current->child[LEFT];
+  }
+  return smaller;
+}
+
+// Descend to the first node inside the range, the top of every path to the others. Below it, the
+// nodes inside the range on its left each bring their right subtree with them, and those on its
+// right their left subtree; the rest of those subtrees is across a bound.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q, typename A>
+typename A::value_type avltree<K, V, Alloc, Augment, Tracer, Compare>::range_aggregate(const Q& lo, const Q& hi) const
+{
+  using op = typename A::op_type;
+  node* split = root;
+  while (split && _less(lo, hi))
+  {
+    if (_less(split->key, lo))
+      split = split->child[RIGHT];
+    else if (!_less(split->key, hi))
+      split = split->child[LEFT];
+    else
+      break;
+  }
+  if (!split || !_less(lo, hi))
+    return op::identity();
+
+  // Walking down towards lo, each node found is before the ones already taken.
+  typename A::value_type left = op::identity();
+  for (node* current = split->child[LEFT]; current; )
+  {
+    if (_less(current->key, lo))
+      current = current->child[RIGHT];
     else
     {
-      if (DBG) { cout << "node had one child, moving that orphan to position of removed node..." << endl; }
-      // get pointer to the node that would be orphaned
-      shared_ptr<node> orphan = (target->left_child) ? target->left_child : target->right_child;
-      // If the root is being deleted, this orphan must become the new root
-      if (target == root)
-        root = orphan;
-      // otherwise, assign it to the side of parent that our target node lived
-      else if (target->is_left_child())
-      {
-        set_left_child(target->parent.lock(), orphan);
-      }
-      else
-        set_right_child(target->parent.lock(), orphan);
+      typename A::value_type taken = op::lift(current->key, current->value);
+      if (current->child[RIGHT])
+        taken = op::combine(taken, current->child[RIGHT]->aggregate);
+      left = op::combine(taken, left);
+      current = current->child[LEFT];
     }
   }
-  // Removed node had 0 children?
-  else
+  // Walking down towards hi, each node found is after the ones already taken.
+  typename A::value_type right = op::identity();
+  for (node* current = split->child[RIGHT]; current; )
   {
-    if (DBG) { cout << "node had no children, removing and retracing from parent." << endl; }
-    if (target == root)  // parent == null in this case
+    if (!_less(current->key, hi))
+      current = current->child[LEFT];
+    else
     {
-      if (DBG) { cout << "node was root, tree is now empty" << endl; }
-      root = nullptr;     // we remove the root, leaving an empty tree, no balancing required
+      typename A::value_type taken = op::lift(current->key, current->value);
+      if (current->child[LEFT])
+        taken = op::combine(current->child[LEFT]->aggregate, taken);
+      right = op::combine(right, taken);
+      current = current->child[RIGHT];
     }
-    else if (target->is_left_child())
+  }
+  return op::combine(op::combine(left, op::lift(split->key, split->value)), right);
+}
+
+// Go left while the index is inside the left subtree, otherwise skip over it (and the node).
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_select_node(std::size_t index) const
+{
+  static_assert(std::is_base_of<order_statistics, Augment>::value, "select needs order_statistics");
+  node* current = root;
+  while (current)
+  {
+    const std::size_t left_size = Augment::size_of(current->child[LEFT]);
+    if (index < left_size)
+      current = current->child[LEFT];
+    else if (index == left_size)
+      return current;
+    else
     {
-      target->parent.lock()->left_child = nullptr;
-      _retrace_deletion(target->parent.lock(), -LEFT_HEAVY);
+      index -= left_size + 1;
+      current = current->child[RIGHT];
     }
+  }
+  return nullptr;
+}
+
+// Keep the last node at or above the key while descending.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_lower_bound_node(const Q& key) const
+{
+  node* bound = nullptr;
+  for (node* current = root; current; )
+  {
+    if (_less(current->key, key))
+      current = current->child[RIGHT];
     else
     {
-      target->parent.lock()->right_child = nullptr;
-      _retrace_deletion(target->parent.lock(), -RIGHT_HEAVY);
+      bound = current;
+      current = current->child[LEFT];
     }
   }
+  return bound;
 }
 
-// Find a node with given key; returning null if there are no nodes, a pointer to the would-be
-// parent if the node doesn't exist, or a pointer to the node itself if it does.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node> avltree<K, V>::_node_search(K key) const
+// Keep the last node above the key while descending.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_upper_bound_node(const Q& key) const
 {
-  // Base case, we have an empty tree.
-  if (!root)
-    return nullptr;
-  // Iterative search. We follow branch directions based on comparing the keys.
-  shared_ptr<node> current = root;
-  for (;;)
+  node* bound = nullptr;
+  for (node* current = root; current; )
   {
-    if (key < current->key)
-      if (current->left_child)
-        current = current->left_child;
-      else
-        return current;
-    else if (key > current->key)
-      if (current->right_child)
-        current = current->right_child;
-      else
-        return current;
-    else // (key == current->key)
-      return current;
+    if (_less(key, current->key))
+    {
+      bound = current;
+      current = current->child[LEFT];
+    }
+    else
+      current = current->child[RIGHT];
   }
+  return bound;
 }
 
-// Retrace after a node is inserted in order to check tree is still AVL and, if not, rebalance it.
-template <typename K, typename V>
-void avltree<K, V>::_retrace_insertion(shared_ptr<node> inserted_node)
+// Follow the links on one side to the end.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_outermost(node* subtree_root, int side)
+{
+  while (subtree_root->child[side])
+    subtree_root = subtree_root->child[side];
+  return subtree_root;
+}
+
+// The next node towards `side` is the outermost node on the other side of its subtree on `side`,
+// if it has one. Otherwise it is the first ancestor reached from the other side. Each link is
+// followed at most twice in a full traversal, so a step costs O(1) amortized.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node* avltree<K, V, Alloc, Augment, Tracer, Compare>::_step(node* current, int side)
+{
+  if (current->child[side])
+    return _outermost(current->child[side], !side);
+  while (current->parent && current->side() == side)
+    current = current->parent;
+  return current->parent;
+}
+
+// Find the value with given key, reusing the node search.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename Q>
+V* avltree<K, V, Alloc, Augment, Tracer, Compare>::_find_value(const Q& key) const
+{
+  int order;
+  node* found_node = _node_search(key, order);
+  if (found_node && order == 0)
+    return &found_node->value;
+  return nullptr;
+}
+
+// The `_node_search` loop run for a group of keys at once: each pass takes every unfinished search
+// one level down and prefetches the node it moves to, which the next pass then reads.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+template <typename ForwardIt, typename OutputIt>
+OutputIt avltree<K, V, Alloc, Augment, Tracer, Compare>::get_many(ForwardIt first, ForwardIt last, OutputIt out) const
 {
-  shared_ptr<node> current;
-  shared_ptr<node> parent;
-  if (DBG) { cout << "\n---------------- Retracing insertion ----------------" << endl; }
-  for (current = inserted_node; current->parent.lock() != nullptr ; current = parent)
+  const K* keys[_search_lanes];
+  node* current[_search_lanes];
+  node* found[_search_lanes];
+  while (first != last)
   {
-    if (DBG) { cout << "backtracing:" << endl; }
-    parent = current->parent.lock();
-    if (current->is_left_child())
+    std::size_t lanes = 0;
+    for (; lanes < _search_lanes && first != last; ++lanes, ++first)
     {
-      if (DBG) { cout << "Child is left child" << endl; }
-      if (parent->balance_factor == LEFT_HEAVY)
-      {
-        //tree is unbalanced, left too heavy
-        if (DBG) { cout << "Parent is already LEFT_HEAVY, rebalance required." << endl; }
-        if (current->balance_factor == RIGHT_HEAVY)
-        {
-          if (DBG) { cout << "Found RIGHT_HEAVY subsubtree in LEFT_HEAVY subtree, performing right-left rotation." << endl; }
-          // left child in right subtree -> right-left double rotation
-          _left_right_rotate(parent);
-          return;
-        }
-        else // (parent->is_right_child() || parent == root) necessarily.
-        {
-          // left child in left subtree -> single right rotation
-          if (DBG) { cout << "Found LEFT_HEAVY subsubtree in LEFT_HEAVY subtree, performing right rotation." << endl; }
-          _right_rotate(parent);
-          return;
-        }
-      }
-      else
-      {
-        if (DBG) { cout << "Adding LEFT_HEAVY to parent balance factor." << endl; }
-        parent->balance_factor += LEFT_HEAVY;
-        if (parent->balance_factor == BALANCED)
-        {
-          if (DBG) { cout << "Tree is now AVL, returning!" << endl; }
-          return;
-        }
-        else
-          continue;
-      }
+      keys[lanes] = &*first;
+      current[lanes] = root;
+      found[lanes] = nullptr;
     }
-    else // (current->is_right_child()) necessarily, we exited loop if there was no parent, so it can't be root.
+
+    for (std::size_t searching = root ? lanes : 0; searching != 0;)
     {
-      if (DBG) { cout << "Child is right child" << endl; }
-      if (parent->balance_factor == RIGHT_HEAVY)
+      searching = 0;
+      for (std::size_t lane = 0; lane < lanes; ++lane)
       {
-        if (DBG) { cout << "parent is RIGHT_HEAVY" << endl;  }
-        //tree is unbalanced, right too heavy
-        if (current->balance_factor == LEFT_HEAVY)
-        {
-          // right child in left subtree -> left-right double rotation
-          if (DBG) { cout << "Found LEFT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing right-left rotation." << endl; }
-          _right_left_rotate(parent);
-          return;
-        }
-        else // (parent->is_right_child() || parent == root) necessarily.
+        node* n = current[lane];
+        if (!n)
+          continue;
+        const int order = _order(*keys[lane], n->key);
+        if (order == 0)
         {
-          // right child in right subtree -> single left rotation
-          if (DBG) { cout << "Found RIGHT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing left rotation." << endl; }
-          _left_rotate(parent);
-          return;
+          found[lane] = n;
+          n = nullptr;
         }
-      }
-      else
-      {
-        if (DBG) { cout << "Adding RIGHT_HEAVY to parent balance factor." << endl; }
-        parent->balance_factor += RIGHT_HEAVY;
-        if (parent->balance_factor == BALANCED)
+        else
+          n = n->child[order > 0];
+        current[lane] = n;
+        if (n)
         {
-          if (DBG) { cout << "Tree is now AVL, returning!" << endl; }
-          return;
+          _prefetch(n);
+          ++searching;
         }
-        else
-          continue;
       }
     }
+
+    for (std::size_t lane = 0; lane < lanes; ++lane, ++out)
+      *out = found[lane] ? optional<V>(found[lane]->value) : optional<V>();
   }
-  if (DBG) { cout << "Fell through, we made it to root? " << (current == root) << endl; }
+  return out;
 }
 
-// Retrace after a node is deleted in order to check tree is still AVL and, if not, rebalance it.
-template <typename K, typename V>
-void avltree<K, V>::_retrace_deletion(shared_ptr<node> subtree_root, int8_t balance_factor_change)
+// Retrace after a node is inserted in order to check tree is still AVL and, if not, rebalance it.
+// Left and right insertions are handled by the same code, mirrored through the side index.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_retrace_insertion(node* inserted_node)
 {
-  shared_ptr<node> current = subtree_root;
-  shared_ptr<node> parent;
-
-  if (DBG) { cout << "\n---------------- Retracing deletion ----------------" << endl; }
-  if (current->balance_factor == BALANCED)
+  if (_balance_slack)
   {
-    if (DBG) { cout << "Subtree was balanced, no illegal subtree height change." << endl; }
-    current->balance_factor += balance_factor_change;
+    if (inserted_node->parent)
+      _relaxed_retrace(inserted_node->parent, inserted_node->side(), 1);
     return;
   }
-
-  else if ((current->balance_factor + balance_factor_change) != BALANCED)
+  node* current;
+  node* parent;
+  std::size_t length = 0;
+  _tracer.trace("retrace insertion");
+  for (current = inserted_node; current->parent != nullptr ; current = parent)
   {
-    if (DBG) { cout << "Subtree is imbalanced here, need to rotate." << endl; }
-    if (balance_factor_change == LEFT_HEAVY)
+    parent = current->parent;
+    ++length;
+    const int side = current->side();
+    const int8_t heavy = _heavy(side);
+    _tracer.trace("retrace insertion: grew on side", side);
+    parent->balance_factor += heavy;
+    if (parent->balance_factor == BALANCED)
     {
-      if (subtree_root->left_child->balance_factor == LEFT_HEAVY)
-      {
-        if (DBG) { cout << "Found LEFT_HEAVY subsubtree in LEFT_HEAVY subtree, performing right rotation." << endl; }
-        _right_rotate(subtree_root);
-      }
-      else
-      {
-        if (DBG) { cout << "Found RIGHT_HEAVY subsubtree in LEFT_HEAVY subtree, performing left-right rotation." << endl; }
-        _left_right_rotate(subtree_root);
-      }
+      _tracer.trace("retrace insertion: subtree is balanced, done");
+      _tracer.insertion_retraced(length);
+      return;
     }
-    else // RIGHT_HEAVY
+    else if (parent->balance_factor == heavy)
+      continue;  // parent's subtree grew, keep going up.
+
+    // Parent was already heavy on this side, rebalance by rotating it to the other side.
+    if (current->balance_factor == -heavy)
     {
-      if (subtree_root->right_child->balance_factor == RIGHT_HEAVY)
-      {
-          if (DBG) { cout << "Found RIGHT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing left rotation." << endl; }
-        _left_rotate(subtree_root);
-      }
-      else
-      {
-        if (DBG) { cout << "Found LEFT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing right-left rotation." << endl; }
-        _right_left_rotate(subtree_root);
-      }
+      // inner grandchild is taller -> double rotation (left-right or right-left)
+      _tracer.trace("retrace insertion: child is heavy on the far side, double rotation");
+      _double_rotate(parent, !side);
     }
+    else
+    {
+      // outer grandchild is taller -> single rotation
+      _tracer.trace("retrace insertion: child is heavy on the same side, single rotation");
+      _rotate(parent, !side);
+    }
+    _tracer.insertion_retraced(length);
     return;
   }
-  else
+  _tracer.trace("retrace insertion: reached the top, at the root", current == root);
+  _tracer.insertion_retraced(length);
+}
+
+// Retrace after a node is deleted in order to check tree is still AVL and, if not, rebalance it.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_retrace_deletion(node* subtree_root, int shortened_side)
+{
+  if (_balance_slack)
   {
-    if (DBG) { cout << "Subtree is balanced, but height has reduced by one, need to retrace..." << endl; }
+    _relaxed_retrace(subtree_root, shortened_side, -1);
+    return;
   }
-
-  for (current = subtree_root; current->parent.lock() != nullptr ; current = parent)
+  node* current = subtree_root;
+  _tracer.trace("retrace deletion");
+  for (std::size_t length = 1;; ++length)
   {
-    if (DBG) { cout << "backtracing:" << endl; }
-    parent = current->parent.lock();
-    if (current->is_left_child())
+    _tracer.trace("retrace deletion: shortened on side", shortened_side);
+    current->balance_factor -= _heavy(shortened_side);
+    if (current->balance_factor == LEFT_HEAVY || current->balance_factor == RIGHT_HEAVY)
     {
-      if (DBG) { cout << "Left subtree height has been reduced." << endl; }
-      if (parent->balance_factor == RIGHT_HEAVY)
-      {
-        if (current->balance_factor == RIGHT_HEAVY)
-        {
-          // left rotate
-          if (DBG) { cout << "Found RIGHT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing left rotation." << endl; }
-          _left_rotate(parent);
-          return;
-        }
-        else
-        {
-          // right-left rotate
-          if (DBG) { cout << "Found LEFT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing right-left rotation." << endl; }
-          _right_left_rotate(parent);
-          return;
-        }
-      }
-      else
-      {
-        if (DBG) { cout << "Subtracting LEFT_HEAVY from parent balance factor." << endl; }
-        parent->balance_factor -= LEFT_HEAVY;
-        if (parent->balance_factor == BALANCED)
-        {
-          if (DBG) { cout << "Tree is now AVL, returning!" << endl; }
-          return;
-        }
-        else
-          continue;
-      }
+      _tracer.trace("retrace deletion: subtree was balanced, keeps its height, done");
+      _tracer.deletion_retraced(length);
+      return;
     }
-    else // (current is a right child necessarily, we exited loop if there was no parent, so it can't be root.
+    else if (current->balance_factor != BALANCED)
     {
-      if (DBG) { cout << "Child is right child" << endl; }
-      if (parent->balance_factor == LEFT_HEAVY)
+      _tracer.trace("retrace deletion: subtree is imbalanced, rotating");
+      const int taller_side = !shortened_side;
+      node* taller_child = current->child[taller_side];
+      if (taller_child->balance_factor == -_heavy(taller_side))
       {
-        if (current->balance_factor == LEFT_HEAVY)
-        {
-          if (DBG) { cout << "Found LEFT_HEAVY subsubtree in LEFT_HEAVY subtree, performing right rotation." << endl; }
-          _right_rotate(parent);
-          return;
-        }
-        else
-        {
-          if (DBG) { cout << "Found LEFT_HEAVY subsubtree in RIGHT_HEAVY subtree, performing left-right rotation." << endl; }
-          _left_right_rotate(parent);
-          return;
-        }
+        _tracer.trace("retrace deletion: taller child is heavy on the inner side, double rotation");
+        current = _double_rotate(current, shortened_side);
       }
       else
       {
-        if (DBG) { cout << "Adding RIGHT_HEAVY to parent balance factor." << endl; }
-        parent->balance_factor -= RIGHT_HEAVY;
-        if (parent->balance_factor == BALANCED)
-        {
-          if (DBG) { cout << "Tree is now AVL, returning!" << endl; }
-          return;
-        }
-        else
-          continue;
+        _tracer.trace("retrace deletion: single rotation");
+        current = _rotate(current, shortened_side);
+      }
+      // If the taller child was balanced, the rotated subtree keeps its height and we can stop.
+      if (current->balance_factor != BALANCED)
+      {
+        _tracer.trace("retrace deletion: rotation kept the subtree height, done");
+        _tracer.deletion_retraced(length);
+        return;
       }
     }
+    // The subtree rooted at current is balanced, but its height has reduced by one, retrace...
+    node* parent = current->parent;
+    if (!parent)
+    {
+      _tracer.trace("retrace deletion: reached the root");
+      _tracer.deletion_retraced(length);
+      return;
+    }
+    shortened_side = current->side();
+    current = parent;
   }
-  if (DBG) { cout << "Fell through, we made it to root? " << (current == root) << endl; }
 }
 
-// Perform left rotation around given node.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node>
-avltree<K, V>::_left_rotate(shared_ptr<avltree<K, V>::node> old_subtree_root)
+// Measured towards `side`, a balance factor b becomes b + delta, and the parent's height changes by
+// the difference of max(b, 0) before and after. Past the slack the node is rotated as in a strict
+// retrace: the taller child is heavy by at most the slack, so the rotated nodes end up within it.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_relaxed_retrace(node* parent, int side, int delta)
 {
-  if (DBG) { cout << "performing left rotation..." << endl; }
-  shared_ptr<node> new_subtree_root = old_subtree_root->right_child;
-  shared_ptr<node> grandparent = old_subtree_root->parent.lock();
-  shared_ptr<node> orphan = new_subtree_root->left_child;
-  
-  if (DBG) { cout << "  old root = " << old_subtree_root->value << endl; }
-  if (DBG) { cout << "  new root = " << new_subtree_root->value << endl; }
-
-  if (old_subtree_root->is_left_child())
-    set_left_child(grandparent, new_subtree_root);
-  else if (old_subtree_root->is_right_child())
-    set_right_child(grandparent, new_subtree_root);
-  else // old_subtree_root is whole tree root.
-  {
-    root = new_subtree_root;
-    new_subtree_root->parent.reset();
-  }
-  set_left_child(new_subtree_root, old_subtree_root);
-  set_right_child(old_subtree_root, orphan);
-
-  if (old_subtree_root->balance_factor == BALANCED)
+  const int limit = 1 + _balance_slack;
+  const bool insertion = delta > 0;
+  std::size_t length = 0;
+  _tracer.trace("relaxed retrace");
+  while (parent && delta != 0)
   {
-    new_subtree_root->balance_factor = RIGHT_HEAVY;
-    old_subtree_root->balance_factor = LEFT_HEAVY;
+    ++length;
+    const int before = _heavy(side) * parent->balance_factor;
+    const int after = before + delta;
+    _tracer.trace("relaxed retrace: changed height on side, by", side, delta);
+    parent->balance_factor = static_cast<int8_t>(_heavy(side) * after);
+    delta = std::max(after, 0) - std::max(before, 0);
+    if (std::abs(after) > 1)
+      _out_of_balance = true;
+    node* current = parent;
+    if (std::abs(after) > limit)
+    {
+      const int taller = after > 0 ? side : !side;
+      node* taller_child = parent->child[taller];
+      if (_heavy(taller) * taller_child->balance_factor < 0)
+      {
+        _tracer.trace("relaxed retrace: past the slack, taller child heavy on the inner side, double rotation");
+        _tracer.double_rotated();
+        const int lean = _heavy(taller) * parent->balance_factor;
+        const int change = _rotated_height_change(taller_child, taller);
+        _rotate(taller_child, taller);
+        parent->balance_factor = static_cast<int8_t>(parent->balance_factor + _heavy(taller) * change);
+        delta += std::max(lean + change, 0) - std::max(lean, 0);
+      }
+      else
+        _tracer.trace("relaxed retrace: past the slack, single rotation");
+      delta += _rotated_height_change(parent, !taller);
+      current = _rotate(parent, !taller);
+    }
+    parent = current->parent;
+    if (parent)
+      side = current->side();
   }
+  if (insertion)
+    _tracer.insertion_retraced(length);
   else
-  {
-    new_subtree_root->balance_factor = BALANCED;
-    old_subtree_root->balance_factor = BALANCED;
-  }
-  return new_subtree_root;
+    _tracer.deletion_retraced(length);
 }
 
-// Perform right rotation around given node.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node>
-avltree<K, V>::_right_rotate(shared_ptr<avltree<K, V>::node> old_subtree_root)
+// Heights relative to the rising child's: the rotation keeps the heights of the three subtrees it
+// moves, so only the two nodes' own heights change.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+int avltree<K, V, Alloc, Augment, Tracer, Compare>::_rotated_height_change(const node* subtree_root, int side)
 {
-  if (DBG) { cout << "performing right rotation..." << endl; }
-  shared_ptr<node> new_subtree_root = old_subtree_root->left_child;
-  shared_ptr<node> grandparent = old_subtree_root->parent.lock();
-  shared_ptr<node> orphan = new_subtree_root->right_child;  // may be nullptr
-
-  if (DBG) { cout << "  old root = " << old_subtree_root->value << endl; }
-  if (DBG) { cout << "  new root = " << new_subtree_root->value << endl; }
-
-  if (old_subtree_root->is_left_child())
-    set_left_child(grandparent, new_subtree_root);
-  else if (old_subtree_root->is_right_child())
-    set_right_child(grandparent, new_subtree_root);
-  else // old_subtree_root is whole tree root.
-  {
-    root = new_subtree_root;
-    new_subtree_root->parent.reset();
-  }
-  set_right_child(new_subtree_root, old_subtree_root);
-  set_left_child(old_subtree_root, orphan);
-
-  if (old_subtree_root->balance_factor == BALANCED)
-  {
-    new_subtree_root->balance_factor = LEFT_HEAVY;
-    old_subtree_root->balance_factor = RIGHT_HEAVY;
-  }
-  else
-  {
-    new_subtree_root->balance_factor = BALANCED;
-    old_subtree_root->balance_factor = BALANCED;
-  }
-  return new_subtree_root;
+  const node* const rising = subtree_root->child[!side];
+  const int staying = -_heavy(!side) * subtree_root->balance_factor;  // subtree_root->child[side]
+  const int rising_lean = _heavy(!side) * rising->balance_factor;
+  const int orphan = -1 - std::max(0, rising_lean);                   // rising->child[side]
+  const int outer = -1 - std::max(0, -rising_lean);                   // rising->child[!side]
+  const int lowered = 1 + std::max(staying, orphan);
+  return 1 + std::max(lowered, outer) - (1 + std::max(staying, 0));
 }
 
-// Perform left-right rotation around a given node.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node> 
-avltree<K, V>::_left_right_rotate(shared_ptr<avltree<K, V>::node> old_subtree_root)
+// Strict AVL retraces need every balance factor within one, so the tree is rebalanced first.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::set_balance_slack(int slack)
 {
-  if (DBG) { cout << "performing left-right rotation..." << endl; }
-  _left_rotate(old_subtree_root->left_child);
-  return _right_rotate(old_subtree_root);
+  _balance_slack = std::max(0, std::min(slack, static_cast<int>(max_balance_slack)));
+  if (_balance_slack == 0)
+    rebalance();
 }
 
-// Perform right-left rotation around a given node.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node> 
-avltree<K, V>::_right_left_rotate(shared_ptr<avltree<K, V>::node> old_subtree_root)
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::rebalance()
 {
-  if (DBG) { cout << "performing right-left rotation..." << endl; }
-  _right_rotate(old_subtree_root->right_child);
-  return _left_rotate(old_subtree_root);
+  if (!_out_of_balance)
+    return;
+  int height;
+  _rebalance(root, height);
+  _out_of_balance = false;
 }
 
-
-
-// ============================================================================================ //
-// |                        `avltree::node` method definitions                                | //
-// ============================================================================================ //
-
-// returns true if the node is the left child of its parent.
-template <typename K, typename V>
-bool avltree<K, V>::node::is_left_child() const
+// Post-order, so a node's subtrees are balanced, and their heights known, before it is looked at.
+// A node out of balance is then the pivot of a join of its own subtrees.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+void avltree<K, V, Alloc, Augment, Tracer, Compare>::_rebalance(node* subtree_root, int& height)
 {
-  shared_ptr<avltree<K, V>::node> parent_sp = parent.lock();
-  if (parent_sp)
+  if (!subtree_root)
   {
-    if (parent_sp->left_child)
-    {
-      return key == parent_sp->left_child->key;
-    }
+    height = 0;
+    return;
   }
-  return false;
-}
-
-// returns true if the node is the right child of its parent.
-template <typename K, typename V>
-bool avltree<K, V>::node::is_right_child() const
-{
-  shared_ptr<avltree<K, V>::node> parent_sp = parent.lock();
-  if (parent_sp)
+  int left_height, right_height;
+  _rebalance(subtree_root->child[LEFT], left_height);
+  _rebalance(subtree_root->child[RIGHT], right_height);
+  if (std::abs(left_height - right_height) > 1)
   {
-    if (parent_sp->right_child)
+    node* const parent = subtree_root->parent;
+    const int side = parent ? subtree_root->side() : LEFT;
+    node* const tree_root = root;
+    node* const joined = _join(subtree_root->child[LEFT], left_height, subtree_root, subtree_root->child[RIGHT],
+                               right_height, height);
+    if (parent)
     {
-      return key == parent_sp->right_child->key;
+      root = tree_root;
+      set_child(parent, side, joined);
     }
+    else
+      root = joined;
+    return;
   }
-  return false;
+  subtree_root->balance_factor = static_cast<int8_t>(left_height - right_height);
+  height = 1 + std::max(left_height, right_height);
 }
 
-// get the sibling node of a parent or nullptr if there is none.
-template <typename K, typename V>
-shared_ptr<typename avltree<K, V>::node> avltree<K, V>::node::sibling() const
+// Perform a single rotation around given node, moving it down to `side`. The balance factors are
+// updated for any starting balance factors, so the double rotations can be built out of single
+// ones.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_rotate(node* old_subtree_root, int side)
 {
-  if (is_left_child())
-    return parent.lock()->left_child;
-  else
-    return parent.lock()->right_child;
+  node* new_subtree_root = old_subtree_root->child[!side];
+  node* orphan = new_subtree_root->child[side];  // may be nullptr
+  _tracer.trace("rotate to side, old subtree root, new subtree root", side, old_subtree_root->key,
+                new_subtree_root->key);
+  _tracer.rotated();
+
+  _replace_child(old_subtree_root, new_subtree_root);
+  set_child(new_subtree_root, side, old_subtree_root);
+  set_child(old_subtree_root, !side, orphan);
+
+  // balance factor = left height - right height. The heights of the three moved subtrees are
+  // unchanged so the new factors follow from the old ones. Measuring the factors towards `side`
+  // (multiplying by `heavy`) makes the update the same for both directions.
+  const int heavy = _heavy(side);
+  const int old_root_bf = heavy * old_subtree_root->balance_factor;
+  const int new_root_bf = heavy * new_subtree_root->balance_factor;
+  const int old_root_new_bf = old_root_bf + 1 - std::min(new_root_bf, 0);
+  const int new_root_new_bf = new_root_bf + 1 + std::max(old_root_new_bf, 0);
+  old_subtree_root->balance_factor = static_cast<int8_t>(heavy * old_root_new_bf);
+  new_subtree_root->balance_factor = static_cast<int8_t>(heavy * new_root_new_bf);
+
+  // The old root is now the new root's child, so it is updated first. Data below them which is
+  // out of date gets fixed by the caller's path update, which covers the ancestors of the change.
+  Augment::update(*old_subtree_root);
+  Augment::update(*new_subtree_root);
+  return new_subtree_root;
 }
 
-// Assuming tree is AVL and both children have correct balance factors...
-template <typename K, typename V>
-void avltree<K, V>::node::correct_balance()
+// Perform a double rotation around a given node.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+typename avltree<K, V, Alloc, Augment, Tracer, Compare>::node*
+avltree<K, V, Alloc, Augment, Tracer, Compare>::_double_rotate(node* old_subtree_root, int side)
 {
-  if (left_child && right_child)
-  {
-    if (abs(left_child->balance_factor) == abs(right_child->balance_factor))  /// WRONG!!
-      balance_factor = 0;
-    else if (left_child->balance_factor)
-      balance_factor = LEFT_HEAVY;
-    else
-      balance_factor = RIGHT_HEAVY;
-  }
-  else if (left_child)
-    balance_factor = LEFT_HEAVY;
-  else
-    balance_factor = RIGHT_HEAVY;
+  _tracer.trace("double rotate to side", side);
+  _tracer.double_rotated();
+  _rotate(old_subtree_root->child[!side], !side);
+  return _rotate(old_subtree_root, side);
 }
 
 #endif
@@ -0,0 +1,681 @@
+/*
+bench-avl.cpp
+Copyright (c) Eromid (Olly) 2017
+
+Benchmarks for the AVL tree implementation in avltree.h.
+Build with optimisations, e.g. `g++ -std=c++11 -O2 -DNDEBUG -pthread bench-avl.cpp -o bench-avl`.
+*/
+
+#include "avltree.h"
+#include "node-pool.h"
+#include "concurrent-avltree.h"
+#include "compact-avltree.h"
+#include "frozen-avltree.h"
+#include "mapped-avltree.h"
+#include "checkpoint-avltree.h"
+#include "parallel-avltree.h"
+#include "bounded-avltree.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <iostream>
+using std::cout;
+using std::endl;
+using std::left;
+using std::right;
+
+#include <iomanip>
+using std::setw;
+
+using bench_clock = std::chrono::steady_clock;
+
+// Stops the optimiser discarding results we don't otherwise use.
+static volatile double sink;
+
+// Print one result line: nanoseconds per operation for `n_ops` operations taking `elapsed`.
+void report(const char* tree_name, const char* workload, std::size_t n, bench_clock::duration elapsed,
+            std::size_t n_ops)
+{
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / n_ops;
+  cout << left << setw(18) << tree_name << setw(20) << workload << right << setw(10) << n
+       << setw(12) << std::fixed << std::setprecision(1) << ns << " ns/op" << endl;
+}
+
+// Insert, look up and remove `keys` (in that order), timing each phase.
+template <typename Tree, typename Key>
+void bench_workload(const char* tree_name, const char* order, const std::vector<Key>& keys)
+{
+  const std::string insert_name = std::string("insert ") + order;
+  const std::string get_name = std::string("get ") + order;
+  const std::string remove_name = std::string("remove ") + order;
+  Tree tree;
+
+  bench_clock::time_point start = bench_clock::now();
+  for (std::size_t i = 0; i < keys.size(); ++i)
+    tree.insert(keys[i], static_cast<double>(i));
+  report(tree_name, insert_name.c_str(), keys.size(), bench_clock::now() - start, keys.size());
+
+  double total = 0.0;
+  start = bench_clock::now();
+  for (const Key& key : keys)
+    total += tree.get(key).value();
+  report(tree_name, get_name.c_str(), keys.size(), bench_clock::now() - start, keys.size());
+  sink = total;
+
+  start = bench_clock::now();
+  for (const Key& key : keys)
+    tree.remove(key);
+  report(tree_name, remove_name.c_str(), keys.size(), bench_clock::now() - start, keys.size());
+}
+
+// Make the i'th key of a sequence. String keys share a long prefix, like paths or URLs do.
+template <typename Key> Key make_key(std::size_t i);
+template <> int make_key<int>(std::size_t i) { return static_cast<int>(i); }
+template <> std::string make_key<std::string>(std::size_t i)
+{
+  std::string digits = std::to_string(i);
+  return "https://example.com/objects/" + std::string(10 - digits.size(), '0') + digits;
+}
+
+// Run every workload over a tree type for a range of sizes.
+template <typename Tree, typename Key>
+void bench_tree(const char* tree_name)
+{
+  static const std::size_t sizes[] = { 1000, 100000, 1000000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<Key> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+      keys[i] = make_key<Key>(i);
+    bench_workload<Tree>(tree_name, "sequential", keys);
+
+    std::mt19937 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    bench_workload<Tree>(tree_name, "random", keys);
+  }
+}
+
+// Compare building a tree from sorted input one insert at a time against a bulk load.
+template <typename Tree, typename Key>
+void bench_bulk_load(const char* tree_name)
+{
+  static const std::size_t sizes[] = { 1000, 100000, 1000000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<Key, double>> sorted(n);
+    for (std::size_t i = 0; i < n; ++i)
+      sorted[i] = std::make_pair(make_key<Key>(i), static_cast<double>(i));
+
+    bench_clock::time_point start = bench_clock::now();
+    {
+      Tree tree;
+      for (const std::pair<Key, double>& element : sorted)
+        tree.insert(element.first, element.second);
+      report(tree_name, "load by insert", n, bench_clock::now() - start, n);
+    }
+    start = bench_clock::now();
+    {
+      Tree tree(sorted.begin(), sorted.end());
+      report(tree_name, "load sorted", n, bench_clock::now() - start, n);
+    }
+  }
+}
+
+// Compare copying a tree against inserting its elements into a new one, and time tearing it down.
+// The tree is built from shuffled keys, so its nodes are scattered through memory.
+template <typename Tree>
+void bench_copy_and_clear(const char* tree_name)
+{
+  static const std::size_t sizes[] = { 1000000, 10000000 };
+  for (std::size_t n : sizes)
+  {
+    Tree tree;
+    for (std::size_t i = 0; i < n; ++i)
+      tree.insert(static_cast<int>(i * 2654435761u % n), 1.0);
+
+    bench_clock::time_point start = bench_clock::now();
+    {
+      const Tree copy(tree);
+      report(tree_name, "copy", n, bench_clock::now() - start, n);
+    }
+    start = bench_clock::now();
+    {
+      Tree copy;
+      for (const auto& element : tree)
+        copy.insert(element.first, element.second);
+      report(tree_name, "copy by insert", n, bench_clock::now() - start, n);
+    }
+    start = bench_clock::now();
+    tree.clear();
+    report(tree_name, "clear", n, bench_clock::now() - start, n);
+  }
+}
+
+// Compare starting up by building a tree from sorted data against opening a saved snapshot, and
+// random lookups in the snapshot's mapping (the file is in the page cache, as just written).
+void bench_mapped()
+{
+  static const std::size_t sizes[] = { 1000000, 10000000 };
+  const std::string path = "bench-avl-snapshot.tmp";
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<int, double>> sorted(n);
+    for (std::size_t i = 0; i < n; ++i)
+      sorted[i] = std::make_pair(static_cast<int>(i), static_cast<double>(i));
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+      keys[i] = static_cast<int>(i);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+
+    bench_clock::time_point start = bench_clock::now();
+    {
+      const avltree<int, double> tree(sorted.begin(), sorted.end());
+      report("avltree", "start by building", n, bench_clock::now() - start, 1);
+      start = bench_clock::now();
+      save_mapped(tree, path);
+      report("mapped", "save", n, bench_clock::now() - start, 1);
+    }
+    start = bench_clock::now();
+    const mapped_avltree<int, double> mapped = open_mapped<int, double>(path);
+    report("mapped", "start by opening", n, bench_clock::now() - start, 1);
+    double total = 0.0;
+    start = bench_clock::now();
+    for (int key : keys)
+      total += *mapped.find(key);
+    report("mapped", "get random", n, bench_clock::now() - start, n);
+    sink = total;
+  }
+  std::remove(path.c_str());
+}
+
+// Compare the first checkpoint of a tree, which holds everything, against checkpoints after a few
+// random updates.
+void bench_checkpoint()
+{
+  static const std::size_t n = 1000000;
+  static const std::size_t changes[] = { 100, 10000 };
+  checkpointed_avltree<int, double> tree;
+  for (std::size_t i = 0; i < n; ++i)
+    tree.insert(static_cast<int>(i), 1.0);
+  std::ostringstream full;
+  bench_clock::time_point start = bench_clock::now();
+  tree.checkpoint(full);
+  report("checkpointed", "full checkpoint", n, bench_clock::now() - start, 1);
+
+  std::mt19937 rng(42);
+  for (std::size_t k : changes)
+  {
+    for (std::size_t i = 0; i < k; ++i)
+      tree.insert(static_cast<int>(rng() % n), 2.0);
+    std::ostringstream delta;
+    start = bench_clock::now();
+    tree.checkpoint(delta);
+    report("checkpointed", k == 100 ? "checkpoint 100 changes" : "checkpoint 10K changes", n,
+           bench_clock::now() - start, 1);
+  }
+}
+
+// An ordered LRU cache built the usual way, for comparison: a map for the order, a list for the
+// order of use and a hash map from keys to list positions.
+struct side_list_cache
+{
+  explicit side_list_cache(std::size_t max_entries) : max_entries(max_entries) {}
+
+  void insert(int key, double value)
+  {
+    elements[key] = value;
+    const auto found = positions.find(key);
+    if (found != positions.end())
+      uses.erase(found->second);
+    uses.push_back(key);
+    positions[key] = std::prev(uses.end());
+    if (elements.size() > max_entries)
+    {
+      elements.erase(uses.front());
+      positions.erase(uses.front());
+      uses.pop_front();
+    }
+  }
+
+  std::map<int, double> elements;
+  std::list<int> uses;
+  std::unordered_map<int, std::list<int>::iterator> positions;
+  std::size_t max_entries;
+};
+
+// Inserts into a full cache, each evicting the least recently used element, against the map, list
+// and hash map above; then expiring a tenth of a cache at once against removing those keys.
+void bench_bounded()
+{
+  static const std::size_t capacity = 100000;
+  static const std::size_t n_ops = 1000000;
+  std::mt19937 rng(42);
+  std::vector<int> keys(n_ops);
+  for (int& key : keys)
+    key = static_cast<int>(rng() % (4 * capacity));
+
+  bounded_avltree<int, double> bounded(capacity);
+  bench_clock::time_point start = bench_clock::now();
+  for (int key : keys)
+    bounded.insert(key, 1.0);
+  report("bounded", "insert evicting", capacity, bench_clock::now() - start, n_ops);
+  side_list_cache side_list(capacity);
+  start = bench_clock::now();
+  for (int key : keys)
+    side_list.insert(key, 1.0);
+  report("map+list+hash", "insert evicting", capacity, bench_clock::now() - start, n_ops);
+
+  // A tenth of the elements, scattered over the keys, expire first.
+  using time_point = bounded_avltree<int, double>::time_point;
+  const time_point now = bench_clock::now();
+  bounded_avltree<int, double> timed(bounded_avltree<int, double>::unlimited);
+  bounded_avltree<int, double> keyed(bounded_avltree<int, double>::unlimited);
+  std::vector<int> expiring;
+  for (std::size_t i = 0; i < capacity; ++i)
+  {
+    const int key = static_cast<int>(i * 2654435761u % capacity);
+    const bool soon = i % 10 == 0;
+    timed.insert(key, 1.0, soon ? now : now + std::chrono::hours(1));
+    keyed.insert(key, 1.0);
+    if (soon)
+      expiring.push_back(key);
+  }
+  start = bench_clock::now();
+  timed.expire_before(now + std::chrono::seconds(1));
+  report("bounded", "expire_before", capacity, bench_clock::now() - start, expiring.size());
+  start = bench_clock::now();
+  for (int key : expiring)
+    keyed.remove(key);
+  report("bounded", "remove each", capacity, bench_clock::now() - start, expiring.size());
+}
+
+// Compare building a tree from shuffled input one insert at a time against `parallel_assign`, on one
+// thread and on every core.
+void bench_parallel_build()
+{
+  static const std::size_t sizes[] = { 1000000, 10000000 };
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<int, double>> shuffled(n);
+    for (std::size_t i = 0; i < n; ++i)
+      shuffled[i] = std::make_pair(static_cast<int>(i), static_cast<double>(i));
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+
+    bench_clock::time_point start = bench_clock::now();
+    {
+      avltree<int, double> tree;
+      for (const std::pair<int, double>& element : shuffled)
+        tree.insert(element.first, element.second);
+      report("avltree", "load by insert", n, bench_clock::now() - start, n);
+    }
+    for (unsigned threads : { 1u, cores })
+    {
+      start = bench_clock::now();
+      avltree<int, double> tree;
+      parallel_assign(tree, shuffled.begin(), shuffled.end(), threads);
+      report("avltree", threads == 1 ? "parallel_assign/1" : "parallel_assign/all", n,
+             bench_clock::now() - start, n);
+    }
+  }
+}
+
+// Compare appending increasing keys with `insert` against inserting each after the last.
+template <typename Key>
+void bench_hinted_insert(const char* tree_name)
+{
+  static const std::size_t sizes[] = { 1000, 100000, 1000000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<Key> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+      keys[i] = make_key<Key>(i);
+
+    bench_clock::time_point start = bench_clock::now();
+    {
+      avltree<Key, double> tree;
+      for (const Key& key : keys)
+        tree.insert(key, 1.0);
+      report(tree_name, "append", n, bench_clock::now() - start, n);
+    }
+    start = bench_clock::now();
+    {
+      avltree<Key, double> tree;
+      auto last = tree.end();
+      for (const Key& key : keys)
+        last = tree.insert(last, key, 1.0);
+      report(tree_name, "append hinted", n, bench_clock::now() - start, n);
+    }
+  }
+}
+
+// Compare random lookups in a tree against its frozen copy, for trees much larger than cache.
+void bench_frozen()
+{
+  static const std::size_t sizes[] = { 1000000, 10000000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<int, double>> sorted(n);
+    for (std::size_t i = 0; i < n; ++i)
+      sorted[i] = std::make_pair(static_cast<int>(i), static_cast<double>(i));
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+      keys[i] = static_cast<int>(i);
+    std::mt19937 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    const avltree<int, double> tree(sorted.begin(), sorted.end());
+    double total = 0.0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int key : keys)
+      total += *tree.find(key);
+    report("avltree", "get random", n, bench_clock::now() - start, n);
+
+    const frozen_avltree<int, double> frozen = freeze(tree);
+    start = bench_clock::now();
+    for (int key : keys)
+      total += *frozen.find(key);
+    report("frozen", "get random", n, bench_clock::now() - start, n);
+    sink = total;
+  }
+}
+
+// Compare looking up a batch of random keys one at a time against `get_many`.
+void bench_get_many()
+{
+  static const std::size_t sizes[] = { 100000, 1000000, 10000000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<int, double>> sorted(n);
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      sorted[i] = std::make_pair(static_cast<int>(i), static_cast<double>(i));
+      keys[i] = static_cast<int>(i);
+    }
+    std::mt19937 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    keys.resize(std::min<std::size_t>(n, 1000000));
+    const avltree<int, double> tree(sorted.begin(), sorted.end());
+
+    double total = 0.0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int key : keys)
+      total += tree.get(key).value();
+    report("avltree", "get each", n, bench_clock::now() - start, keys.size());
+
+    std::vector<optional<double>> results(keys.size());
+    start = bench_clock::now();
+    tree.get_many(keys.begin(), keys.end(), results.begin());
+    report("avltree", "get_many", n, bench_clock::now() - start, keys.size());
+    for (const optional<double>& result : results)
+      total += result.value();
+    sink = total;
+  }
+}
+
+// A large value type whose default constructor zeroes it.
+struct bench_record
+{
+  bench_record() : fields() {}
+  explicit bench_record(double x) : fields() { fields[0] = x; }
+  double fields[16];
+};
+
+// Time `get` for missing and present keys with a large value type, against `get_ref`, which
+// doesn't copy the value.
+void bench_get_results()
+{
+  static const std::size_t sizes[] = { 16, 1000, 100000 };
+  for (std::size_t n : sizes)
+  {
+    std::vector<std::pair<int, bench_record>> sorted(n);
+    std::vector<int> keys(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      sorted[i] = std::make_pair(static_cast<int>(2 * i), bench_record(static_cast<double>(i)));
+      keys[i] = static_cast<int>(2 * i);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+    const avltree<int, bench_record> tree(sorted.begin(), sorted.end());
+    const std::size_t rounds = 1000000 / n;
+
+    double total = 0.0;
+    bench_clock::time_point start = bench_clock::now();
+    for (std::size_t round = 0; round < rounds; ++round)
+      for (int key : keys)
+        total += tree.get(key + 1).has_value();
+    report("avltree/record", "get missing", n, bench_clock::now() - start, rounds * n);
+    start = bench_clock::now();
+    for (std::size_t round = 0; round < rounds; ++round)
+      for (int key : keys)
+        total += tree.get(key).value().fields[0];
+    report("avltree/record", "get present", n, bench_clock::now() - start, rounds * n);
+    start = bench_clock::now();
+    for (std::size_t round = 0; round < rounds; ++round)
+      for (int key : keys)
+        total += tree.get_ref(key).value().fields[0];
+    report("avltree/record", "get_ref present", n, bench_clock::now() - start, rounds * n);
+    sink = total;
+  }
+}
+
+// Compare applying sorted batches of updates to a big tree key by key against the batch calls.
+template <typename Tree>
+void bench_batches(const char* tree_name)
+{
+  static const std::size_t tree_size = 1000000;
+  static const std::size_t batch_sizes[] = { 1000, 10000, 100000 };
+  std::vector<std::pair<int, double>> sorted(tree_size);
+  for (std::size_t i = 0; i < tree_size; ++i)
+    sorted[i] = std::make_pair(static_cast<int>(2 * i), static_cast<double>(i));  // even keys
+
+  std::mt19937 rng(42);
+  for (std::size_t batch_size : batch_sizes)
+  {
+    // Odd keys scattered over the whole key range, sorted.
+    std::vector<std::pair<int, double>> batch(batch_size);
+    std::vector<int> keys(batch_size);
+    for (std::size_t i = 0; i < batch_size; ++i)
+      batch[i] = std::make_pair(static_cast<int>(2 * (rng() % tree_size) + 1), 1.0);
+    std::sort(batch.begin(), batch.end());
+    for (std::size_t i = 0; i < batch_size; ++i)
+      keys[i] = batch[i].first;
+
+    Tree one_by_one(sorted.begin(), sorted.end());
+    bench_clock::time_point start = bench_clock::now();
+    for (const std::pair<int, double>& element : batch)
+      one_by_one.insert(element.first, element.second);
+    report(tree_name, "insert each", batch_size, bench_clock::now() - start, batch_size);
+    start = bench_clock::now();
+    for (int key : keys)
+      one_by_one.remove(key);
+    report(tree_name, "remove each", batch_size, bench_clock::now() - start, batch_size);
+
+    Tree batched(sorted.begin(), sorted.end());
+    start = bench_clock::now();
+    batched.insert_batch(batch.begin(), batch.end());
+    report(tree_name, "insert_batch", batch_size, bench_clock::now() - start, batch_size);
+    start = bench_clock::now();
+    batched.erase_batch(keys.begin(), keys.end());
+    report(tree_name, "erase_batch", batch_size, bench_clock::now() - start, batch_size);
+  }
+}
+
+// Random inserts into one tree with each balance slack, counting the rotations they make, and
+// then the `rebalance` which brings the tree back to AVL balance.
+void bench_relaxed_balance()
+{
+  using Tree = avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, collect_stats>;
+  static const std::size_t n = 1000000;
+  static const int slacks[] = { 0, 2, 8 };
+  std::vector<int> keys(n);
+  for (std::size_t i = 0; i < n; ++i)
+    keys[i] = static_cast<int>(i);
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+
+  for (int slack : slacks)
+  {
+    const std::string name = "avltree/slack " + std::to_string(slack);
+    Tree tree;
+    tree.set_balance_slack(slack);
+    bench_clock::time_point start = bench_clock::now();
+    for (int key : keys)
+      tree.insert(key, 1.0);
+    report(name.c_str(), "insert random", n, bench_clock::now() - start, n);
+    const avltree_stats stats = tree.stats();
+    cout << left << setw(18) << name << setw(20) << "rotations" << right << setw(10) << n
+         << setw(12) << stats.single_rotations + stats.double_rotations << endl;
+    start = bench_clock::now();
+    tree.rebalance();
+    report(name.c_str(), "rebalance", n, bench_clock::now() - start, n);
+  }
+}
+
+// Compare uniting a big tree with smaller ones key by key against `set_union`, and moving the top
+// half of a tree to another by removing and inserting against `split`.
+void bench_set_operations()
+{
+  static const std::size_t tree_size = 1000000;
+  static const std::size_t other_sizes[] = { 1000, 100000, 1000000 };
+  std::vector<std::pair<int, double>> sorted(tree_size);
+  for (std::size_t i = 0; i < tree_size; ++i)
+    sorted[i] = std::make_pair(static_cast<int>(2 * i), static_cast<double>(i));  // even keys
+
+  std::mt19937 rng(42);
+  for (std::size_t other_size : other_sizes)
+  {
+    std::vector<std::pair<int, double>> other_elements(other_size);
+    for (std::size_t i = 0; i < other_size; ++i)
+      other_elements[i] = std::make_pair(static_cast<int>(rng() % (2 * tree_size)), 1.0);
+    std::sort(other_elements.begin(), other_elements.end());
+
+    avltree<int, double> one_by_one(sorted.begin(), sorted.end());
+    avltree<int, double> other(other_elements.begin(), other_elements.end());
+    bench_clock::time_point start = bench_clock::now();
+    for (auto element : other)
+      one_by_one.try_emplace(element.first, element.second);
+    report("avltree", "union by insert", other_size, bench_clock::now() - start, other_size);
+
+    avltree<int, double> united(sorted.begin(), sorted.end());
+    start = bench_clock::now();
+    united.set_union(std::move(other));
+    report("avltree", "set_union", other_size, bench_clock::now() - start, other_size);
+  }
+
+  avltree<int, double> halves(sorted.begin(), sorted.end());
+  avltree<int, double> upper;
+  bench_clock::time_point start = bench_clock::now();
+  for (std::size_t i = tree_size / 2; i < tree_size; ++i)
+  {
+    upper.insert(sorted[i].first, sorted[i].second);
+    halves.remove(sorted[i].first);
+  }
+  report("avltree", "split by moving", tree_size, bench_clock::now() - start, 1);
+  halves.join(std::move(upper));
+  start = bench_clock::now();
+  upper = halves.split(sorted[tree_size / 2].first);
+  report("avltree", "split", tree_size, bench_clock::now() - start, 1);
+}
+
+// A tree behind one mutex, the simplest way to share a tree, to compare `concurrent_avltree` with.
+class mutex_avltree
+{
+public:
+  optional<double> get(int key) const
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _tree.get(key);
+  }
+  void insert(int key, double value)
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _tree.insert(key, value);
+  }
+private:
+  mutable std::mutex _mutex;
+  avltree<int, double> _tree;
+};
+
+// Time reader threads searching a shared tree at once; each thread does the same number of
+// searches, so with reads that scale the time per search drops as threads are added.
+template <typename Tree>
+void bench_parallel_reads(const char* tree_name)
+{
+  static const std::size_t tree_size = 100000;
+  static const std::size_t searches_per_thread = 1000000;
+  static const unsigned thread_counts[] = { 1, 2, 4, 8 };
+  Tree tree;
+  for (std::size_t i = 0; i < tree_size; ++i)
+    tree.insert(static_cast<int>(i), static_cast<double>(i));
+
+  for (unsigned thread_count : thread_counts)
+  {
+    std::vector<std::thread> threads;
+    std::vector<double> totals(thread_count);
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned t = 0; t < thread_count; ++t)
+    {
+      threads.push_back(std::thread([&tree, &totals, t]() {
+        std::mt19937 rng(t);
+        double total = 0.0;
+        for (std::size_t i = 0; i < searches_per_thread; ++i)
+          total += tree.get(static_cast<int>(rng() % tree_size)).value();
+        totals[t] = total;
+      }));
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+    const std::string workload = "get x" + std::to_string(thread_count) + " threads";
+    report(tree_name, workload.c_str(), tree_size, bench_clock::now() - start,
+           searches_per_thread * thread_count);
+    sink = totals[0];
+  }
+}
+
+// Run all the above benchmarks
+int main()
+{
+  bench_tree<avltree<int, double>, int>("avltree");
+  bench_tree<avltree<int, double, node_pool_allocator<int>>, int>("avltree/pool");
+  bench_tree<avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics>, int>("avltree/ranked");
+  bench_tree<compact_avltree<int, double>, int>("compact");
+  bench_tree<avltree<std::string, double>, std::string>("avltree/str");
+  bench_tree<compact_avltree<std::string, double>, std::string>("compact/str");
+  bench_tree<compact_avltree<std::string, double, inline_keys<std::string>>, std::string>("compact/str/inl");
+  bench_tree<avltree<std::string, double, std::allocator<std::pair<const std::string, double>>, no_augmentation,
+                     no_tracing, member_compare>, std::string>("avltree/str/3way");
+  bench_tree<avltree<std::string, double, node_pool_allocator<int>>, std::string>("avltree/str/pool");
+  bench_bulk_load<avltree<int, double>, int>("avltree");
+  bench_bulk_load<avltree<int, double, node_pool_allocator<int>>, int>("avltree/pool");
+  bench_bulk_load<avltree<std::string, double>, std::string>("avltree/str");
+  bench_copy_and_clear<avltree<int, double>>("avltree");
+  bench_copy_and_clear<avltree<int, double, node_pool_allocator<int>>>("avltree/pool");
+  bench_parallel_build();
+  bench_hinted_insert<int>("avltree");
+  bench_hinted_insert<std::string>("avltree/str");
+  bench_batches<avltree<int, double>>("avltree");
+  bench_relaxed_balance();
+  bench_set_operations();
+  bench_get_many();
+  bench_get_results();
+  bench_frozen();
+  bench_mapped();
+  bench_checkpoint();
+  bench_bounded();
+  bench_parallel_reads<mutex_avltree>("mutex avltree");
+  bench_parallel_reads<concurrent_avltree<int, double>>("concurrent");
+  return 0;
+}
@@ -0,0 +1,362 @@
+/*
+bench-suite.cpp
+Copyright (c) Eromid (Olly) 2017
+
+A benchmark suite comparing the trees in this repository against `std::map`, `absl::btree_map`
+and a sorted vector, using Google Benchmark. Build with optimisations, e.g.
+  g++ -std=c++17 -O2 -DNDEBUG -pthread bench-suite.cpp -o bench-suite -lbenchmark
+and run with `./bench-suite [--max_size=N] [Google Benchmark flags]`. Sizes run from 1K up to
+`--max_size` (default 1M) in powers of ten; 100M takes around 10GB for the node-based containers.
+
+Each benchmark is named container/key/workload/order/size and reports:
+  ns/op       time per insert, get or remove
+  allocs/op   calls to operator new per operation
+  peak_MB     the peak resident set size while the benchmark ran (Linux only, else 0)
+*/
+
+#include "avltree.h"
+#include "node-pool.h"
+#include "compact-avltree.h"
+
+#include <absl/container/btree_map.h>
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Count every allocation, so each benchmark can report how many its operations make. The suite
+// runs on one thread. (GCC takes the replacements' malloc and free for a mismatched pair.)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::size_t allocation_count = 0;
+
+void* operator new(std::size_t size)
+{
+  ++allocation_count;
+  if (void* memory = std::malloc(size ? size : 1))
+    return memory;
+  throw std::bad_alloc();
+}
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+
+// Peak resident set size: reset the kernel's high water mark, then read it back.
+static void reset_peak_rss()
+{
+#if defined(__linux__)
+  std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+static double peak_rss_mb()
+{
+#if defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+#endif
+  return 0.0;
+}
+
+
+
+// ============================================================================================ //
+// |                                        Containers                                        | //
+// ============================================================================================ //
+
+// The containers under test, behind the interface the trees here already have: `insert(key,
+// value)` overwriting, `find(key)` giving a pointer or nullptr, and `remove(key)`.
+template <typename Map>
+class map_adaptor
+{
+public:
+  using key_type = typename Map::key_type;
+  using mapped_type = typename Map::mapped_type;
+
+  void insert(const key_type& key, const mapped_type& value) { _map.insert_or_assign(key, value); }
+  const mapped_type* find(const key_type& key) const
+  {
+    const auto found = _map.find(key);
+    return found == _map.end() ? nullptr : &found->second;
+  }
+  void remove(const key_type& key) { _map.erase(key); }
+
+private:
+  Map _map;
+};
+
+// Pairs kept sorted by key in one array: searches are binary searches, updates shift the tail.
+template <typename K, typename V>
+class sorted_vector
+{
+public:
+  void insert(const K& key, const V& value)
+  {
+    const auto position = _lower_bound(key);
+    if (position != _elements.end() && position->first == key)
+      position->second = value;
+    else
+      _elements.insert(position, std::make_pair(key, value));
+  }
+  const V* find(const K& key) const
+  {
+    const auto position = const_cast<sorted_vector*>(this)->_lower_bound(key);
+    return position != _elements.end() && position->first == key ? &position->second : nullptr;
+  }
+  void remove(const K& key)
+  {
+    const auto position = _lower_bound(key);
+    if (position != _elements.end() && position->first == key)
+      _elements.erase(position);
+  }
+
+private:
+  typename std::vector<std::pair<K, V>>::iterator _lower_bound(const K& key)
+  {
+    return std::lower_bound(_elements.begin(), _elements.end(), key,
+                            [](const std::pair<K, V>& element, const K& k) { return element.first < k; });
+  }
+
+  std::vector<std::pair<K, V>> _elements;
+};
+
+
+
+// ============================================================================================ //
+// |                                       Workloads                                          | //
+// ============================================================================================ //
+
+// The i'th key in ascending order. 64-bit keys are spread well beyond 32 bits; string keys share a
+// long prefix, like paths or URLs do.
+template <typename Key> Key make_key(std::size_t i);
+template <> int make_key<int>(std::size_t i) { return static_cast<int>(i); }
+template <> std::uint64_t make_key<std::uint64_t>(std::size_t i)
+{
+  return (std::uint64_t(1) << 40) + static_cast<std::uint64_t>(i) * 0x9E3779B1u;
+}
+template <> std::string make_key<std::string>(std::size_t i)
+{
+  std::string digits = std::to_string(i);
+  return "https://example.com/objects/" + std::string(10 - digits.size(), '0') + digits;
+}
+
+// Draws from a Zipfian distribution over [0, n) with exponent `theta`, so that a few items are
+// drawn very often and most rarely, using the method of Gray et al., "Quickly generating
+// billion-record synthetic databases" (as YCSB does). Setting up costs O(n), each draw O(1).
+class zipf_generator
+{
+public:
+  zipf_generator(std::size_t n, double theta) : _n(n), _theta(theta), _zeta_n(_zeta(n, theta))
+  {
+    const double zeta_2 = _zeta(2, theta);
+    _alpha = 1.0 / (1.0 - theta);
+    _eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / _zeta_n);
+  }
+
+  template <typename Rng>
+  std::size_t operator()(Rng& rng)
+  {
+    const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    const double uz = u * _zeta_n;
+    if (uz < 1.0)
+      return 0;
+    if (uz < 1.0 + std::pow(0.5, _theta))
+      return 1;
+    const std::size_t drawn = static_cast<std::size_t>(_n * std::pow(_eta * u - _eta + 1.0, _alpha));
+    return std::min(drawn, _n - 1);
+  }
+
+private:
+  static double _zeta(std::size_t n, double theta)
+  {
+    double sum = 0.0;
+    for (std::size_t i = 1; i <= n; ++i)
+      sum += 1.0 / std::pow(static_cast<double>(i), theta);
+    return sum;
+  }
+
+  std::size_t _n;
+  double _theta;
+  double _zeta_n;
+  double _alpha;
+  double _eta;
+};
+
+enum class key_order { sequential, random, zipfian };
+enum class operation { insert, get, remove };
+
+static const char* order_name(key_order order)
+{
+  return order == key_order::sequential ? "sequential" : order == key_order::random ? "random" : "zipfian";
+}
+static const char* operation_name(operation op)
+{
+  return op == operation::insert ? "insert" : op == operation::get ? "get" : "remove";
+}
+
+// The n keys each operation in a run is given, in the order they're given: every key ascending,
+// every key shuffled, or n Zipfian draws, whose popular keys are scattered over the key range.
+template <typename Key>
+std::vector<Key> workload_keys(std::size_t n, key_order order)
+{
+  std::vector<std::size_t> indices(n);
+  std::mt19937_64 rng(42);
+  if (order == key_order::zipfian)
+  {
+    std::size_t stride = 2654435761u % n;  // a step coprime with n permutes [0, n)
+    while (stride == 0 || std::gcd(stride, n) != 1)
+      ++stride;
+    zipf_generator zipf(n, 0.99);
+    for (std::size_t i = 0; i < n; ++i)
+      indices[i] = (zipf(rng) * stride) % n;
+  }
+  else
+  {
+    for (std::size_t i = 0; i < n; ++i)
+      indices[i] = i;
+    if (order == key_order::random)
+      std::shuffle(indices.begin(), indices.end(), rng);
+  }
+  std::vector<Key> keys(n);
+  for (std::size_t i = 0; i < n; ++i)
+    keys[i] = make_key<Key>(indices[i]);
+  return keys;
+}
+
+// Time one operation over every key of `keys`. Inserts start from an empty container; gets and
+// removes from one holding every key 0..n-1 (so Zipfian removes mostly miss after the first).
+template <typename Container, typename Key>
+void run_workload(benchmark::State& state, operation op, key_order order)
+{
+  const std::size_t n = static_cast<std::size_t>(state.range(0));
+  reset_peak_rss();
+  const std::vector<Key> keys = workload_keys<Key>(n, order);
+  std::vector<Key> all_keys(n);
+  for (std::size_t i = 0; i < n; ++i)
+    all_keys[i] = make_key<Key>(i);
+
+  std::unique_ptr<Container> filled;
+  if (op == operation::get)
+  {
+    filled.reset(new Container());
+    for (std::size_t i = 0; i < n; ++i)
+      filled->insert(all_keys[i], static_cast<double>(i));
+  }
+
+  std::size_t allocations = 0;
+  for (auto _ : state)
+  {
+    std::unique_ptr<Container> container;
+    if (op != operation::get)
+    {
+      state.PauseTiming();
+      container.reset(new Container());
+      if (op == operation::remove)
+        for (std::size_t i = 0; i < n; ++i)
+          container->insert(all_keys[i], static_cast<double>(i));
+      state.ResumeTiming();
+    }
+
+    const std::size_t allocations_before = allocation_count;
+    if (op == operation::insert)
+    {
+      for (std::size_t i = 0; i < n; ++i)
+        container->insert(keys[i], static_cast<double>(i));
+    }
+    else if (op == operation::get)
+    {
+      std::size_t found = 0;
+      for (const Key& key : keys)
+        found += filled->find(key) != nullptr;
+      benchmark::DoNotOptimize(found);
+    }
+    else
+    {
+      for (const Key& key : keys)
+        container->remove(key);
+    }
+    allocations += allocation_count - allocations_before;
+
+    state.PauseTiming();
+    container.reset();
+    state.ResumeTiming();
+  }
+
+  const double operations = static_cast<double>(n) * state.iterations();
+  state.counters["ns/op"] = benchmark::Counter(operations, benchmark::Counter::kIsRate
+                                                           | benchmark::Counter::kInvert);
+  state.counters["allocs/op"] = benchmark::Counter(allocations / operations);
+  state.counters["peak_MB"] = benchmark::Counter(peak_rss_mb());
+}
+
+// Register every workload for one container and key type, for the sizes up to `max_size`
+// (`max_updated_size` for inserts and removes, for containers which update in O(n)).
+template <typename Container, typename Key>
+void register_container(const std::string& name, const char* key_name, std::size_t max_size,
+                        std::size_t max_updated_size)
+{
+  static const operation operations[] = { operation::insert, operation::get, operation::remove };
+  static const key_order orders[] = { key_order::sequential, key_order::random, key_order::zipfian };
+  for (operation op : operations)
+    for (key_order order : orders)
+    {
+      const std::size_t limit = op == operation::get ? max_size : std::min(max_size, max_updated_size);
+      const std::string benchmark_name = name + "/" + key_name + "/" + operation_name(op) + "/" + order_name(order);
+      benchmark::internal::Benchmark* registered = benchmark::RegisterBenchmark(
+        benchmark_name.c_str(), [op, order](benchmark::State& state) { run_workload<Container, Key>(state, op, order); });
+      for (std::size_t n = 1000; n <= limit; n *= 10)
+        registered->Arg(static_cast<int64_t>(n));
+      registered->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+}
+
+template <typename Key>
+void register_key_type(const char* key_name, std::size_t max_size)
+{
+  const std::size_t unlimited = static_cast<std::size_t>(-1);
+  register_container<avltree<Key, double>, Key>("avltree", key_name, max_size, unlimited);
+  register_container<avltree<Key, double, node_pool_allocator<int>>, Key>("avltree/pool", key_name, max_size, unlimited);
+  register_container<compact_avltree<Key, double>, Key>("compact_avltree", key_name, max_size, unlimited);
+  register_container<map_adaptor<std::map<Key, double>>, Key>("std::map", key_name, max_size, unlimited);
+  register_container<map_adaptor<absl::btree_map<Key, double>>, Key>("absl::btree_map", key_name, max_size, unlimited);
+  register_container<sorted_vector<Key, double>, Key>("sorted_vector", key_name, max_size, 100000);
+}
+
+int main(int argc, char** argv)
+{
+  std::size_t max_size = 1000000;
+  for (int i = 1; i < argc; ++i)
+    if (std::strncmp(argv[i], "--max_size=", 11) == 0)
+    {
+      max_size = static_cast<std::size_t>(std::strtoull(argv[i] + 11, nullptr, 10));
+      std::copy(argv + i + 1, argv + argc, argv + i);
+      --argc;
+      --i;
+    }
+
+  register_key_type<int>("int", max_size);
+  register_key_type<std::uint64_t>("u64", max_size);
+  register_key_type<std::string>("string", max_size);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
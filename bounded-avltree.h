@@ -0,0 +1,314 @@
+/*
+bounded-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+An AVL tree used as a cache: bounded in size, evicting the least recently used elements, and
+dropping elements once they expire.
+*/
+
+#ifndef BOUNDED_AVLTREE_H
+#define BOUNDED_AVLTREE_H
+
+#include <chrono>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <utility>
+
+#include "avltree.h"
+
+// The augmentation `bounded_avltree` gives its nodes. The elements are linked into a list in the
+// order they were last used, through the nodes themselves, and each node keeps the earliest expiry
+// in its subtree so that the expired elements can be found without visiting the rest.
+template <typename TimePoint>
+struct cache_entry
+{
+  struct data
+  {
+    data() : older(nullptr), newer(nullptr), expiry(TimePoint::max()), earliest_expiry(TimePoint::max()),
+      bytes(0) {}
+    data* older;                // The element used before this one; null for the oldest.
+    data* newer;                // The element used after this one; null for the newest.
+    TimePoint expiry;           // `TimePoint::max()` if the element doesn't expire.
+    TimePoint earliest_expiry;  // The earliest expiry in this node's subtree.
+    std::size_t bytes;          // What the element counts against the byte limit.
+  };
+
+  template <typename Node>
+  static void update(Node& n)
+  {
+    n.earliest_expiry = n.expiry;
+    for (const Node* child : n.child)
+      if (child && child->earliest_expiry < n.earliest_expiry)
+        n.earliest_expiry = child->earliest_expiry;
+  }
+};
+
+// The bytes an element of a `bounded_avltree` holds outside its node, for the byte limit. This
+// default counts none, which suits keys and values that own no memory; for strings, say, pass a
+// function object returning their capacities instead.
+struct no_extra_bytes
+{
+  template <typename K, typename V>
+  std::size_t operator()(const K&, const V&) const { return 0; }
+};
+
+// An `avltree` which holds at most a given number of elements, or bytes, evicting the least
+// recently used elements to stay within them. Elements can also be given an expiry time, and
+// `expire_before` removes those whose time has come.
+//
+// The order of use is a list linked through the nodes, so there is no second container to keep in
+// step: finding the element to evict takes O(1), and removing it from the tree O(log n). Inserting
+// an element or finding it with `find` or `get` makes it the most recently used; the tree itself
+// (`tree()`) can be searched and iterated in key order without counting as a use.
+//
+// Each element counts `sizeof` its node plus what `Weigh` says, called as `weigh(key, value)`,
+// against the byte limit. `Clock` supplies the time points used for expiry.
+template <typename K, typename V, typename Weigh = no_extra_bytes, typename Clock = std::chrono::steady_clock>
+class bounded_avltree
+{
+public:
+  using time_point = typename Clock::time_point;
+  using tree_type = avltree<K, V, std::allocator<std::pair<const K, V>>, cache_entry<time_point>>;
+
+  // No limit on the number of elements or bytes.
+  static const std::size_t unlimited = std::numeric_limits<std::size_t>::max();
+
+  // An empty tree which will hold at most `max_entries` elements, taking at most `max_bytes`.
+  explicit bounded_avltree(std::size_t max_entries, std::size_t max_bytes = unlimited,
+                           const Weigh& weigh = Weigh()) :
+    _oldest(nullptr), _newest(nullptr), _bytes(0), _evictions(0), _max_entries(max_entries),
+    _max_bytes(max_bytes), _weigh(weigh) {}
+
+  // Take another tree's elements and limits, leaving it empty with no room for any.
+  bounded_avltree(bounded_avltree&& other) : bounded_avltree(0, 0) { swap(other); }
+  bounded_avltree& operator=(bounded_avltree&& other)
+  {
+    swap(other);
+    return *this;
+  }
+  bounded_avltree(const bounded_avltree&) = delete;
+  bounded_avltree& operator=(const bounded_avltree&) = delete;
+
+  // Add a key-value pair, or overwrite the value if the key is present, and make it the most
+  // recently used element. It expires at `expiry`; by default, never. Then the least recently used
+  // elements are evicted until the tree is within its limits again, which evicts this element too
+  // if it takes more than `max_bytes()` on its own.
+  template <typename KeyArg, typename ValueArg>
+  void insert(KeyArg&& key, ValueArg&& value, time_point expiry = time_point::max());
+
+  // A pointer to the value stored under `key`, or nullptr, making it the most recently used
+  // element. Changing the value through the pointer doesn't change what it counts against the
+  // byte limit; `insert` it again for that.
+  template <typename Q>
+  V* find(const Q& key);
+
+  // Find the value associated with a given key, making it the most recently used element.
+  optional<V> get(const K& key)
+  {
+    const V* value = find(key);
+    return value ? optional<V>(*value) : optional<V>();
+  }
+
+  // As `find`, without counting as a use.
+  template <typename Q>
+  const V* peek(const Q& key) const { return _tree.find(key); }
+
+  // Remove the element with the given key. Doesn't matter if it isn't there.
+  void remove(const K& key);
+
+  // Remove every element which expires before `time`, returning how many there were. Only the
+  // subtrees holding such elements are visited, and the rest are joined back together as
+  // `erase_batch` does: O(k log(n / k + 1)) for k elements, however many are left.
+  std::size_t expire_before(time_point time);
+
+  // Remove the elements which have expired by now.
+  std::size_t expire() { return expire_before(Clock::now()); }
+
+  // Change the limits, evicting the least recently used elements to meet them.
+  void set_limits(std::size_t max_entries, std::size_t max_bytes = unlimited);
+  std::size_t max_entries() const { return _max_entries; }
+  std::size_t max_bytes() const { return _max_bytes; }
+
+  // The bytes the elements count against the limit, and the number evicted to stay within the
+  // limits (not counting removed or expired ones).
+  std::size_t bytes() const { return _bytes; }
+  std::size_t evictions() const { return _evictions; }
+
+  // The keys of the least and most recently used elements; there must be some.
+  const K& oldest() const { return static_cast<const node*>(_oldest)->key; }
+  const K& newest() const { return static_cast<const node*>(_newest)->key; }
+
+  // The tree itself, for iterating and range queries in key order.
+  const tree_type& tree() const { return _tree; }
+
+  std::size_t size() const { return _tree.size(); }
+  bool empty() const { return _tree.empty(); }
+
+  // Remove every element.
+  void clear();
+
+  void swap(bounded_avltree& other);
+
+private:
+  using node = typename tree_type::node;
+  using entry = typename cache_entry<time_point>::data;
+
+  // Link an element in as the most recently used, or unlink it, in O(1).
+  void _link_newest(entry* e);
+  void _unlink(entry* e);
+
+  // Evict the least recently used elements until the tree is within its limits.
+  void _evict_to_limits();
+
+  tree_type _tree;
+  entry* _oldest;
+  entry* _newest;
+  std::size_t _bytes;
+  std::size_t _evictions;
+  std::size_t _max_entries;
+  std::size_t _max_bytes;
+  Weigh _weigh;
+};
+
+
+
+// ============================================================================================ //
+// |                             `bounded_avltree` method definitions                         | //
+// ============================================================================================ //
+
+// The node's earliest expiry only needs updating, on the way up, when its own expiry changes;
+// rebalancing on insertion keeps it up to date otherwise.
+template <typename K, typename V, typename Weigh, typename Clock>
+template <typename KeyArg, typename ValueArg>
+void bounded_avltree<K, V, Weigh, Clock>::insert(KeyArg&& key, ValueArg&& value, time_point expiry)
+{
+  const std::pair<node*, bool> result = _tree._try_emplace_node(std::forward<KeyArg>(key),
+                                                                std::forward<ValueArg>(value));
+  node* n = result.first;
+  if (!result.second)
+  {
+    n->value = std::forward<ValueArg>(value);  // not moved from yet, the node was already there
+    _bytes -= n->bytes;
+    _unlink(n);
+  }
+  _link_newest(n);
+  n->bytes = sizeof(node) + _weigh(n->key, n->value);
+  _bytes += n->bytes;
+  if (n->expiry != expiry)
+  {
+    n->expiry = expiry;
+    tree_type::_update_path(n);
+  }
+  _evict_to_limits();
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+template <typename Q>
+V* bounded_avltree<K, V, Weigh, Clock>::find(const Q& key)
+{
+  int order;
+  node* found = _tree._node_search(key, order);
+  if (!found || order != 0)
+    return nullptr;
+  if (found != _newest)
+  {
+    _unlink(found);
+    _link_newest(found);
+  }
+  return &found->value;
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::remove(const K& key)
+{
+  int order;
+  node* found = _tree._node_search(key, order);
+  if (!found || order != 0)
+    return;
+  _unlink(found);
+  _bytes -= found->bytes;
+  _tree._remove_node(found);
+}
+
+// Subtrees whose earliest expiry isn't before `time` are left alone.
+template <typename K, typename V, typename Weigh, typename Clock>
+std::size_t bounded_avltree<K, V, Weigh, Clock>::expire_before(time_point time)
+{
+  if (!_tree.root || !(_tree.root->earliest_expiry < time))
+    return 0;
+  const std::size_t count = _tree.size();
+  const auto search = [&](const node& n) { return n.earliest_expiry < time; };
+  const auto doomed = [&](node& n) {
+    if (!(n.expiry < time))
+      return false;
+    _unlink(&n);
+    _bytes -= n.bytes;
+    return true;
+  };
+  int height;
+  _tree.root = _tree._erase_where(_tree.root, tree_type::_height(_tree.root), search, doomed, height);
+  return count - _tree.size();
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::set_limits(std::size_t max_entries, std::size_t max_bytes)
+{
+  _max_entries = max_entries;
+  _max_bytes = max_bytes;
+  _evict_to_limits();
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::clear()
+{
+  _tree.clear();
+  _oldest = nullptr;
+  _newest = nullptr;
+  _bytes = 0;
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::swap(bounded_avltree& other)
+{
+  std::swap(_tree, other._tree);
+  std::swap(_oldest, other._oldest);
+  std::swap(_newest, other._newest);
+  std::swap(_bytes, other._bytes);
+  std::swap(_evictions, other._evictions);
+  std::swap(_max_entries, other._max_entries);
+  std::swap(_max_bytes, other._max_bytes);
+  std::swap(_weigh, other._weigh);
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::_link_newest(entry* e)
+{
+  e->older = _newest;
+  e->newer = nullptr;
+  (_newest ? _newest->newer : _oldest) = e;
+  _newest = e;
+}
+
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::_unlink(entry* e)
+{
+  (e->older ? e->older->newer : _oldest) = e->newer;
+  (e->newer ? e->newer->older : _newest) = e->older;
+}
+
+// The oldest element is found from the list, and its node removed without searching for its key.
+template <typename K, typename V, typename Weigh, typename Clock>
+void bounded_avltree<K, V, Weigh, Clock>::_evict_to_limits()
+{
+  while (_oldest && (_tree.size() > _max_entries || _bytes > _max_bytes))
+  {
+    node* victim = static_cast<node*>(_oldest);
+    _unlink(victim);
+    _bytes -= victim->bytes;
+    _tree._remove_node(victim);
+    ++_evictions;
+  }
+}
+
+#endif  // BOUNDED_AVLTREE_H
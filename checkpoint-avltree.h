@@ -0,0 +1,211 @@
+/*
+checkpoint-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+An AVL tree which writes out only what changed since its last checkpoint.
+*/
+
+#ifndef CHECKPOINT_AVLTREE_H
+#define CHECKPOINT_AVLTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "avltree.h"
+
+// The start of each checkpoint in a stream. Then come the `removed_count` removed keys, then the
+// changed elements in chunks: a `std::uint32_t` count and that many keys and values, in key order,
+// ending with an empty chunk. Numbers, keys and values are written in the machine's own layout.
+struct avltree_checkpoint_header
+{
+  static const std::uint32_t current_version = 1;
+  static const std::uint32_t native_byte_order = 0x01020304;
+
+  char magic[8];  // "avlckpt" and a terminating zero
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t key_size;
+  std::uint32_t value_size;
+  std::uint64_t sequence;       // 0 for a tree's first checkpoint, counting up from there.
+  std::uint64_t removed_count;
+};
+
+// An `avltree` which can write periodic checkpoints of itself, each holding only the changes
+// since the one before, and be rebuilt from them.
+//
+// The nodes track which elements are new or have new values (the `dirty_tracking` augmentation),
+// so a checkpoint visits just the subtrees with changes in; the keys removed are kept in a list
+// until the next checkpoint. The first checkpoint holds every element, so a stream of them starts
+// with a full copy. Values can only be changed through `insert`, so every change is seen.
+//
+// Checkpoints hold the bytes of the keys and values, so both must be trivially copyable.
+template <typename K, typename V>
+class checkpointed_avltree
+{
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "checkpoints store keys and values as bytes");
+
+public:
+  using tree_type = avltree<K, V, std::allocator<std::pair<const K, V>>, dirty_tracking>;
+
+  checkpointed_avltree() : _sequence(0) {}
+
+  // Add a key-value pair to the tree, or overwrite the value if the key is present.
+  void insert(const K& key, const V& value) { _tree.insert(key, value); }
+
+  // Remove the element with the given key. Doesn't matter if it isn't there.
+  void remove(const K& key)
+  {
+    if (!_tree.find(key))
+      return;
+    _tree.remove(key);
+    _removed.push_back(key);
+  }
+
+  // Find the value associated with a given key.
+  optional<V> get(const K& key) const { return _tree.get(key); }
+
+  // A pointer to the value stored under `key`, or nullptr.
+  const V* find(const K& key) const { return _tree.find(key); }
+
+  // The tree itself, for iterating and range queries.
+  const tree_type& tree() const { return _tree; }
+
+  std::size_t size() const { return _tree.size(); }
+  bool empty() const { return _tree.empty(); }
+
+  // Write the keys removed and the elements inserted or changed since the last checkpoint to `out`,
+  // and start tracking changes afresh. Costs O(k log(n / k + 1)) for k changes. Returns false if
+  // the stream failed, in which case the changes may have been partly written and are no longer
+  // tracked; take a new full copy by writing checkpoints from a fresh tree.
+  bool checkpoint(std::ostream& out);
+
+  // Apply the next checkpoint from `in`, which must have been written by a tree of the same key
+  // and value types, as its checkpoint number `checkpoints_applied()`: restoring a tree means
+  // applying every checkpoint to an empty one in the order they were written. Returns false if `in`
+  // doesn't hold that checkpoint; if it fails partway, the tree is left partly updated.
+  bool restore(std::istream& in);
+
+  // The number of checkpoints written or applied.
+  std::uint64_t checkpoints_applied() const { return _sequence; }
+
+private:
+  // The most elements written in one chunk.
+  static const std::uint32_t _chunk_size = 4096;
+
+  template <typename T>
+  static void _write(std::ostream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  static bool _read(std::istream& in, T& value)
+  {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+  }
+
+  tree_type _tree;
+  std::vector<K> _removed;
+  std::uint64_t _sequence;
+};
+
+
+
+// ============================================================================================ //
+// |                          `checkpointed_avltree` method definitions                       | //
+// ============================================================================================ //
+
+// The changed elements go out in chunks as they are visited, so nothing but the chunk is buffered.
+template <typename K, typename V>
+bool checkpointed_avltree<K, V>::checkpoint(std::ostream& out)
+{
+  std::sort(_removed.begin(), _removed.end());
+  _removed.erase(std::unique(_removed.begin(), _removed.end()), _removed.end());
+
+  avltree_checkpoint_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "avlckpt", 8);
+  header.version = avltree_checkpoint_header::current_version;
+  header.byte_order = avltree_checkpoint_header::native_byte_order;
+  header.key_size = sizeof(K);
+  header.value_size = sizeof(V);
+  header.sequence = _sequence;
+  header.removed_count = _removed.size();
+  _write(out, header);
+  for (const K& key : _removed)
+    _write(out, key);
+  _removed.clear();
+
+  std::vector<std::pair<K, V>> chunk;
+  chunk.reserve(_chunk_size);
+  const auto flush = [&]() {
+    _write(out, static_cast<std::uint32_t>(chunk.size()));
+    for (const std::pair<K, V>& element : chunk)
+    {
+      _write(out, element.first);
+      _write(out, element.second);
+    }
+    chunk.clear();
+  };
+  _tree.for_each_changed([&](const K& key, const V& value) {
+    chunk.push_back(std::make_pair(key, value));
+    if (chunk.size() == _chunk_size)
+      flush();
+  });
+  if (!chunk.empty())
+    flush();
+  flush();  // the empty chunk which ends the checkpoint
+  ++_sequence;
+  return static_cast<bool>(out.flush());
+}
+
+// Removals first: a key removed and then inserted again is in both lists.
+template <typename K, typename V>
+bool checkpointed_avltree<K, V>::restore(std::istream& in)
+{
+  avltree_checkpoint_header header;
+  if (!_read(in, header) || std::memcmp(header.magic, "avlckpt", 8) != 0
+      || header.version != avltree_checkpoint_header::current_version
+      || header.byte_order != avltree_checkpoint_header::native_byte_order || header.key_size != sizeof(K)
+      || header.value_size != sizeof(V) || header.sequence != _sequence)
+    return false;
+
+  for (std::uint64_t i = 0; i < header.removed_count; ++i)
+  {
+    K key;
+    if (!_read(in, key))
+      return false;
+    _tree.remove(key);
+  }
+  for (;;)
+  {
+    std::uint32_t count;
+    if (!_read(in, count))
+      return false;
+    if (count == 0)
+      break;
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+      K key;
+      V value;
+      if (!_read(in, key) || !_read(in, value))
+        return false;
+      _tree.insert(key, value);
+    }
+  }
+  // What was read is now the state at the checkpoint, so none of it counts as changed.
+  _tree.for_each_changed([](const K&, const V&) {});
+  _removed.clear();
+  ++_sequence;
+  return true;
+}
+
+#endif  // CHECKPOINT_AVLTREE_H
@@ -0,0 +1,802 @@
+/*
+compact-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+An AVL tree whose nodes are stored contiguously and linked by 32-bit indices.
+*/
+
+#ifndef COMPACT_AVLTREE_H
+#define COMPACT_AVLTREE_H
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "optional.h"
+
+template<typename K, typename V>
+class test_helper;
+
+// How a `compact_avltree` stores its keys and compares search keys with them. A policy has:
+//   stored_key                   What a node holds of its key.
+//   store(key, parent, probe)    The stored form of a new key; `parent` is its parent's stored key
+//                                (nullptr for the root) and `probe` the search which placed it.
+//   release(stored)              Let go of a key whose node has left the tree.
+//   adopt(stored, parent)        A node now hangs from a different parent, or its key changed.
+//   probe<Q>                     Compares a search key with the keys on one way down from the root,
+//                                in turn: `order(stored)` is negative, zero or positive as the
+//                                search key is before, equal to or after each.
+//   less(a, b)                   The order of two stored keys.
+//   wants_compaction()           Whether `compact(first, last)` should be called with pointers to
+//                                every stored key in key order, to reclaim space.
+
+// The general policy, which keeps each key in its node.
+template <typename K>
+class inline_keys
+{
+public:
+  using stored_key = K;
+
+  template <typename Q>
+  class probe
+  {
+  public:
+    probe(const inline_keys&, const Q& key) : _key(key) {}
+    int order(const K& stored) const { return _key < stored ? -1 : _key > stored ? 1 : 0; }
+  private:
+    const Q& _key;
+  };
+
+  static const K& store(const K& key, const K*, const probe<K>&) { return key; }
+  static void release(const K&) {}
+  static void adopt(const K&, const K*) {}
+  static bool less(const K& a, const K& b) { return a < b; }
+  static bool wants_compaction() { return false; }
+  template <typename It>
+  static void compact(It, It) {}
+};
+
+class shared_prefix_keys;
+
+// The key policy a `compact_avltree` uses by default: `inline_keys`, except for `std::string` keys,
+// which get `shared_prefix_keys`.
+template <typename K>
+struct compact_keys { using type = inline_keys<K>; };
+
+template <>
+struct compact_keys<std::string> { using type = shared_prefix_keys; };
+
+// Keeps `std::string` keys out of the nodes, in one array of bytes (the arena) shared by the tree,
+// and stores a key's prefix just once where it has one in common with a neighbouring key.
+//
+// A node holds the length of its key, the length of the prefix its key shares with its parent's
+// key, and a few of the key's bytes that follow that prefix. A search keeps track of how much of
+// the search key matches the last key it compared with. Where that differs from how much the
+// node's key matches the same (parent) key, the order is already known, and otherwise only the
+// bytes after the common prefix need comparing, which the node holds the first of. So most nodes
+// on the way down are passed without reading the arena, even when every key starts the same way;
+// a search reads the whole of just the keys which match it for more than the bytes in the nodes,
+// such as the key it finds.
+//
+// In the arena, a key is stored either whole or as the bytes following the prefix it shares with
+// a key stored whole, so reading any key takes at most two runs of bytes. Removed keys stay until
+// they take up half the arena, which is then rebuilt in key order. The arena holds at most 4 GiB.
+class shared_prefix_keys
+{
+public:
+  // The bytes of a key each node holds.
+  enum { inline_bytes = 8 };
+
+  struct stored_key
+  {
+    std::uint32_t length;                 // The length of the key.
+    std::uint32_t entry;                  // Where the key is stored in the arena.
+    std::uint32_t parent_match;           // The length of the prefix shared with the parent's key.
+    unsigned char next[inline_bytes];     // The key's bytes from `parent_match` on, if it has them.
+  };
+
+  template <typename Q>
+  class probe;
+
+  shared_prefix_keys() : _dead_bytes(0) {}
+
+  stored_key store(const std::string& key, const stored_key* parent, const probe<std::string>& search);
+  void release(const stored_key& key)
+  {
+    const std::uint32_t shared = _header(key.entry).shared;
+    _dead_bytes += _header_bytes(shared) + key.length - shared;
+  }
+  void adopt(stored_key& key, const stored_key* parent) const
+  {
+    key.parent_match = parent ? _common_prefix(key, *parent) : 0;
+    _fill_next(key);
+  }
+  bool less(const stored_key& a, const stored_key& b) const;
+  bool wants_compaction() const { return _dead_bytes > _min_compaction && 2 * _dead_bytes > _arena.size(); }
+  template <typename It>
+  void compact(It first, It last);
+
+  // The key itself, rebuilt from the arena.
+  std::string key(const stored_key& stored) const;
+
+  // Whether `parent_match` and `next` are right for a key hanging from `parent` (or the root).
+  bool valid_link(const stored_key& key, const stored_key* parent) const;
+
+  // The bytes the arena takes, and how many of them belong to removed keys.
+  std::size_t arena_bytes() const { return _arena.size(); }
+  std::size_t dead_bytes() const { return _dead_bytes; }
+
+private:
+  // The start of each key in the arena: the key stored whole (`shared` 0), or stored as the bytes
+  // after the first `shared`, which are those of the whole key stored at `base`. In the arena this
+  // is a 16-bit `shared`, then `base` only if `shared` isn't 0, then the key's bytes.
+  struct entry_header
+  {
+    std::uint32_t base;
+    std::uint32_t shared;
+  };
+
+  // Keys sharing less than this with their neighbour are stored whole, and they share at most
+  // `_max_shared`.
+  static const std::uint32_t _min_shared = 8;
+  static const std::uint32_t _max_shared = 0xffff;
+
+  // The arena isn't rebuilt to reclaim fewer bytes than this.
+  static const std::size_t _min_compaction = 1 << 16;
+
+  entry_header _header(std::uint32_t entry) const
+  {
+    std::uint16_t shared;
+    std::memcpy(&shared, &_arena[entry], sizeof(shared));
+    entry_header header = { 0, shared };
+    if (shared != 0)
+      std::memcpy(&header.base, &_arena[entry + sizeof(shared)], sizeof(header.base));
+    return header;
+  }
+
+  static std::uint32_t _clamp_shared(std::uint32_t shared) { return shared < _max_shared ? shared : _max_shared; }
+
+  // The bytes of an entry before the key's own.
+  static std::uint32_t _header_bytes(std::uint32_t shared)
+  {
+    return shared ? sizeof(std::uint16_t) + sizeof(std::uint32_t) : sizeof(std::uint16_t);
+  }
+
+  // The key's bytes from `position` (which must be less than its length) on, as far as they are
+  // stored together; `count` gets how many that is.
+  const unsigned char* _run(const stored_key& key, std::uint32_t position, std::uint32_t& count) const;
+
+  // The length of the prefix two keys have in common.
+  std::uint32_t _common_prefix(const stored_key& a, const stored_key& b) const;
+
+  // Copy the key's bytes from `parent_match` into `next`.
+  void _fill_next(stored_key& key) const;
+
+  // Append a key's entry to `arena`: `length` bytes at `data`, following `shared` bytes in common
+  // with the whole key stored at `base`. Returns where it starts.
+  static std::uint32_t _append(std::vector<unsigned char>& arena, const char* data, std::uint32_t length,
+                               std::uint32_t base, std::uint32_t shared);
+
+  std::vector<unsigned char> _arena;
+  std::size_t _dead_bytes;
+};
+
+// Follows a search down the tree. `_matched` is the length of the prefix the search key shares
+// with the last key it was compared with, and `_last` the order against that key.
+template <typename Q>
+class shared_prefix_keys::probe
+{
+public:
+  probe(const shared_prefix_keys& keys, const Q& key) : _keys(keys), _matched(0), _last(0)
+  {
+    _set(key, 0);
+  }
+
+  int order(const stored_key& stored);
+
+  // The length of the prefix the search key shares with the last key it was compared with.
+  std::uint32_t matched() const { return _matched; }
+
+private:
+  // Anything with `data()` and `size()`, like `std::string` and `std::string_view`, or a C string.
+  template <typename S>
+  auto _set(const S& key, int) -> decltype(key.data(), key.size(), void())
+  {
+    _data = reinterpret_cast<const unsigned char*>(key.data());
+    _size = key.size();
+  }
+  void _set(const char* key, long)
+  {
+    _data = reinterpret_cast<const unsigned char*>(key);
+    _size = std::strlen(key);
+  }
+
+  const shared_prefix_keys& _keys;
+  const unsigned char* _data;
+  std::size_t _size;
+  std::uint32_t _matched;
+  int _last;
+};
+
+// An AVL tree laid out for the cache.
+//
+// The nodes live in one array and link to each other with 32-bit indices rather than pointers,
+// and hold only what a search reads: the key, the two child links and the balance factor. The
+// values are kept apart, in a second array in the same order, and are only touched once a search
+// has found its key. For small keys that makes a node a quarter of the size of an `avltree` node,
+// so about four times as many of the top levels of the tree fit in each level of cache. There are
+// no parent links: updates remember the path they took down instead.
+//
+// The slots of removed elements are reused by later insertions, and their values reset to `V()`.
+// Growing the arrays moves every value, and a removal can move one, so `find` pointers are only
+// valid until the tree is next changed. A tree holds at most 2^32 - 1 elements.
+//
+// `Keys` says how the keys are stored, see `inline_keys` above. `std::string` keys are kept
+// together in one array, sharing their common prefixes, by `shared_prefix_keys`: nodes are then
+// 32 bytes, and a search needs to read only a few keys in full.
+template <typename K, typename V, typename Keys = typename compact_keys<K>::type>
+class compact_avltree
+{
+public:
+
+  compact_avltree() : _root(nil), _free(nil), _size(0) {}
+
+  // Add a key-value pair to the tree, or overwrite the value if the key is present.
+  void insert(const K& key, const V& value);
+
+  // Find the value associated with a given key.
+  optional<V> get(const K& key) const
+  {
+    const V* value = find(key);
+    return value ? optional<V>(*value) : optional<V>();
+  }
+
+  // A pointer to the value stored under `key`, or nullptr. Valid until the tree is next changed.
+  template <typename Q>
+  V* find(const Q& key) { return _find_value(key); }
+  template <typename Q>
+  const V* find(const Q& key) const { return _find_value(key); }
+
+  // Remove the element with the given key. Doesn't matter if it isn't there.
+  void remove(const K& key);
+
+  // The number of elements in the tree.
+  std::size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  // Make room for `count` elements, so that inserting them doesn't reallocate the arrays.
+  void reserve(std::size_t count)
+  {
+    _nodes.reserve(count);
+    _values.reserve(count);
+  }
+
+protected:
+
+  using index = std::uint32_t;
+
+  // The link for a missing child.
+  static const index nil = static_cast<index>(-1);
+
+  // The most levels an AVL tree of 2^32 - 1 nodes can have is 46.
+  static const int max_height = 48;
+
+  enum { LEFT = 0, RIGHT = 1 };
+
+  // LEFT_HEAVY for LEFT, RIGHT_HEAVY for RIGHT, as in `avltree`.
+  static int8_t _heavy(int side) { return static_cast<int8_t>(1 - 2 * side); }
+
+  using stored_key = typename Keys::stored_key;
+  template <typename Q>
+  using probe = typename Keys::template probe<Q>;
+
+  // Everything a search reads of a node. `balance_factor` is left height - right height.
+  struct node
+  {
+    node(const stored_key& key) : key(key), child{nil, nil}, balance_factor(0) {}
+    stored_key key;
+    index child[2];
+    int8_t balance_factor;
+  };
+
+  // The way down to a node: the nodes passed through, from the root, and the side taken at each.
+  struct path
+  {
+    path() : depth(0) {}
+    void push(index through, int side)
+    {
+      nodes[depth] = through;
+      sides[depth] = static_cast<int8_t>(side);
+      ++depth;
+    }
+    index nodes[max_height];
+    int8_t sides[max_height];
+    int depth;
+  };
+
+  // Descend from the root towards the key `search` is for, recording the way. Returns the node with
+  // the key, or nil if it isn't there (in which case the path ends at the would-be parent).
+  template <typename Probe>
+  index _search(Probe& search, path& way) const;
+
+  // The value stored under the given key, or nullptr if there isn't one.
+  template <typename Q>
+  V* _find_value(const Q& key) const;
+
+  // Make `new_child` the child reached by the step `depth` - 1 of `way`, or the root if depth is 0.
+  void _link(const path& way, int depth, index new_child)
+  {
+    if (depth == 0)
+      _root = new_child;
+    else
+      _nodes[way.nodes[depth - 1]].child[way.sides[depth - 1]] = new_child;
+  }
+
+  // As `_link`, for a node which had a different parent before (or none).
+  void _relink(const path& way, int depth, index new_child)
+  {
+    _link(way, depth, new_child);
+    if (new_child != nil)
+      _keys.adopt(_nodes[new_child].key, depth == 0 ? nullptr : &_nodes[way.nodes[depth - 1]].key);
+  }
+
+  // Tell the key policy that `child` (may be nil) of `parent` hangs from it anew.
+  void _adopt(index child, index parent)
+  {
+    if (child != nil)
+      _keys.adopt(_nodes[child].key, &_nodes[parent].key);
+  }
+
+  // Rebalance after the subtree at each step of the way, from the last, grew by a level.
+  void _retrace_insertion(const path& way);
+
+  // Rebalance after the subtree at each step of the way, from the last, lost a level.
+  void _retrace_deletion(const path& way);
+
+  // Rotate the subtree at `subtree_root` down to `side`, as `avltree::_rotate`. Returns the new
+  // subtree root; the caller links it in.
+  index _rotate(index subtree_root, int side);
+
+  // Rotate the child on the far side away from `side`, then the subtree root towards `side`.
+  index _double_rotate(index subtree_root, int side)
+  {
+    _nodes[subtree_root].child[!side] = _rotate(_nodes[subtree_root].child[!side], !side);
+    _adopt(_nodes[subtree_root].child[!side], subtree_root);
+    return _rotate(subtree_root, side);
+  }
+
+  // Take a slot for a new node, reusing a free one if there is one.
+  index _allocate(const stored_key& key, const V& value);
+
+  // Let the key policy rebuild its storage, if it wants to.
+  void _compact_keys();
+
+  // The nodes, and their values at the same positions. Free slots are kept in a list linked
+  // through their left child links.
+  std::vector<node> _nodes;
+  std::vector<V> _values;
+  index _root;
+  index _free;
+  std::size_t _size;
+  Keys _keys;
+
+  // The test_helper class contains some meta functionality to check the implementation is valid.
+  template <typename, typename> friend class test_helper;
+};
+
+
+
+// ============================================================================================ //
+// |                            `compact_avltree` method definitions                          | //
+// ============================================================================================ //
+
+// Search down to the key, then (if it isn't there) hang a new node where the search ended.
+template <typename K, typename V, typename Keys>
+void compact_avltree<K, V, Keys>::insert(const K& key, const V& value)
+{
+  path way;
+  probe<K> search(_keys, key);
+  const index found = _search(search, way);
+  if (found != nil)
+  {
+    _values[found] = value;
+    return;
+  }
+  const stored_key* parent = way.depth == 0 ? nullptr : &_nodes[way.nodes[way.depth - 1]].key;
+  _link(way, way.depth, _allocate(_keys.store(key, parent, search), value));
+  _retrace_insertion(way);
+}
+
+// As `avltree::remove`, except that a node with two children swaps its key and value with its
+// in-order successor, whose node is then the one taken out of the tree. The key policy hears of the
+// key which has moved, and of its children.
+template <typename K, typename V, typename Keys>
+void compact_avltree<K, V, Keys>::remove(const K& key)
+{
+  path way;
+  probe<K> search(_keys, key);
+  index target = _search(search, way);
+  if (target == nil)
+    return;
+
+  if (_nodes[target].child[LEFT] != nil && _nodes[target].child[RIGHT] != nil)
+  {
+    const int target_depth = way.depth;
+    way.push(target, RIGHT);
+    index successor = _nodes[target].child[RIGHT];
+    while (_nodes[successor].child[LEFT] != nil)
+    {
+      way.push(successor, LEFT);
+      successor = _nodes[successor].child[LEFT];
+    }
+    std::swap(_nodes[target].key, _nodes[successor].key);
+    std::swap(_values[target], _values[successor]);
+    _relink(way, target_depth, target);
+    _adopt(_nodes[target].child[LEFT], target);
+    _adopt(_nodes[target].child[RIGHT], target);
+    target = successor;
+  }
+
+  // The node has at most one child, which takes its place.
+  const node& removed = _nodes[target];
+  _relink(way, way.depth, removed.child[removed.child[LEFT] != nil ? LEFT : RIGHT]);
+  _retrace_deletion(way);
+
+  _keys.release(_nodes[target].key);
+  _values[target] = V();
+  _nodes[target].child[LEFT] = _free;
+  _free = target;
+  --_size;
+  if (_keys.wants_compaction())
+    _compact_keys();
+}
+
+// Iterative search. We follow branch directions based on comparing the keys.
+template <typename K, typename V, typename Keys>
+template <typename Probe>
+typename compact_avltree<K, V, Keys>::index compact_avltree<K, V, Keys>::_search(Probe& search, path& way) const
+{
+  index current = _root;
+  while (current != nil)
+  {
+    const node& n = _nodes[current];
+    const int order = search.order(n.key);
+    if (order == 0)
+      return current;
+    const int side = order > 0 ? RIGHT : LEFT;
+    way.push(current, side);
+    current = n.child[side];
+  }
+  return nil;
+}
+
+// Search without recording the way, for lookups.
+template <typename K, typename V, typename Keys>
+template <typename Q>
+V* compact_avltree<K, V, Keys>::_find_value(const Q& key) const
+{
+  probe<Q> search(_keys, key);
+  index current = _root;
+  while (current != nil)
+  {
+    const node& n = _nodes[current];
+    const int order = search.order(n.key);
+    if (order == 0)
+      return const_cast<V*>(&_values[current]);
+    current = n.child[order > 0 ? RIGHT : LEFT];
+  }
+  return nullptr;
+}
+
+// As `avltree::_retrace_insertion`, walking back up the recorded path.
+template <typename K, typename V, typename Keys>
+void compact_avltree<K, V, Keys>::_retrace_insertion(const path& way)
+{
+  for (int depth = way.depth - 1; depth >= 0; --depth)
+  {
+    const index parent = way.nodes[depth];
+    const int side = way.sides[depth];
+    const int8_t heavy = _heavy(side);
+    _nodes[parent].balance_factor += heavy;
+    if (_nodes[parent].balance_factor == 0)
+      return;
+    else if (_nodes[parent].balance_factor == heavy)
+      continue;  // parent's subtree grew, keep going up.
+
+    // Parent was already heavy on this side, rebalance by rotating it to the other side.
+    const index child = _nodes[parent].child[side];
+    const index rotated = (_nodes[child].balance_factor == -heavy) ? _double_rotate(parent, !side)
+                                                                    : _rotate(parent, !side);
+    _relink(way, depth, rotated);
+    return;
+  }
+}
+
+// As `avltree::_retrace_deletion`, walking back up the recorded path.
+template <typename K, typename V, typename Keys>
+void compact_avltree<K, V, Keys>::_retrace_deletion(const path& way)
+{
+  for (int depth = way.depth - 1; depth >= 0; --depth)
+  {
+    index current = way.nodes[depth];
+    const int shortened_side = way.sides[depth];
+    _nodes[current].balance_factor -= _heavy(shortened_side);
+    const int8_t balance = _nodes[current].balance_factor;
+    if (balance == 1 || balance == -1)
+      return;  // The subtree was balanced and keeps its height.
+    else if (balance != 0)
+    {
+      const int taller_side = !shortened_side;
+      const index taller_child = _nodes[current].child[taller_side];
+      current = (_nodes[taller_child].balance_factor == -_heavy(taller_side))
+                ? _double_rotate(current, shortened_side) : _rotate(current, shortened_side);
+      _relink(way, depth, current);
+      // If the taller child was balanced, the rotated subtree keeps its height and we can stop.
+      if (_nodes[current].balance_factor != 0)
+        return;
+    }
+  }
+}
+
+// The balance factor update is the one `avltree::_rotate` derives.
+template <typename K, typename V, typename Keys>
+typename compact_avltree<K, V, Keys>::index compact_avltree<K, V, Keys>::_rotate(index subtree_root, int side)
+{
+  node& old_root = _nodes[subtree_root];
+  const index new_subtree_root = old_root.child[!side];
+  node& new_root = _nodes[new_subtree_root];
+  old_root.child[!side] = new_root.child[side];
+  new_root.child[side] = subtree_root;
+
+  const int heavy = _heavy(side);
+  const int old_root_bf = heavy * old_root.balance_factor;
+  const int new_root_bf = heavy * new_root.balance_factor;
+  const int old_root_new_bf = old_root_bf + 1 - (new_root_bf < 0 ? new_root_bf : 0);
+  const int new_root_new_bf = new_root_bf + 1 + (old_root_new_bf > 0 ? old_root_new_bf : 0);
+  old_root.balance_factor = static_cast<int8_t>(heavy * old_root_new_bf);
+  new_root.balance_factor = static_cast<int8_t>(heavy * new_root_new_bf);
+  _adopt(subtree_root, new_subtree_root);
+  _adopt(old_root.child[!side], subtree_root);
+  return new_subtree_root;
+}
+
+template <typename K, typename V, typename Keys>
+typename compact_avltree<K, V, Keys>::index compact_avltree<K, V, Keys>::_allocate(const stored_key& key,
+                                                                                  const V& value)
+{
+  ++_size;
+  if (_free == nil)
+  {
+    _nodes.push_back(node(key));
+    _values.push_back(value);
+    return static_cast<index>(_nodes.size() - 1);
+  }
+  const index slot = _free;
+  _free = _nodes[slot].child[LEFT];
+  _nodes[slot] = node(key);
+  _values[slot] = value;
+  return slot;
+}
+
+// An in-order walk with a stack of the nodes still to visit, none of which has been moved.
+template <typename K, typename V, typename Keys>
+void compact_avltree<K, V, Keys>::_compact_keys()
+{
+  std::vector<stored_key*> keys;
+  keys.reserve(_size);
+  index pending[max_height];
+  int depth = 0;
+  index current = _root;
+  while (current != nil || depth > 0)
+  {
+    for (; current != nil; current = _nodes[current].child[LEFT])
+      pending[depth++] = current;
+    current = pending[--depth];
+    keys.push_back(&_nodes[current].key);
+    current = _nodes[current].child[RIGHT];
+  }
+  _keys.compact(keys.begin(), keys.end());
+}
+
+
+
+// ============================================================================================ //
+// |                          `shared_prefix_keys` method definitions                         | //
+// ============================================================================================ //
+
+// The search ended at the parent, so the probe knows how much the key shares with the parent's. A
+// parent stored whole lends its prefix; otherwise its key shares a prefix with a key stored whole,
+// which the new key may share some of too. Where that is much less than it shares with the parent,
+// the key is stored whole instead, for the keys after it to share.
+inline shared_prefix_keys::stored_key shared_prefix_keys::store(const std::string& key, const stored_key* parent,
+                                                                 const probe<std::string>& search)
+{
+  stored_key stored;
+  stored.length = static_cast<std::uint32_t>(key.size());
+  stored.parent_match = parent ? search.matched() : 0;
+  std::uint32_t base = 0;
+  std::uint32_t shared = 0;
+  if (parent && stored.parent_match >= _min_shared)
+  {
+    const entry_header header = _header(parent->entry);
+    base = header.shared == 0 ? parent->entry : header.base;
+    shared = _clamp_shared(header.shared == 0 ? stored.parent_match : std::min(stored.parent_match, header.shared));
+    if (shared < _min_shared || 4 * shared < 3 * _clamp_shared(stored.parent_match))
+      shared = 0;
+  }
+  stored.entry = _append(_arena, key.data() + shared, stored.length - shared, base, shared);
+  const std::size_t next = std::min<std::size_t>(inline_bytes, stored.length - stored.parent_match);
+  std::memcpy(stored.next, key.data() + stored.parent_match, next);
+  return stored;
+}
+
+inline bool shared_prefix_keys::less(const stored_key& a, const stored_key& b) const
+{
+  const std::uint32_t common = _common_prefix(a, b);
+  if (common == a.length || common == b.length)
+    return common < b.length;
+  std::uint32_t count;
+  return *_run(a, common, count) < *_run(b, common, count);
+}
+
+// Rebuilt in key order, each key sharing its prefix with the last key stored whole. A key starts
+// a new whole key when it shares much less with that than with the key before it.
+template <typename It>
+void shared_prefix_keys::compact(It first, It last)
+{
+  std::vector<unsigned char> arena;
+  arena.reserve(_arena.size() - _dead_bytes);
+  std::string whole;
+  std::uint32_t whole_entry = 0;
+  std::string previous;
+  const auto common_prefix = [](const std::string& a, const std::string& b) {
+    const std::size_t end = std::min(a.size(), b.size());
+    std::size_t length = 0;
+    while (length < end && a[length] == b[length])
+      ++length;
+    return static_cast<std::uint32_t>(length);
+  };
+  for (; first != last; ++first)
+  {
+    stored_key& stored = **first;
+    std::string current = key(stored);
+    const std::uint32_t shared = _clamp_shared(common_prefix(current, whole));
+    if (shared >= _min_shared && 4 * shared >= 3 * _clamp_shared(common_prefix(current, previous)))
+      stored.entry = _append(arena, current.data() + shared, stored.length - shared, whole_entry, shared);
+    else
+    {
+      stored.entry = _append(arena, current.data(), stored.length, 0, 0);
+      whole = current;
+      whole_entry = stored.entry;
+    }
+    previous.swap(current);
+  }
+  _arena.swap(arena);
+  _dead_bytes = 0;
+}
+
+inline std::string shared_prefix_keys::key(const stored_key& stored) const
+{
+  std::string result;
+  result.reserve(stored.length);
+  std::uint32_t count;
+  for (std::uint32_t position = 0; position < stored.length; position += count)
+  {
+    const unsigned char* run = _run(stored, position, count);
+    result.append(reinterpret_cast<const char*>(run), count);
+  }
+  return result;
+}
+
+inline bool shared_prefix_keys::valid_link(const stored_key& key, const stored_key* parent) const
+{
+  stored_key expected = key;
+  adopt(expected, parent);
+  return expected.parent_match == key.parent_match
+    && std::memcmp(expected.next, key.next, std::min<std::size_t>(inline_bytes, key.length - key.parent_match)) == 0;
+}
+
+// A key stored in part has its first `shared` bytes in the whole key at `base`. Only those up to
+// the limit set by the key itself belong to it.
+inline const unsigned char* shared_prefix_keys::_run(const stored_key& key, std::uint32_t position,
+                                                     std::uint32_t& count) const
+{
+  entry_header header = _header(key.entry);
+  std::uint32_t entry = key.entry;
+  std::uint32_t end = key.length;
+  if (position < header.shared)
+  {
+    end = header.shared;
+    entry = header.base;
+    header = _header(entry);
+  }
+  count = end - position;
+  return &_arena[entry + _header_bytes(header.shared) + position - header.shared];
+}
+
+inline std::uint32_t shared_prefix_keys::_common_prefix(const stored_key& a, const stored_key& b) const
+{
+  const std::uint32_t end = std::min(a.length, b.length);
+  std::uint32_t position = 0;
+  while (position < end)
+  {
+    std::uint32_t a_count, b_count;
+    const unsigned char* a_run = _run(a, position, a_count);
+    const unsigned char* b_run = _run(b, position, b_count);
+    const std::uint32_t count = std::min(std::min(a_count, b_count), end - position);
+    for (std::uint32_t i = 0; i < count; ++i)
+      if (a_run[i] != b_run[i])
+        return position + i;
+    position += count;
+  }
+  return end;
+}
+
+inline void shared_prefix_keys::_fill_next(stored_key& key) const
+{
+  std::uint32_t position = key.parent_match;
+  const std::uint32_t end = std::min<std::uint32_t>(key.length, position + inline_bytes);
+  while (position < end)
+  {
+    std::uint32_t count;
+    const unsigned char* run = _run(key, position, count);
+    count = std::min(count, end - position);
+    std::memcpy(key.next + (position - key.parent_match), run, count);
+    position += count;
+  }
+}
+
+inline std::uint32_t shared_prefix_keys::_append(std::vector<unsigned char>& arena, const char* data,
+                                                 std::uint32_t length, std::uint32_t base, std::uint32_t shared)
+{
+  const std::uint16_t stored_shared = static_cast<std::uint16_t>(shared);
+  const std::size_t entry = arena.size();
+  const std::uint32_t header_bytes = _header_bytes(shared);
+  arena.resize(entry + header_bytes + length);
+  std::memcpy(&arena[entry], &stored_shared, sizeof(stored_shared));
+  if (shared != 0)
+    std::memcpy(&arena[entry + sizeof(stored_shared)], &base, sizeof(base));
+  std::memcpy(&arena[entry + header_bytes], data, length);
+  return static_cast<std::uint32_t>(entry);
+}
+
+// Where the node's key matches the last key differently from the search key, the order is the
+// order against the last key, or the opposite; see the class comment. Otherwise compare the bytes
+// after the common prefix: those in the node, then the rest of the key from the arena.
+template <typename Q>
+int shared_prefix_keys::probe<Q>::order(const stored_key& stored)
+{
+  if (_matched < stored.parent_match)
+    return _last;
+  if (_matched > stored.parent_match)
+  {
+    _matched = stored.parent_match;
+    return _last = -_last;
+  }
+  std::uint32_t position = _matched;
+  const unsigned char* run = stored.next;
+  std::uint32_t count = std::min<std::uint32_t>(inline_bytes, stored.length - position);
+  for (;;)
+  {
+    for (std::uint32_t i = 0; i < count; ++i, ++position)
+    {
+      if (position == _size || _data[position] != run[i])
+      {
+        _matched = position;
+        return _last = (position == _size || _data[position] < run[i]) ? -1 : 1;
+      }
+    }
+    if (position == stored.length)
+    {
+      _matched = position;
+      return _last = position == _size ? 0 : 1;
+    }
+    run = _keys._run(stored, position, count);
+  }
+}
+
+#endif  // COMPACT_AVLTREE_H
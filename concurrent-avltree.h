@@ -0,0 +1,218 @@
+/*
+concurrent-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+An AVL tree which many threads can read while others write to it.
+*/
+
+#ifndef CONCURRENT_AVLTREE_H
+#define CONCURRENT_AVLTREE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "avltree.h"
+
+// A reader-writer lock whose readers don't contend with each other.
+//
+// Each reader registers in one of `reader_slots` counters, chosen by its thread, and each counter
+// has a cache line to itself; readers on different cores never write to the same line, so taking
+// the read lock costs the same with one reader as with many. A writer announces itself, waits for
+// every counter to drain, and has the structure to itself until it unlocks. Writers take priority:
+// once one is waiting, new readers wait for it. Writers are serialized among themselves.
+//
+// The interface matches the standard shared mutexes, so it works with `std::lock_guard` and
+// `std::unique_lock` (exclusive) as well as `read_guard` below.
+class striped_rw_lock
+{
+public:
+  static const std::size_t reader_slots = 64;
+
+  striped_rw_lock() : _writer(false)
+  {
+    for (std::size_t i = 0; i < reader_slots; ++i)
+      _slots[i].readers.store(0, std::memory_order_relaxed);
+  }
+
+  striped_rw_lock(const striped_rw_lock&) = delete;
+  striped_rw_lock& operator=(const striped_rw_lock&) = delete;
+
+  void lock_shared();
+  void unlock_shared() { _slots[_slot_index()].readers.fetch_sub(1, std::memory_order_release); }
+
+  void lock();
+  void unlock()
+  {
+    _writer.store(false);
+    _writers.unlock();
+  }
+
+private:
+  // One counter per cache line. The slots are 128 bytes apart so no two counters can share a line
+  // wherever the lock is placed, and adjacent-line prefetching doesn't pair them up either.
+  struct slot
+  {
+    std::atomic<unsigned> readers;
+    char padding[128 - sizeof(std::atomic<unsigned>)];
+  };
+
+  // The slot the calling thread reads through; fixed for the life of the thread.
+  static std::size_t _slot_index()
+  {
+    static thread_local const std::size_t index =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % reader_slots;
+    return index;
+  }
+
+  slot _slots[reader_slots];
+  std::atomic<bool> _writer;
+  std::mutex _writers;
+};
+
+// Hold a read lock on a `striped_rw_lock` for a scope.
+class read_guard
+{
+public:
+  explicit read_guard(striped_rw_lock& lock) : _lock(lock) { _lock.lock_shared(); }
+  ~read_guard() { _lock.unlock_shared(); }
+  read_guard(const read_guard&) = delete;
+  read_guard& operator=(const read_guard&) = delete;
+private:
+  striped_rw_lock& _lock;
+};
+
+
+// An `avltree` shared between threads: any number of threads can search it at once, and writes
+// (which may rotate any part of the tree) have it to themselves for as long as they take.
+//
+// This is one lock over the whole tree, not per-node locking: every write stalls every reader,
+// wherever in the tree it lands. Readers which only wait for writes to the subtree they are in
+// (optimistic versions on each node, or hand-over-hand locking down the search path) would need
+// atomic links and balance factors in the nodes and removed nodes freed only once no reader can
+// still hold them, neither of which `avltree` has. What the lock does give is reads which scale:
+// without writes, readers never write to a shared cache line.
+//
+// Searches hand back copies (`get`) or run a function over the tree under the read lock (`read`),
+// since a pointer into the tree could be invalidated by the next write. Group updates into
+// `insert_batch` or `write` calls where possible; each write waits for the readers in progress.
+template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>,
+          typename Augment = no_augmentation>
+class concurrent_avltree
+{
+public:
+  using tree_type = avltree<K, V, Alloc, Augment>;
+
+  explicit concurrent_avltree(const Alloc& alloc = Alloc()) : _tree(alloc) {}
+
+  concurrent_avltree(const concurrent_avltree&) = delete;
+  concurrent_avltree& operator=(const concurrent_avltree&) = delete;
+
+  // Copy out the value stored under `key`, if there is one.
+  optional<V> get(const K& key) const
+  {
+    read_guard guard(_lock);
+    return _tree.get(key);
+  }
+
+  // Whether `key` is in the tree.
+  template <typename Q>
+  bool contains(const Q& key) const
+  {
+    read_guard guard(_lock);
+    return _tree.find(key) != nullptr;
+  }
+
+  // The number of elements in the tree.
+  std::size_t size() const
+  {
+    read_guard guard(_lock);
+    return _tree.size();
+  }
+
+  // Call `reader(tree)` with a const reference to the tree, holding the read lock throughout; for
+  // range scans and anything else needing a consistent view. Returns what `reader` returns.
+  template <typename Reader>
+  auto read(Reader&& reader) const -> decltype(reader(std::declval<const tree_type&>()))
+  {
+    read_guard guard(_lock);
+    return reader(static_cast<const tree_type&>(_tree));
+  }
+
+  void insert(const K& key, const V& value)
+  {
+    std::lock_guard<striped_rw_lock> guard(_lock);
+    _tree.insert(key, value);
+  }
+
+  void remove(const K& key)
+  {
+    std::lock_guard<striped_rw_lock> guard(_lock);
+    _tree.remove(key);
+  }
+
+  template <typename ForwardIt>
+  void insert_batch(ForwardIt first, ForwardIt last)
+  {
+    std::lock_guard<striped_rw_lock> guard(_lock);
+    _tree.insert_batch(first, last);
+  }
+
+  template <typename ForwardIt>
+  void erase_batch(ForwardIt first, ForwardIt last)
+  {
+    std::lock_guard<striped_rw_lock> guard(_lock);
+    _tree.erase_batch(first, last);
+  }
+
+  // Call `writer(tree)` with the tree, holding the write lock throughout, so a group of updates
+  // waits for the readers once. Returns what `writer` returns.
+  template <typename Writer>
+  auto write(Writer&& writer) -> decltype(writer(std::declval<tree_type&>()))
+  {
+    std::lock_guard<striped_rw_lock> guard(_lock);
+    return writer(_tree);
+  }
+
+private:
+  mutable striped_rw_lock _lock;
+  tree_type _tree;
+};
+
+
+
+// ============================================================================================ //
+// |                            `striped_rw_lock` method definitions                          | //
+// ============================================================================================ //
+
+// Register in our slot, then check for a writer. If one got in first, back out and wait for it.
+// Both sides store then load with sequentially consistent atomics, so either the writer sees our
+// count or we see its flag.
+inline void striped_rw_lock::lock_shared()
+{
+  std::atomic<unsigned>& readers = _slots[_slot_index()].readers;
+  for (;;)
+  {
+    readers.fetch_add(1);
+    if (!_writer.load())
+      return;
+    readers.fetch_sub(1);
+    while (_writer.load(std::memory_order_relaxed))
+      std::this_thread::yield();
+  }
+}
+
+// Announce the writer so no new readers get in, then wait for the current ones to leave.
+inline void striped_rw_lock::lock()
+{
+  _writers.lock();
+  _writer.store(true);
+  for (std::size_t i = 0; i < reader_slots; ++i)
+    while (_slots[i].readers.load() != 0)
+      std::this_thread::yield();
+}
+
+#endif  // CONCURRENT_AVLTREE_H
@@ -16,9 +16,9 @@ using std::endl;
 using std::string;
 
 // Retrieve and print a node which might exist in the tree.
-void findAndPrint(avltree<int, string> tree, int key)
+void findAndPrint(const avltree<int, string>& tree, int key)
 {
-  const optional<string> &result = tree.search(key);
+  const optional<string> &result = tree.get(key);
   if (result.has_value())
     cout << key << " --> " << result.value() << endl;
   else
@@ -26,7 +26,7 @@ void findAndPrint(avltree<int, string> tree, int key)
 }
 
 // Print all the nodes we might be adding
-void printTreeNodes(avltree<int, string> tree)
+void printTreeNodes(const avltree<int, string>& tree)
 {
   findAndPrint(tree, 1);
   findAndPrint(tree, 2);
@@ -0,0 +1,178 @@
+/*
+frozen-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+An immutable copy of an AVL tree, laid out in arrays for fast searching.
+*/
+
+#ifndef FROZEN_AVLTREE_H
+#define FROZEN_AVLTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "avltree.h"
+
+// The keys and values of a tree, read-only, in Eytzinger order: the root at position 1, and the
+// children of position i at 2i and 2i + 1. There are no links, so the arrays hold nothing else.
+//
+// A search steps down from 1 to 2i or 2i + 1 on a single comparison, without a branch to
+// mispredict, and the positions it can reach four levels further down are one cache line of keys
+// (for 4-byte keys), which it prefetches while working on the current level. The top levels share
+// a handful of cache lines. Build the data in an `avltree`, then `freeze` it; the keys are ordered
+// by `Compare`, as in `avltree`, which `freeze` copies from the tree.
+//
+// For integral keys and `key_less` the step compiles to a compare and a conditional move, which is
+// the branch-free path; there is no SIMD one. Each level of an Eytzinger search compares one key,
+// and which key the next level compares depends on it, so there are no comparisons to do side by
+// side. Comparing several keys at once would need a layout with several keys to a node (a B-tree),
+// and the prefetch already hides most of the memory latency which that would save.
+template <typename K, typename V, typename Compare = key_less>
+class frozen_avltree
+{
+public:
+
+  // An empty tree.
+  explicit frozen_avltree(const Compare& compare = Compare()) : _keys(1), _values(1), _compare(compare) {}
+
+  // Copy the elements of a range sorted by key (under `compare`), with no duplicate keys: pairs of
+  // (key, value) or `avltree` iterators.
+  template <typename ForwardIt>
+  frozen_avltree(ForwardIt first, ForwardIt last, const Compare& compare = Compare());
+
+  // Find the value associated with a given key.
+  optional<V> get(const K& key) const
+  {
+    const V* value = find(key);
+    return value ? optional<V>(*value) : optional<V>();
+  }
+
+  // A pointer to the value stored under `key`, or nullptr.
+  template <typename Q>
+  const V* find(const Q& key) const;
+
+  // The number of elements in the tree.
+  std::size_t size() const { return _keys.size() - 1; }
+  bool empty() const { return size() == 0; }
+
+  // The keys and values in Eytzinger order, from position 1; position 0 is unused.
+  const std::vector<K>& keys() const { return _keys; }
+  const std::vector<V>& values() const { return _values; }
+
+  // The comparison policy ordering the keys.
+  Compare key_comp() const { return _compare; }
+
+protected:
+
+  // Fill the subtree at `position` in order from `next`.
+  template <typename ForwardIt>
+  void _fill(std::size_t position, ForwardIt& next);
+
+  // Position 0 is unused, so that the arithmetic works from 1.
+  std::vector<K> _keys;
+  std::vector<V> _values;
+  Compare _compare;
+};
+
+// The position in keys[1..count] laid out in Eytzinger order of the first key not before `key`
+// under `compare`, or 0 if there isn't one.
+template <typename K, typename Q, typename Compare = key_less>
+std::size_t eytzinger_lower_bound(const K* keys, std::size_t count, const Q& key, Compare compare = Compare());
+
+// The position in keys[1..count] of `key`, or 0 if it isn't there.
+template <typename K, typename Q, typename Compare = key_less>
+std::size_t eytzinger_find(const K* keys, std::size_t count, const Q& key, Compare compare = Compare())
+{
+  const std::size_t position = eytzinger_lower_bound(keys, count, key, compare);
+  return position == 0 || key_before(compare, key, keys[position]) ? 0 : position;
+}
+
+// The position after `position` in key order, in an Eytzinger layout of `count` keys: the leftmost
+// position below its right child, or else the first position it is on the left of. 0 at the end.
+inline std::size_t eytzinger_next(std::size_t position, std::size_t count)
+{
+  if (2 * position + 1 <= count)
+  {
+    position = 2 * position + 1;
+    while (2 * position <= count)
+      position *= 2;
+    return position;
+  }
+  while (position & 1)
+    position >>= 1;
+  return position >> 1;
+}
+
+// A frozen copy of the tree, in O(n), ordered as the tree is.
+template <typename K, typename V, typename Alloc, typename Augment, typename Tracer, typename Compare>
+frozen_avltree<K, V, Compare> freeze(const avltree<K, V, Alloc, Augment, Tracer, Compare>& tree)
+{
+  return frozen_avltree<K, V, Compare>(tree.begin(), tree.end(), tree.key_comp());
+}
+
+
+
+// ============================================================================================ //
+// |                            `frozen_avltree` method definitions                           | //
+// ============================================================================================ //
+
+template <typename K, typename V, typename Compare>
+template <typename ForwardIt>
+frozen_avltree<K, V, Compare>::frozen_avltree(ForwardIt first, ForwardIt last, const Compare& compare) :
+  _compare(compare)
+{
+  const std::size_t count = static_cast<std::size_t>(std::distance(first, last));
+  _keys.resize(count + 1);
+  _values.resize(count + 1);
+  _fill(1, first);
+}
+
+// An in-order walk of the implicit tree takes the positions in key order.
+template <typename K, typename V, typename Compare>
+template <typename ForwardIt>
+void frozen_avltree<K, V, Compare>::_fill(std::size_t position, ForwardIt& next)
+{
+  if (position >= _keys.size())
+    return;
+  _fill(2 * position, next);
+  const auto& element = *next;
+  _keys[position] = element.first;
+  _values[position] = element.second;
+  ++next;
+  _fill(2 * position + 1, next);
+}
+
+template <typename K, typename V, typename Compare>
+template <typename Q>
+const V* frozen_avltree<K, V, Compare>::find(const Q& key) const
+{
+  const std::size_t position = eytzinger_find(_keys.data(), size(), key, _compare);
+  return position ? &_values[position] : nullptr;
+}
+
+// Step down to 2i when the key is at or before position i, else 2i + 1, until we fall off the
+// bottom. The last position we stepped left from holds the first key not less than `key`; its
+// position is what's left of i after dropping the trailing right steps (the trailing 1 bits) and
+// then the left step (one 0 bit). The prefetch address is worked out as an integer, since past
+// the bottom levels it lies beyond the array, where a pointer can't point.
+template <typename K, typename Q, typename Compare>
+std::size_t eytzinger_lower_bound(const K* keys, std::size_t count, const Q& key, Compare compare)
+{
+  std::size_t position = 1;
+  while (position <= count)
+  {
+#if defined(__GNUC__)
+    __builtin_prefetch(reinterpret_cast<const void*>(reinterpret_cast<std::uintptr_t>(keys)
+                                                     + 16 * position * sizeof(K)));
+#endif
+    position = 2 * position + key_before(compare, keys[position], key);
+  }
+  while (position & 1)
+    position >>= 1;
+  return position >> 1;
+}
+
+#endif  // FROZEN_AVLTREE_H
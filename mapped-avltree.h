@@ -0,0 +1,381 @@
+/*
+mapped-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+Saving a tree to a file, and searching the file in place through a read-only memory mapping.
+*/
+
+#ifndef MAPPED_AVLTREE_H
+#define MAPPED_AVLTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avltree.h"
+#include "frozen-avltree.h"
+
+// The start of a snapshot file. The rest is the keys and then the values of a `frozen_avltree`,
+// each array starting at a multiple of 64 bytes, position 0 included. Everything is written in the
+// machine's own byte order and layout, which `open` checks it is reading back.
+struct mapped_avltree_header
+{
+  static const std::uint32_t current_version = 2;
+  static const std::uint32_t native_byte_order = 0x01020304;
+
+  char magic[8];  // "avltree" and a terminating zero
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t key_size;
+  std::uint32_t key_alignment;
+  std::uint32_t value_size;
+  std::uint32_t value_alignment;
+  std::uint64_t count;          // The number of elements.
+  std::uint64_t keys_offset;    // From the start of the file, to `count` + 1 keys.
+  std::uint64_t values_offset;  // From the start of the file, to `count` + 1 values.
+  std::uint64_t order;          // `mapped_avltree_order<Compare>()` for the order of the keys.
+};
+
+// Identifies the comparison policy a snapshot's keys are ordered by: a hash (FNV-1a) of the
+// policy's type name, which is the same from one process to the next on a given platform.
+template <typename Compare>
+std::uint64_t mapped_avltree_order()
+{
+  std::uint64_t hash = 14695981039346656037ull;
+  for (const char* c = typeid(Compare).name(); *c; ++c)
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+  return hash;
+}
+
+// A snapshot saved by `save_mapped`, searched directly in a read-only shared mapping of its file.
+//
+// Opening a snapshot reads only its header; the pages of the arrays are read in by the first
+// searches that touch them, and the page cache holds one copy of them however many processes have
+// the file open. The keys are in Eytzinger order, searched as `frozen_avltree` searches them.
+//
+// The keys and values are stored as their bytes, so both must be trivially copyable (no pointers
+// or strings) and a file can only be opened for the types it was saved with, on the same kind of
+// machine. The keys are searched with `Compare`, which must be the policy of the tree the snapshot
+// was saved from: the file records the policy's type, and `open` checks it and that the first keys
+// are in its order. A snapshot can't be changed; save a new one, which replaces the file atomically
+// while existing mappings keep reading the old one.
+template <typename K, typename V, typename Compare = key_less>
+class mapped_avltree
+{
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "mapped_avltree stores keys and values as bytes");
+
+public:
+
+  // Iterates over the elements in key order, dereferencing to `std::pair<const K&, const V&>`.
+  class const_iterator;
+
+  // A pair of iterators which can be used in a range-based for loop.
+  struct range_view
+  {
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    const_iterator first;
+    const_iterator last;
+  };
+
+  // A tree which isn't open, and is empty.
+  explicit mapped_avltree(const Compare& compare = Compare()) : _mapping(nullptr), _length(0), _keys(nullptr),
+    _values(nullptr), _count(0), _compare(compare) {}
+
+  // Take another tree's mapping, leaving it closed. It keeps its comparison policy, as `avltree`'s
+  // move does.
+  mapped_avltree(mapped_avltree&& other) : _mapping(other._mapping), _length(other._length), _keys(other._keys),
+    _values(other._values), _count(other._count), _compare(other._compare)
+  {
+    other._mapping = nullptr;
+    other._length = 0;
+    other._keys = nullptr;
+    other._values = nullptr;
+    other._count = 0;
+  }
+  mapped_avltree& operator=(mapped_avltree&& other)
+  {
+    swap(other);
+    return *this;
+  }
+  mapped_avltree(const mapped_avltree&) = delete;
+  mapped_avltree& operator=(const mapped_avltree&) = delete;
+
+  ~mapped_avltree() { close(); }
+
+  // Map the snapshot at `path`, closing any snapshot already open. Returns false, leaving the tree
+  // closed, if the file can't be mapped or doesn't hold a snapshot of these key and value types in
+  // this order.
+  bool open(const char* path);
+
+  // Unmap the snapshot. Pointers and iterators into it are then invalid.
+  void close();
+
+  bool is_open() const { return _mapping != nullptr; }
+
+  // Find the value associated with a given key.
+  optional<V> get(const K& key) const
+  {
+    const V* value = find(key);
+    return value ? optional<V>(*value) : optional<V>();
+  }
+
+  // A pointer to the value stored under `key` in the mapping, or nullptr.
+  template <typename Q>
+  const V* find(const Q& key) const
+  {
+    const std::size_t position = eytzinger_find(_keys, _count, key, _compare);
+    return position ? _values + position : nullptr;
+  }
+
+  // The elements in key order, and the first element whose key is not less than `key`.
+  const_iterator begin() const;
+  const_iterator end() const { return const_iterator(this, 0); }
+  template <typename Q>
+  const_iterator lower_bound(const Q& key) const
+  {
+    return const_iterator(this, eytzinger_lower_bound(_keys, _count, key, _compare));
+  }
+
+  // The elements with keys in [lo, hi).
+  template <typename Q>
+  range_view range(const Q& lo, const Q& hi) const
+  {
+    return key_before(_compare, lo, hi) ? range_view{ lower_bound(lo), lower_bound(hi) }
+                                        : range_view{ end(), end() };
+  }
+
+  // The number of elements in the tree.
+  std::size_t size() const { return _count; }
+  bool empty() const { return _count == 0; }
+
+  // The comparison policy ordering the keys.
+  Compare key_comp() const { return _compare; }
+
+  void swap(mapped_avltree& other)
+  {
+    std::swap(_mapping, other._mapping);
+    std::swap(_length, other._length);
+    std::swap(_keys, other._keys);
+    std::swap(_values, other._values);
+    std::swap(_count, other._count);
+    std::swap(_compare, other._compare);
+  }
+
+protected:
+
+  // Whether `header` describes arrays of K and V in this order which fit in the `length` bytes
+  // mapped at `file`.
+  bool _valid(const mapped_avltree_header& header, const char* file, std::size_t length) const;
+
+  void* _mapping;
+  std::size_t _length;
+  const K* _keys;
+  const V* _values;
+  std::size_t _count;
+  Compare _compare;
+};
+
+template <typename K, typename V, typename Compare>
+class mapped_avltree<K, V, Compare>::const_iterator
+{
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = std::pair<const K, V>;
+  using difference_type = std::ptrdiff_t;
+  using reference = std::pair<const K&, const V&>;
+
+  // `operator->` hands out a pointer to a temporary pair of references.
+  struct pointer
+  {
+    reference element;
+    const reference* operator->() const { return &element; }
+  };
+
+  const_iterator() : _tree(nullptr), _position(0) {}
+
+  reference operator*() const { return reference(_tree->_keys[_position], _tree->_values[_position]); }
+  pointer operator->() const { return pointer{**this}; }
+
+  const_iterator& operator++()
+  {
+    _position = eytzinger_next(_position, _tree->_count);
+    return *this;
+  }
+  const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+
+  friend bool operator==(const const_iterator& a, const const_iterator& b) { return a._position == b._position; }
+  friend bool operator!=(const const_iterator& a, const const_iterator& b) { return a._position != b._position; }
+
+private:
+  friend class mapped_avltree;
+
+  const_iterator(const mapped_avltree* tree, std::size_t position) : _tree(tree), _position(position) {}
+
+  const mapped_avltree* _tree;
+  std::size_t _position;  // 0 at the end
+};
+
+// Write a snapshot of a frozen tree to `path`, which `mapped_avltree` can open. The file is written
+// beside `path` and renamed over it once complete, so a reader never sees half a snapshot. Returns
+// false if it couldn't be written.
+template <typename K, typename V, typename Compare>
+bool save_mapped(const frozen_avltree<K, V, Compare>& frozen, const std::string& path);
+
+// Freeze a tree and write a snapshot of it to `path`, in O(n).
+template <typename K, typename V, typename... Params>
+bool save_mapped(const avltree<K, V, Params...>& tree, const std::string& path)
+{
+  return save_mapped(freeze(tree), path);
+}
+
+// Open the snapshot at `path`, saved from a tree ordered by `Compare`; check `is_open()` on the result.
+template <typename K, typename V, typename Compare = key_less>
+mapped_avltree<K, V, Compare> open_mapped(const std::string& path, const Compare& compare = Compare())
+{
+  mapped_avltree<K, V, Compare> tree(compare);
+  tree.open(path.c_str());
+  return tree;
+}
+
+
+
+// ============================================================================================ //
+// |                             `mapped_avltree` method definitions                          | //
+// ============================================================================================ //
+
+// The descriptor can be closed as soon as the file is mapped; the mapping keeps the file open.
+template <typename K, typename V, typename Compare>
+bool mapped_avltree<K, V, Compare>::open(const char* path)
+{
+  close();
+  const int file = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    return false;
+  struct stat status;
+  void* mapping = MAP_FAILED;
+  if (::fstat(file, &status) == 0 && static_cast<std::size_t>(status.st_size) >= sizeof(mapped_avltree_header))
+    mapping = ::mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+  ::close(file);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  const std::size_t length = static_cast<std::size_t>(status.st_size);
+  mapped_avltree_header header;
+  std::memcpy(&header, mapping, sizeof(header));
+  if (!_valid(header, static_cast<const char*>(mapping), length))
+  {
+    ::munmap(mapping, length);
+    return false;
+  }
+  _mapping = mapping;
+  _length = length;
+  _keys = reinterpret_cast<const K*>(static_cast<const char*>(mapping) + header.keys_offset);
+  _values = reinterpret_cast<const V*>(static_cast<const char*>(mapping) + header.values_offset);
+  _count = static_cast<std::size_t>(header.count);
+  return true;
+}
+
+template <typename K, typename V, typename Compare>
+void mapped_avltree<K, V, Compare>::close()
+{
+  if (_mapping)
+    ::munmap(_mapping, _length);
+  _mapping = nullptr;
+  _length = 0;
+  _keys = nullptr;
+  _values = nullptr;
+  _count = 0;
+}
+
+// Leftmost position: keep stepping to the left child.
+template <typename K, typename V, typename Compare>
+typename mapped_avltree<K, V, Compare>::const_iterator mapped_avltree<K, V, Compare>::begin() const
+{
+  std::size_t position = _count ? 1 : 0;
+  while (position && 2 * position <= _count)
+    position *= 2;
+  return const_iterator(this, position);
+}
+
+// Past the layout, the root and its children (positions 1 to 3) must be in order: a policy with
+// state, or one changed since the file was saved, can share a type with the one it was saved with.
+template <typename K, typename V, typename Compare>
+bool mapped_avltree<K, V, Compare>::_valid(const mapped_avltree_header& header, const char* file,
+                                           std::size_t length) const
+{
+  if (std::memcmp(header.magic, "avltree", 8) != 0 || header.version != mapped_avltree_header::current_version
+      || header.byte_order != mapped_avltree_header::native_byte_order || header.key_size != sizeof(K)
+      || header.key_alignment != alignof(K) || header.value_size != sizeof(V)
+      || header.value_alignment != alignof(V) || header.order != mapped_avltree_order<Compare>())
+    return false;
+  if (header.count >= length / sizeof(K) || header.count >= length / sizeof(V))
+    return false;
+  const std::uint64_t slots = header.count + 1;
+  if (!(header.keys_offset % alignof(K) == 0 && header.values_offset % alignof(V) == 0
+        && header.keys_offset <= length && slots * sizeof(K) <= length - header.keys_offset
+        && header.values_offset <= length && slots * sizeof(V) <= length - header.values_offset))
+    return false;
+  const K* keys = reinterpret_cast<const K*>(file + header.keys_offset);
+  return (header.count < 2 || key_before(_compare, keys[2], keys[1]))
+    && (header.count < 3 || key_before(_compare, keys[1], keys[3]));
+}
+
+// Header, padding, keys, padding, values, in one pass; then flush to disk and rename into place.
+template <typename K, typename V, typename Compare>
+bool save_mapped(const frozen_avltree<K, V, Compare>& frozen, const std::string& path)
+{
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "mapped_avltree stores keys and values as bytes");
+  const auto aligned = [](std::uint64_t offset) { return (offset + 63) / 64 * 64; };
+  const std::uint64_t slots = frozen.size() + 1;
+
+  mapped_avltree_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "avltree", 8);
+  header.version = mapped_avltree_header::current_version;
+  header.byte_order = mapped_avltree_header::native_byte_order;
+  header.key_size = sizeof(K);
+  header.key_alignment = alignof(K);
+  header.value_size = sizeof(V);
+  header.value_alignment = alignof(V);
+  header.count = frozen.size();
+  header.keys_offset = aligned(sizeof(header));
+  header.values_offset = aligned(header.keys_offset + slots * sizeof(K));
+  header.order = mapped_avltree_order<Compare>();
+
+  const std::string temporary = path + ".tmp";
+  std::FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (!file)
+    return false;
+  static const char padding[64] = {};
+  bool written = std::fwrite(&header, sizeof(header), 1, file) == 1
+    && std::fwrite(padding, 1, header.keys_offset - sizeof(header), file) == header.keys_offset - sizeof(header)
+    && std::fwrite(frozen.keys().data(), sizeof(K), slots, file) == slots;
+  const std::uint64_t keys_end = header.keys_offset + slots * sizeof(K);
+  written = written
+    && std::fwrite(padding, 1, header.values_offset - keys_end, file) == header.values_offset - keys_end
+    && std::fwrite(frozen.values().data(), sizeof(V), slots, file) == slots
+    && std::fflush(file) == 0 && ::fsync(::fileno(file)) == 0;
+  written = std::fclose(file) == 0 && written;
+  if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif  // MAPPED_AVLTREE_H
@@ -0,0 +1,262 @@
+/*
+node-pool.h
+Copyright (c) Eromid (Olly) 2017
+
+A pool of fixed-size memory slots, and a standard allocator which hands out nodes from it.
+*/
+
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+
+// A pool of fixed-size memory slots carved out of large blocks.
+//
+// The slot size is fixed by the first allocation made from the pool; containers only ever ask for
+// one size of object (their node), so every later request is served from the same slots. Freed
+// slots go on a free list and are handed out again before any new block is touched. A request for
+// a different size (or an over-aligned type) falls through to the global `operator new`.
+//
+// All blocks are released in one go when the pool is destroyed, or by `release`.
+class node_pool
+{
+public:
+
+  // Create an empty pool. No memory is allocated until the first slot is requested.
+  //   first_block_slots: The number of slots in the first block; each new block doubles this, up
+  //                      to `max_block_slots`.
+  explicit node_pool(std::size_t first_block_slots = 64) :
+    _slot_size(0), _next_block_slots(first_block_slots ? first_block_slots : 1), _blocks(nullptr),
+    _cursor(nullptr), _end(nullptr), _free_list(nullptr), _block_count(0) {}
+
+  node_pool(const node_pool&) = delete;
+  node_pool& operator=(const node_pool&) = delete;
+
+  ~node_pool();
+
+  // Get memory for one object of `bytes` size.
+  void* allocate(std::size_t bytes);
+
+  // Return memory previously obtained from `allocate` with the same `bytes` size.
+  void deallocate(void* slot, std::size_t bytes);
+
+  // Make sure the current block has room for `slots` more allocations of `bytes` size, getting a
+  // block big enough for them now if it doesn't. Once the free list is used up, the following
+  // allocations are then carved contiguously out of that block.
+  void reserve(std::size_t slots, std::size_t bytes);
+
+  // Give every block back to the system at once, without destroying anything still living in the
+  // slots; every slot handed out is then invalid. The pool can be used again afterwards.
+  void release();
+
+  // Whether allocations of `bytes` size are served from the pool's slots.
+  bool serves(std::size_t bytes) const { return _slot_size == _round_up(bytes); }
+
+  // The number of blocks the pool holds.
+  std::size_t block_count() const { return _block_count; }
+
+  // The largest block the pool will ask for, in slots.
+  static const std::size_t max_block_slots = 64 * 1024;
+
+private:
+
+  // A free slot is reused to hold the link to the next free slot.
+  struct free_slot { free_slot* next; };
+
+  // Blocks are chained through a header at their start so they can be released together.
+  struct block_header { block_header* next; };
+
+  // Round a request up to a multiple of the largest fundamental alignment.
+  static std::size_t _round_up(std::size_t bytes)
+  {
+    const std::size_t align = alignof(std::max_align_t);
+    if (bytes < sizeof(free_slot))
+      bytes = sizeof(free_slot);
+    return (bytes + align - 1) / align * align;
+  }
+
+  // Obtain a new block of at least `min_slots` and make it the one new slots are carved from.
+  void _grow(std::size_t min_slots = 0);
+
+  std::size_t _slot_size;        // 0 until the first allocation fixes it.
+  std::size_t _next_block_slots;
+  block_header* _blocks;
+  char* _cursor;                 // Next never-used slot in the newest block.
+  char* _end;                    // One past the last slot in the newest block.
+  free_slot* _free_list;
+  std::size_t _block_count;
+};
+
+
+// A standard allocator drawing from a shared `node_pool`.
+//
+// Copies (including rebound copies) share the same pool, and the pool lives for as long as any
+// allocator using it does. A copied container gets a fresh pool of its own, though (see
+// `select_on_container_copy_construction`). Pass one to an `avltree` to have all of its nodes
+// allocated from the pool:
+//
+//   avltree<int, string, node_pool_allocator<int>> tree;
+template <typename T>
+class node_pool_allocator
+{
+public:
+  using value_type = T;
+
+  // Create an allocator with a fresh pool of its own.
+  node_pool_allocator() : _pool(std::make_shared<node_pool>()) {}
+
+  // Create an allocator using an existing pool.
+  explicit node_pool_allocator(std::shared_ptr<node_pool> pool) : _pool(pool) {}
+
+  // Rebinding copies share the pool of the allocator they were made from.
+  template <typename U>
+  node_pool_allocator(const node_pool_allocator<U>& other) : _pool(other.pool()) {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(_allocate(n * sizeof(T), std::integral_constant<bool,
+      (alignof(T) <= alignof(std::max_align_t))>()));
+  }
+
+  void deallocate(T* p, std::size_t n)
+  {
+    _deallocate(p, n * sizeof(T), std::integral_constant<bool,
+      (alignof(T) <= alignof(std::max_align_t))>());
+  }
+
+  // Set aside contiguous room in the pool for the next `n` objects.
+  void reserve(std::size_t n)
+  {
+    if (alignof(T) <= alignof(std::max_align_t))
+      _pool->reserve(n, sizeof(T));
+  }
+
+  // Release all the pool's memory at once, if this allocator is the only one using the pool and
+  // every object of type T came from its slots; nothing in them is destroyed. Returns whether it
+  // was released.
+  bool release_all()
+  {
+    if (alignof(T) > alignof(std::max_align_t) || _pool.use_count() != 1 || !_pool->serves(sizeof(T)))
+      return false;
+    _pool->release();
+    return true;
+  }
+
+  // A copy of a container allocates from a new pool, rather than sharing the original's.
+  node_pool_allocator select_on_container_copy_construction() const { return node_pool_allocator(); }
+
+  // The pool this allocator draws from.
+  const std::shared_ptr<node_pool>& pool() const { return _pool; }
+
+  template <typename U>
+  bool operator==(const node_pool_allocator<U>& other) const { return _pool == other.pool(); }
+
+  template <typename U>
+  bool operator!=(const node_pool_allocator<U>& other) const { return _pool != other.pool(); }
+
+private:
+  void* _allocate(std::size_t bytes, std::true_type) { return _pool->allocate(bytes); }
+  void* _allocate(std::size_t bytes, std::false_type) { return ::operator new(bytes); }
+  void _deallocate(void* p, std::size_t bytes, std::true_type) { _pool->deallocate(p, bytes); }
+  void _deallocate(void* p, std::size_t, std::false_type) { ::operator delete(p); }
+
+  std::shared_ptr<node_pool> _pool;
+};
+
+
+
+// ============================================================================================ //
+// |                              `node_pool` method definitions                              | //
+// ============================================================================================ //
+
+// Release every block at once. Objects still living in the pool are not destroyed.
+inline node_pool::~node_pool()
+{
+  release();
+}
+
+// The slot size and the size of the next block are kept, for a pool being refilled.
+inline void node_pool::release()
+{
+  while (_blocks)
+  {
+    block_header* next = _blocks->next;
+    ::operator delete(_blocks);
+    _blocks = next;
+  }
+  _cursor = nullptr;
+  _end = nullptr;
+  _free_list = nullptr;
+  _block_count = 0;
+}
+
+// Hand out a slot: a recycled one if there is one, otherwise the next unused one.
+inline void* node_pool::allocate(std::size_t bytes)
+{
+  const std::size_t rounded = _round_up(bytes);
+  if (_slot_size == 0)
+    _slot_size = rounded;
+  else if (rounded != _slot_size)
+    return ::operator new(bytes);
+
+  if (_free_list)
+  {
+    free_slot* slot = _free_list;
+    _free_list = slot->next;
+    return slot;
+  }
+  if (_cursor == _end)
+    _grow();
+  void* slot = _cursor;
+  _cursor += _slot_size;
+  return slot;
+}
+
+// Put a slot on the free list so the next allocation reuses it.
+inline void node_pool::deallocate(void* slot, std::size_t bytes)
+{
+  if (!slot)
+    return;
+  if (_round_up(bytes) != _slot_size)
+  {
+    ::operator delete(slot);
+    return;
+  }
+  free_slot* freed = static_cast<free_slot*>(slot);
+  freed->next = _free_list;
+  _free_list = freed;
+}
+
+// Reserve a contiguous run of slots for a bulk allocation.
+inline void node_pool::reserve(std::size_t slots, std::size_t bytes)
+{
+  const std::size_t rounded = _round_up(bytes);
+  if (_slot_size == 0)
+    _slot_size = rounded;
+  else if (rounded != _slot_size)
+    return;
+  if (static_cast<std::size_t>(_end - _cursor) < slots * _slot_size)
+    _grow(slots);
+}
+
+// Get a new block from the system, twice the size of the last one (up to `max_block_slots`), or
+// `min_slots` if that is bigger.
+inline void node_pool::_grow(std::size_t min_slots)
+{
+  const std::size_t header = _round_up(sizeof(block_header));
+  const std::size_t block_slots = (min_slots > _next_block_slots) ? min_slots : _next_block_slots;
+  char* memory = static_cast<char*>(::operator new(header + block_slots * _slot_size));
+  block_header* block = reinterpret_cast<block_header*>(memory);
+  block->next = _blocks;
+  _blocks = block;
+  ++_block_count;
+
+  _cursor = memory + header;
+  _end = _cursor + block_slots * _slot_size;
+  if (_next_block_slots < max_block_slots)
+    _next_block_slots *= 2;
+}
+
+#endif  // NODE_POOL_H
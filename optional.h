@@ -8,27 +8,137 @@ A template for an object which may or may not hold a value.
 #ifndef OPTIONAL_H
 #define OPTIONAL_H
 
+#include <cassert>
+#include <new>
+#include <type_traits>
+#include <utility>
+
 // A struct which may or may not hold a value of type T.
+//
+// The value is constructed in storage inside the struct only when there is one, so making an empty
+// `optional` costs nothing and T needn't be default constructible. `optional<T&>` (below) refers
+// to a value held elsewhere instead.
 template <typename T>
 struct optional
 {
   // Construct without value
-  optional()         : _has_value(false)               {}
+  optional() : _has_value(false) {}
 
   // Construct with value
-  optional(T& value) : _value(value), _has_value(true) {}
+  optional(const T& value) : _has_value(true) { ::new (_address()) T(value); }
+  optional(T&& value) : _has_value(true) { ::new (_address()) T(std::move(value)); }
+
+  optional(const optional& other) : _has_value(other._has_value)
+  {
+    if (_has_value)
+      ::new (_address()) T(*other);
+  }
+  optional(optional&& other) : _has_value(other._has_value)
+  {
+    if (_has_value)
+      ::new (_address()) T(std::move(*other));
+  }
+
+  optional& operator=(const optional& other)
+  {
+    if (other._has_value)
+      _assign(*other);
+    else
+      reset();
+    return *this;
+  }
+  optional& operator=(optional&& other)
+  {
+    if (other._has_value)
+      _assign(std::move(*other));
+    else
+      reset();
+    return *this;
+  }
+
+  ~optional() { reset(); }
 
   // Return true if the struct has a value.
   bool has_value() const { return _has_value; }
-  
-  // Get the value. Will still return reference to default constructed value if _has_value is false, so it's up to
-  // the user to check if the structure contains a valid value before using it.
-  T& value()             { return _value; }
-  const T& value() const { return _value; }
+  explicit operator bool() const { return _has_value; }
+
+  // Get the value. There must be one, so it's up to the user to check `has_value` first.
+  T& value()             { assert(_has_value); return *_address(); }
+  const T& value() const { assert(_has_value); return *_address(); }
+  T& operator*()             { return value(); }
+  const T& operator*() const { return value(); }
+  T* operator->()             { return &value(); }
+  const T* operator->() const { return &value(); }
+
+  // The value, or `fallback` if there is none.
+  template <typename U>
+  T value_or(U&& fallback) const { return _has_value ? value() : static_cast<T>(std::forward<U>(fallback)); }
+
+  // Construct the value from `args`, destroying any value held first.
+  template <typename... Args>
+  T& emplace(Args&&... args)
+  {
+    reset();
+    ::new (_address()) T(std::forward<Args>(args)...);
+    _has_value = true;
+    return *_address();
+  }
+
+  // Destroy the value, if there is one.
+  void reset()
+  {
+    if (_has_value)
+      _address()->~T();
+    _has_value = false;
+  }
 
 private:
-  T _value;
+  T* _address()             { return static_cast<T*>(static_cast<void*>(&_storage)); }
+  const T* _address() const { return static_cast<const T*>(static_cast<const void*>(&_storage)); }
+
+  // Assign over the value held, or construct one if there's none.
+  template <typename U>
+  void _assign(U&& value)
+  {
+    if (_has_value)
+      *_address() = std::forward<U>(value);
+    else
+      emplace(std::forward<U>(value));
+  }
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
   bool _has_value;
 };
 
+// An `optional` referring to a value held elsewhere, such as in a tree's node: just a pointer,
+// which is null without a value. Assigning one makes it refer to the other's value.
+template <typename T>
+struct optional<T&>
+{
+  // Construct without value
+  optional() : _pointer(nullptr) {}
+
+  // Construct referring to `value`
+  optional(T& value) : _pointer(&value) {}
+
+  // Return true if the struct refers to a value.
+  bool has_value() const { return _pointer != nullptr; }
+  explicit operator bool() const { return _pointer != nullptr; }
+
+  // Get the value referred to. There must be one, so check `has_value` first.
+  T& value() const { assert(_pointer); return *_pointer; }
+  T& operator*() const { return value(); }
+  T* operator->() const { return &value(); }
+
+  // A copy of the value, or `fallback` if there is none.
+  template <typename U>
+  typename std::remove_const<T>::type value_or(U&& fallback) const
+  {
+    return _pointer ? *_pointer : static_cast<typename std::remove_const<T>::type>(std::forward<U>(fallback));
+  }
+
+private:
+  T* _pointer;
+};
+
 #endif  // OPTIONAL_H
@@ -0,0 +1,343 @@
+/*
+parallel-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+Building and combining AVL trees on several threads.
+*/
+
+#ifndef PARALLEL_AVLTREE_H
+#define PARALLEL_AVLTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "avltree.h"
+#include "node-pool.h"
+
+// Whether copies of an allocator can allocate and free on several threads at once. The parallel
+// algorithms run on one thread for allocators which can't. `std::allocator` can; a
+// `node_pool_allocator` shares an unsynchronized pool between its copies, so can't.
+template <typename Alloc>
+struct is_thread_safe_allocator : std::true_type {};
+
+template <typename T>
+struct is_thread_safe_allocator<node_pool_allocator<T>> : std::false_type {};
+
+// The parallel algorithms on an `avltree` type. Use them through the functions below.
+//
+// Each splits its work in two, hands one half to a new thread and works on the other itself,
+// until the threads it was given are used up; each thread then finishes its part as the
+// single-threaded algorithm would. A forked half works on a tree object of its own (sharing the
+// allocator), so no two threads touch the same tree or count. The tree's tracer only hears about
+// the work done on the calling thread.
+template <typename Tree>
+class parallel_avltree
+{
+public:
+  using node = typename Tree::node;
+
+  // Replace the contents of `tree` with the key-value pairs in [first, last), in any order. If a
+  // key is repeated, its last value is kept, as if each pair were inserted in turn.
+  template <typename RandomIt>
+  static void assign(Tree& tree, RandomIt first, RandomIt last, unsigned threads);
+
+  enum set_operation { UNION, INTERSECTION, DIFFERENCE };
+
+  // `tree.set_union(std::move(other))` and the rest, on up to `threads` threads.
+  static void combine(Tree& tree, Tree&& other, set_operation operation, unsigned threads);
+
+private:
+  // Work smaller than this isn't worth a thread.
+  static const std::size_t _min_elements_per_thread = 16 * 1024;
+
+  // Run task(0), ..., task(parts - 1), all but the first on new threads, and wait for them. If any
+  // throws, the first exception is rethrown once they have all finished.
+  template <typename Task>
+  static void _fork(unsigned parts, const Task& task);
+
+  // The number of threads to use for `count` elements, given at most `threads`.
+  static unsigned _threads_for(std::size_t count, unsigned threads)
+  {
+    if (!is_thread_safe_allocator<decltype(std::declval<Tree&>().get_allocator())>::value)
+      return 1;
+    const std::size_t useful = count / _min_elements_per_thread + 1;
+    return static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, useful)));
+  }
+
+  // Sort nodes[0..count) by key, keeping nodes with equal keys in order: runs sorted on each
+  // thread, then merged in pairs, in parallel, until one run is left.
+  static void _sort(const Tree& tree, node** nodes, std::size_t count, unsigned threads);
+
+  // `Tree::_build_balanced`, building the two subtrees of each node in parallel while there are
+  // threads to spare.
+  static node* _build(node* const* nodes, std::size_t count, node* parent, int& height, unsigned threads);
+
+  // As `Tree::_union` and the rest, running the recursions on the two subtrees in parallel while
+  // there are threads to spare. Nodes are destroyed by `tree`, or by a worker tree whose count
+  // starts as `tree`'s, and whichever it destroys are then taken off `tree`'s count.
+  static node* _combine(Tree& tree, set_operation operation, node* a, int a_height, node* b, int b_height,
+                        int& height, unsigned threads);
+};
+
+// Replace the contents of `tree` with the key-value pairs in [first, last), which needn't be
+// sorted, using up to `threads` threads. The nodes are made in parallel, sorted with a parallel
+// merge sort and linked into a balanced tree, so there is no searching or rebalancing. A repeated
+// key keeps its last value.
+template <typename Tree, typename RandomIt>
+void parallel_assign(Tree& tree, RandomIt first, RandomIt last,
+                     unsigned threads = std::thread::hardware_concurrency())
+{
+  parallel_avltree<Tree>::assign(tree, first, last, threads);
+}
+
+// `tree.set_union(std::move(other))`, `set_intersection` and `set_difference`, recursing on the
+// two halves of each split in parallel on up to `threads` threads.
+template <typename Tree>
+void parallel_set_union(Tree& tree, Tree&& other, unsigned threads = std::thread::hardware_concurrency())
+{
+  parallel_avltree<Tree>::combine(tree, std::move(other), parallel_avltree<Tree>::UNION, threads);
+}
+
+template <typename Tree>
+void parallel_set_intersection(Tree& tree, Tree&& other, unsigned threads = std::thread::hardware_concurrency())
+{
+  parallel_avltree<Tree>::combine(tree, std::move(other), parallel_avltree<Tree>::INTERSECTION, threads);
+}
+
+template <typename Tree>
+void parallel_set_difference(Tree& tree, Tree&& other, unsigned threads = std::thread::hardware_concurrency())
+{
+  parallel_avltree<Tree>::combine(tree, std::move(other), parallel_avltree<Tree>::DIFFERENCE, threads);
+}
+
+
+
+// ============================================================================================ //
+// |                           `parallel_avltree` method definitions                          | //
+// ============================================================================================ //
+
+// Make the nodes, a slice of the input on each thread, then sort them, drop the repeated keys and
+// link what is left.
+template <typename Tree>
+template <typename RandomIt>
+void parallel_avltree<Tree>::assign(Tree& tree, RandomIt first, RandomIt last, unsigned threads)
+{
+  tree._destroy_all();
+  const std::size_t count = static_cast<std::size_t>(last - first);
+  if (count == 0)
+    return;
+  threads = _threads_for(count, threads);
+  if (threads == 1)
+    Tree::_reserve_nodes(tree._alloc, count, 0);
+
+  std::vector<Tree> workers;
+  workers.reserve(threads);
+  for (unsigned part = 0; part < threads; ++part)
+    workers.emplace_back(tree.get_allocator());
+  std::vector<node*> nodes(count, nullptr);
+  std::exception_ptr failure;
+  try
+  {
+    _fork(threads, [&](unsigned part) {
+      for (std::size_t i = count * part / threads; i < count * (part + 1) / threads; ++i)
+        nodes[i] = workers[part]._create_node(nullptr, first[i].first, first[i].second);
+    });
+  }
+  catch (...)
+  {
+    failure = std::current_exception();
+  }
+  for (Tree& worker : workers)
+  {
+    tree._node_count += worker._node_count;
+    worker._node_count = 0;
+  }
+  if (failure)
+  {
+    for (node* made : nodes)
+      if (made)
+        tree._destroy_node(made);
+    std::rethrow_exception(failure);
+  }
+
+  _sort(tree, nodes.data(), count, threads);
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < count; ++i)
+    if (i + 1 < count && !tree._less(nodes[i]->key, nodes[i + 1]->key))
+      tree._destroy_node(nodes[i]);  // the later one wins
+    else
+      nodes[kept++] = nodes[i];
+
+  int height;
+  tree.root = _build(nodes.data(), kept, nullptr, height, threads);
+}
+
+// Without spare threads (or when the tree is small) this is just the member function.
+template <typename Tree>
+void parallel_avltree<Tree>::combine(Tree& tree, Tree&& other, set_operation operation, unsigned threads)
+{
+  threads = _threads_for(std::min(tree.size(), other.size()), threads);
+  if (threads == 1)
+  {
+    if (operation == UNION)
+      tree.set_union(std::move(other));
+    else if (operation == INTERSECTION)
+      tree.set_intersection(std::move(other));
+    else
+      tree.set_difference(std::move(other));
+    return;
+  }
+  tree.rebalance();
+  int other_height;
+  node* other_root = tree._take_nodes(other, other_height);
+  node* tree_root = tree.root;
+  int height;
+  node* result = _combine(tree, operation, tree_root, Tree::_height(tree_root), other_root, other_height,
+                          height, threads);
+  tree.root = result;
+}
+
+template <typename Tree>
+template <typename Task>
+void parallel_avltree<Tree>::_fork(unsigned parts, const Task& task)
+{
+  std::vector<std::future<void>> forked;
+  forked.reserve(parts);
+  std::exception_ptr failure;
+  try
+  {
+    for (unsigned part = 1; part < parts; ++part)
+      forked.push_back(std::async(std::launch::async, std::cref(task), part));
+    task(0);
+  }
+  catch (...)
+  {
+    failure = std::current_exception();
+  }
+  for (std::future<void>& part : forked)
+  {
+    try
+    {
+      part.get();
+    }
+    catch (...)
+    {
+      if (!failure)
+        failure = std::current_exception();
+    }
+  }
+  if (failure)
+    std::rethrow_exception(failure);
+}
+
+// `std::stable_sort` on each thread's share, then rounds of `std::inplace_merge`, which is stable
+// too, on neighbouring runs.
+template <typename Tree>
+void parallel_avltree<Tree>::_sort(const Tree& tree, node** nodes, std::size_t count, unsigned threads)
+{
+  const auto by_key = [&tree](const node* a, const node* b) { return tree._less(a->key, b->key); };
+  std::vector<std::size_t> bounds;
+  for (unsigned part = 0; part <= threads; ++part)
+    bounds.push_back(count * part / threads);
+  _fork(threads, [&](unsigned part) {
+    std::stable_sort(nodes + bounds[part], nodes + bounds[part + 1], by_key);
+  });
+  while (bounds.size() > 2)
+  {
+    const unsigned runs = static_cast<unsigned>(bounds.size() - 1);
+    _fork(runs / 2, [&](unsigned pair) {
+      std::inplace_merge(nodes + bounds[2 * pair], nodes + bounds[2 * pair + 1], nodes + bounds[2 * pair + 2],
+                         by_key);
+    });
+    std::vector<std::size_t> merged;
+    for (std::size_t i = 0; i < bounds.size(); i += 2)
+      merged.push_back(bounds[i]);
+    if (runs % 2)
+      merged.push_back(bounds.back());
+    bounds.swap(merged);
+  }
+}
+
+// The same shape as `_build_balanced`, so the result doesn't depend on the number of threads.
+template <typename Tree>
+typename parallel_avltree<Tree>::node*
+parallel_avltree<Tree>::_build(node* const* nodes, std::size_t count, node* parent, int& height, unsigned threads)
+{
+  if (threads <= 1 || count == 0)
+    return Tree::_build_balanced(nodes, count, parent, height);
+  const std::size_t left_count = (count - 1) / 2;
+  node* subtree_root = nodes[left_count];
+  int left_height, right_height;
+  subtree_root->parent = parent;
+  _fork(2, [&](unsigned side) {
+    if (side == Tree::LEFT)
+      subtree_root->child[Tree::LEFT] = _build(nodes, left_count, subtree_root, left_height, threads / 2);
+    else
+      subtree_root->child[Tree::RIGHT] = _build(nodes + left_count + 1, count - left_count - 1, subtree_root,
+                                                right_height, threads - threads / 2);
+  });
+  subtree_root->balance_factor = static_cast<int8_t>(left_height - right_height);
+  height = 1 + std::max(left_height, right_height);
+  Tree::augment_type::update(*subtree_root);
+  return subtree_root;
+}
+
+// The recursion of `Tree::_union`, `_intersection` and `_difference`, with `a`'s root kept or
+// dropped as each of them would. The right halves are combined by a worker tree on another thread.
+// The worker starts with `tree`'s count, which includes every node it can be handed, so its count
+// can't go below zero as it destroys them.
+template <typename Tree>
+typename parallel_avltree<Tree>::node*
+parallel_avltree<Tree>::_combine(Tree& tree, set_operation operation, node* a, int a_height, node* b, int b_height,
+                                 int& height, unsigned threads)
+{
+  if (threads <= 1 || !a || !b)
+  {
+    if (operation == UNION)
+      return tree._union(a, a_height, b, b_height, height);
+    else if (operation == INTERSECTION)
+      return tree._intersection(a, a_height, b, b_height, height);
+    return tree._difference(a, a_height, b, b_height, height);
+  }
+  node* b_left;
+  node* b_right;
+  int b_left_height, b_right_height;
+  node* duplicate = tree._split(b, b_height, a->key, b_left, b_left_height, b_right, b_right_height);
+  int left_height = Tree::_child_height(a, a_height, Tree::LEFT);
+  int right_height = Tree::_child_height(a, a_height, Tree::RIGHT);
+  node* a_left = Tree::_take_child(a, Tree::LEFT);
+  node* a_right = Tree::_take_child(a, Tree::RIGHT);
+  node* left;
+  node* right;
+  Tree worker(tree.get_allocator());
+  const std::size_t lent = tree._node_count;
+  worker._node_count = lent;
+  _fork(2, [&](unsigned side) {
+    if (side == Tree::LEFT)
+      left = _combine(tree, operation, a_left, left_height, b_left, b_left_height, left_height, threads / 2);
+    else
+      right = _combine(worker, operation, a_right, right_height, b_right, b_right_height, right_height,
+                       threads - threads / 2);
+  });
+  tree._node_count -= lent - worker._node_count;
+  worker._node_count = 0;
+  worker.root = nullptr;
+
+  const bool keep_root = operation == UNION || (operation == INTERSECTION) == (duplicate != nullptr);
+  if (duplicate)
+    tree._destroy_node(duplicate);
+  if (keep_root)
+    return tree._join(left, left_height, a, right, right_height, height);
+  tree._destroy_node(a);
+  return tree._join(left, left_height, right, right_height, height);
+}
+
+#endif  // PARALLEL_AVLTREE_H
@@ -0,0 +1,320 @@
+/*
+persistent-avltree.h
+Copyright (c) Eromid (Olly) 2017
+
+A persistent AVL tree: updates copy the nodes they change, and snapshots of any version can be
+kept and searched, with no locking, while the tree carries on being updated.
+*/
+
+#ifndef PERSISTENT_AVLTREE_H
+#define PERSISTENT_AVLTREE_H
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "optional.h"
+
+template<typename K, typename V>
+class test_helper;
+
+// An AVL tree whose nodes are never changed once they are made.
+//
+// `insert` and `remove` build new copies of the nodes on the path from the root to the key (and of
+// the few more a rotation moves), sharing every other node with the previous version, so an
+// update costs O(log n) time and memory. `snapshot` captures the current version in O(1). A
+// snapshot can be searched and iterated from any thread, without locks, while one writer thread
+// goes on updating the tree; nodes are reclaimed (through `std::shared_ptr`) once no version uses
+// them any more.
+//
+// Keys and values are copied into the new nodes along an update's path, so keep values which are
+// expensive to copy behind a pointer.
+template <typename K, typename V>
+class persistent_avltree
+{
+protected:
+  struct node;
+  using node_ptr = std::shared_ptr<const node>;
+
+public:
+
+  // An immutable version of the tree, as captured by `snapshot`. Cheap to copy; all copies share
+  // the same nodes.
+  class version
+  {
+  public:
+    class const_iterator;
+
+    // An empty version.
+    version() {}
+
+    // The value stored under `key`, if there is one.
+    optional<V> get(const K& key) const
+    {
+      const V* value = find(key);
+      return value ? optional<V>(*value) : optional<V>();
+    }
+
+    // A pointer to the value stored under `key`, or nullptr. Valid while the version is.
+    template <typename Q>
+    const V* find(const Q& key) const;
+
+    // The number of elements in the version.
+    std::size_t size() const { return _root ? _root->size : 0; }
+    bool empty() const { return !_root; }
+
+    // Iterate over the elements in key order.
+    const_iterator begin() const { return const_iterator(_root.get()); }
+    const_iterator end() const { return const_iterator(); }
+
+  private:
+    friend class persistent_avltree;
+    template <typename, typename> friend class test_helper;
+
+    explicit version(node_ptr root) : _root(std::move(root)) {}
+
+    node_ptr _root;
+  };
+
+  persistent_avltree() {}
+
+  // Copying shares every node; the copies then change independently.
+  persistent_avltree(const persistent_avltree& other) : _root(std::atomic_load(&other._root)) {}
+  persistent_avltree& operator=(const persistent_avltree& other)
+  {
+    _publish(std::atomic_load(&other._root));
+    return *this;
+  }
+
+  // Add a key-value pair, or replace the value of an existing key.
+  void insert(const K& key, const V& value) { _publish(_insert(_root, key, value)); }
+
+  // Remove the element with the given key. Doesn't matter if it isn't there.
+  void remove(const K& key)
+  {
+    node_ptr new_root = _remove(_root, key);
+    if (new_root != _root)
+      _publish(std::move(new_root));
+  }
+
+  // The current version, in O(1). Can be called from any thread.
+  version snapshot() const { return version(std::atomic_load(&_root)); }
+
+  // Searches of the current version, for the writer thread (other threads use `snapshot()`).
+  optional<V> get(const K& key) const { return version(_root).get(key); }
+  std::size_t size() const { return _root ? _root->size : 0; }
+
+protected:
+
+  enum { LEFT = 0, RIGHT = 1 };
+
+  // A node, with the height and size of its subtree.
+  struct node
+  {
+    node(const K& key, const V& value, node_ptr left, node_ptr right) : key(key), value(value),
+      child{std::move(left), std::move(right)},
+      height(static_cast<int8_t>(1 + std::max(_height(child[LEFT]), _height(child[RIGHT])))),
+      size(1 + _size(child[LEFT]) + _size(child[RIGHT])) {}
+    const K key;
+    const V value;
+    const node_ptr child[2];
+    const int8_t height;
+    const std::size_t size;
+  };
+
+  // Make a node with the given children, on `side` and the other side.
+  static node_ptr _make(const K& key, const V& value, int side, node_ptr on_side, node_ptr other_side)
+  {
+    return side == LEFT ? std::make_shared<const node>(key, value, std::move(on_side), std::move(other_side))
+                        : std::make_shared<const node>(key, value, std::move(other_side), std::move(on_side));
+  }
+
+  static int _height(const node_ptr& subtree_root) { return subtree_root ? subtree_root->height : 0; }
+  static std::size_t _size(const node_ptr& subtree_root) { return subtree_root ? subtree_root->size : 0; }
+
+  // Make a node from a key, a value and two subtrees whose heights differ by at most two, rotating
+  // if they differ by two.
+  static node_ptr _balance(const K& key, const V& value, node_ptr left, node_ptr right);
+
+  // The subtree with `key` inserted (or its value replaced).
+  static node_ptr _insert(const node_ptr& subtree_root, const K& key, const V& value);
+
+  // The subtree without `key`; `subtree_root` itself if the key isn't in it.
+  static node_ptr _remove(const node_ptr& subtree_root, const K& key);
+
+  // The non-empty subtree without its smallest node, which is returned through `smallest`.
+  static node_ptr _remove_smallest(const node_ptr& subtree_root, node_ptr& smallest);
+
+  // Make `new_root` the current version, so that snapshots taken from now on see it.
+  void _publish(node_ptr new_root) { std::atomic_store(&_root, std::move(new_root)); }
+
+  // The root of the current version. Only the writer changes it, always atomically; readers on
+  // other threads load it atomically.
+  node_ptr _root;
+};
+
+// Iterates over a version in key order, keeping the path back up the tree on a stack since the
+// nodes have no parent links.
+template <typename K, typename V>
+class persistent_avltree<K, V>::version::const_iterator
+{
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = std::pair<const K, V>;
+  using difference_type = std::ptrdiff_t;
+  using reference = std::pair<const K&, const V&>;
+
+  // `operator->` hands out a pointer to a temporary pair of references.
+  struct pointer
+  {
+    reference element;
+    const reference* operator->() const { return &element; }
+  };
+
+  const_iterator() {}
+
+  reference operator*() const { return reference(_path.back()->key, _path.back()->value); }
+  pointer operator->() const { return pointer{**this}; }
+  const K& key() const { return _path.back()->key; }
+  const V& value() const { return _path.back()->value; }
+
+  // The next node is the leftmost of the right subtree, or else the nearest ancestor on the stack.
+  const_iterator& operator++()
+  {
+    const node* right = _path.back()->child[RIGHT].get();
+    _path.pop_back();
+    _push_leftmost(right);
+    return *this;
+  }
+  const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+
+  friend bool operator==(const const_iterator& a, const const_iterator& b)
+  { return a._path.empty() ? b._path.empty() : !b._path.empty() && a._path.back() == b._path.back(); }
+  friend bool operator!=(const const_iterator& a, const const_iterator& b) { return !(a == b); }
+
+private:
+  friend class version;
+
+  explicit const_iterator(const node* root) { _push_leftmost(root); }
+
+  // Stack the path down the left edge of the subtree.
+  void _push_leftmost(const node* subtree_root)
+  {
+    for (; subtree_root; subtree_root = subtree_root->child[LEFT].get())
+      _path.push_back(subtree_root);
+  }
+
+  // The nodes still to be visited whose left subtrees are done, the current one at the back.
+  std::vector<const node*> _path;
+};
+
+
+
+// ============================================================================================ //
+// |                          `persistent_avltree` method definitions                         | //
+// ============================================================================================ //
+
+// Iterative search down the version.
+template <typename K, typename V>
+template <typename Q>
+const V* persistent_avltree<K, V>::version::find(const Q& key) const
+{
+  const node* current = _root.get();
+  while (current)
+  {
+    if (key < current->key)
+      current = current->child[LEFT].get();
+    else if (key > current->key)
+      current = current->child[RIGHT].get();
+    else
+      return &current->value;
+  }
+  return nullptr;
+}
+
+// If one side is two levels taller, its root comes up (a single rotation) unless its inner
+// subtree is the taller one, in which case that subtree's root comes up (a double rotation). Both
+// directions are handled by the same code through the side index.
+template <typename K, typename V>
+typename persistent_avltree<K, V>::node_ptr
+persistent_avltree<K, V>::_balance(const K& key, const V& value, node_ptr left, node_ptr right)
+{
+  const int left_height = _height(left);
+  const int right_height = _height(right);
+  if (left_height <= right_height + 1 && right_height <= left_height + 1)
+    return std::make_shared<const node>(key, value, std::move(left), std::move(right));
+
+  const int side = left_height > right_height ? LEFT : RIGHT;  // the taller side
+  const node_ptr taller = side == LEFT ? std::move(left) : std::move(right);
+  node_ptr shorter = side == LEFT ? std::move(right) : std::move(left);
+  const node_ptr& outer = taller->child[side];
+  const node_ptr& inner = taller->child[!side];
+  if (_height(outer) >= _height(inner))
+  {
+    node_ptr lowered = _make(key, value, side, inner, std::move(shorter));
+    return _make(taller->key, taller->value, side, outer, std::move(lowered));
+  }
+  node_ptr taller_side = _make(taller->key, taller->value, side, outer, inner->child[side]);
+  node_ptr shorter_side = _make(key, value, side, inner->child[!side], std::move(shorter));
+  return _make(inner->key, inner->value, side, std::move(taller_side), std::move(shorter_side));
+}
+
+// Copy the path down to the key, rebalancing each copy on the way back up.
+template <typename K, typename V>
+typename persistent_avltree<K, V>::node_ptr
+persistent_avltree<K, V>::_insert(const node_ptr& subtree_root, const K& key, const V& value)
+{
+  if (!subtree_root)
+    return std::make_shared<const node>(key, value, nullptr, nullptr);
+  const node& n = *subtree_root;
+  if (key < n.key)
+    return _balance(n.key, n.value, _insert(n.child[LEFT], key, value), n.child[RIGHT]);
+  else if (key > n.key)
+    return _balance(n.key, n.value, n.child[LEFT], _insert(n.child[RIGHT], key, value));
+  return std::make_shared<const node>(key, value, n.child[LEFT], n.child[RIGHT]);
+}
+
+// Copy the path down to the key, if it's there. A removed node with two children is replaced by
+// its in-order successor.
+template <typename K, typename V>
+typename persistent_avltree<K, V>::node_ptr
+persistent_avltree<K, V>::_remove(const node_ptr& subtree_root, const K& key)
+{
+  if (!subtree_root)
+    return subtree_root;
+  const node& n = *subtree_root;
+  if (key < n.key || key > n.key)
+  {
+    const int side = key < n.key ? LEFT : RIGHT;
+    node_ptr changed = _remove(n.child[side], key);
+    if (changed == n.child[side])
+      return subtree_root;  // the key isn't here, nothing was copied
+    return side == LEFT ? _balance(n.key, n.value, std::move(changed), n.child[RIGHT])
+                        : _balance(n.key, n.value, n.child[LEFT], std::move(changed));
+  }
+  if (!n.child[LEFT] || !n.child[RIGHT])
+    return n.child[n.child[LEFT] ? LEFT : RIGHT];
+  node_ptr successor;
+  node_ptr right = _remove_smallest(n.child[RIGHT], successor);
+  return _balance(successor->key, successor->value, n.child[LEFT], std::move(right));
+}
+
+// Follow the left edge down, copying it on the way back up without the last node.
+template <typename K, typename V>
+typename persistent_avltree<K, V>::node_ptr
+persistent_avltree<K, V>::_remove_smallest(const node_ptr& subtree_root, node_ptr& smallest)
+{
+  const node& n = *subtree_root;
+  if (!n.child[LEFT])
+  {
+    smallest = subtree_root;
+    return n.child[RIGHT];
+  }
+  return _balance(n.key, n.value, _remove_smallest(n.child[LEFT], smallest), n.child[RIGHT]);
+}
+
+#endif  // PERSISTENT_AVLTREE_H
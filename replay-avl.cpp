@@ -0,0 +1,350 @@
+/*
+replay-avl.cpp
+Copyright (c) Eromid (Olly) 2017
+
+Replays a recorded trace of operations against an `avltree` and reports what it cost, so that a
+regression seen in production can be reproduced offline. Build with optimisations, e.g.
+  g++ -std=c++11 -O2 -DNDEBUG -pthread replay-avl.cpp -o replay-avl
+and run with `./replay-avl [--keys=string|int] [--threads=N] [--check-every=N] TRACE`, where
+TRACE is a file, or `-` for standard input. It holds one operation per line:
+  insert KEY [VALUE]
+  get KEY
+  remove KEY
+  range LO HI
+Keys are strings without whitespace, or 64-bit integers with `--keys=int`; values are numbers,
+and an insert without one stores the line number. Blank lines and lines starting with `#` are
+skipped.
+
+With `--threads=N`, operation i goes to thread i % N, and the threads share one tree behind a
+mutex, so a latency includes the time spent waiting for it. With `--check-every=N`, the tree is
+checked with `test_helper` after every N operations, and the replay stops at the first check
+to fail. The report gives, for each kind of operation:
+  p50/p99/p999   latency percentiles, in nanoseconds
+and then the rotations the tree made, its largest size, and the resident set size as the replay
+started (with the trace loaded) and at its peak (Linux only, else 0). It exits with 1 if the
+trace can't be read, and 2 if a check failed.
+*/
+
+#include "avltree.h"
+#include "avltree-test-helper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using replay_clock = std::chrono::steady_clock;
+
+// Stops the optimiser discarding results we don't otherwise use.
+static volatile double sink;
+
+// Peak resident set size: reset the kernel's high water mark, then read it back.
+static void reset_peak_rss()
+{
+#if defined(__linux__)
+  std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+// A size in /proc/self/status, "VmRSS:" (resident now) or "VmHWM:" (the peak), in MB.
+static double rss_mb(const char* field)
+{
+#if defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 6, field) == 0)
+      return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+#else
+  (void)field;
+#endif
+  return 0.0;
+}
+
+
+
+// ============================================================================================ //
+// |                                          Traces                                          | //
+// ============================================================================================ //
+
+enum operation_kind { op_insert, op_get, op_remove, op_range, operation_kinds };
+
+static const char* const operation_names[operation_kinds] = { "insert", "get", "remove", "range" };
+
+// One line of a trace. `high` is only used by ranges, and `value` by inserts.
+template <typename Key>
+struct trace_operation
+{
+  operation_kind kind;
+  Key key;
+  Key high;
+  double value;
+};
+
+// Read a key from the stream; false if there isn't one, or it isn't a number for integer keys.
+static bool read_key(std::istream& in, std::string& key) { return static_cast<bool>(in >> key); }
+static bool read_key(std::istream& in, std::int64_t& key)
+{
+  std::string text;
+  if (!(in >> text))
+    return false;
+  char* end;
+  key = std::strtoll(text.c_str(), &end, 10);
+  return *end == '\0';
+}
+
+// Read a whole trace, or report the first line which isn't an operation and return false.
+template <typename Key>
+bool read_trace(std::istream& in, std::vector<trace_operation<Key>>& trace)
+{
+  std::string line;
+  for (std::size_t line_number = 1; std::getline(in, line); ++line_number)
+  {
+    std::istringstream fields(line);
+    std::string name;
+    if (!(fields >> name) || name[0] == '#')
+      continue;
+    trace_operation<Key> operation;
+    operation.kind = operation_kinds;
+    for (int kind = 0; kind < operation_kinds; ++kind)
+      if (name == operation_names[kind])
+        operation.kind = static_cast<operation_kind>(kind);
+    operation.value = static_cast<double>(line_number);
+    bool valid = operation.kind != operation_kinds && read_key(fields, operation.key);
+    if (valid && operation.kind == op_range)
+      valid = read_key(fields, operation.high);
+    if (valid && operation.kind == op_insert && !(fields >> operation.value))
+    {
+      operation.value = static_cast<double>(line_number);
+      fields.clear();
+    }
+    std::string rest;
+    if (!valid || fields >> rest)
+    {
+      std::cerr << "line " << line_number << ": not an operation: " << line << std::endl;
+      return false;
+    }
+    trace.push_back(operation);
+  }
+  return true;
+}
+
+
+
+// ============================================================================================ //
+// |                                        Replaying                                         | //
+// ============================================================================================ //
+
+struct replay_options
+{
+  replay_options() : threads(1), check_every(0) {}
+
+  std::size_t threads;
+  std::size_t check_every;  // 0 for no checks.
+};
+
+// The tree under test, shared by the threads, with what they need to keep track of together.
+template <typename Key>
+struct replay_state
+{
+  using tree_type = avltree<Key, double, std::allocator<std::pair<const Key, double>>, no_augmentation,
+                            collect_stats>;
+
+  replay_state() : completed(0), peak_size(0), checks(0), failed(false) {}
+
+  tree_type tree;
+  std::mutex mutex;
+  std::size_t completed;
+  std::size_t peak_size;
+  std::size_t checks;
+  bool failed;
+};
+
+// Check the tree is a valid AVL tree, as the unit tests do.
+template <typename Key>
+bool check_tree(const typename replay_state<Key>::tree_type& tree)
+{
+  using helper = test_helper<Key, double>;
+  return helper::is_avl(tree) && helper::valid_balance_factors(tree) && helper::valid_parent_links(tree)
+    && helper::count_nodes(tree) == tree.size();
+}
+
+// Apply one operation to the tree, which the caller has locked.
+template <typename Key>
+void apply(typename replay_state<Key>::tree_type& tree, const trace_operation<Key>& operation)
+{
+  switch (operation.kind)
+  {
+  case op_insert:
+    tree.insert(operation.key, operation.value);
+    break;
+  case op_get:
+    if (const double* value = tree.find(operation.key))
+      sink = *value;
+    break;
+  case op_remove:
+    tree.remove(operation.key);
+    break;
+  case op_range:
+  {
+    double total = 0.0;
+    for (const auto& element : tree.range(operation.key, operation.high))
+      total += element.second;
+    sink = total;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Run the operations `first`, `first + step`, ... of the trace, writing the nanoseconds each took
+// to `latencies` at its position in the trace. The clock starts before taking the lock, and the
+// checks run after it stops.
+template <typename Key>
+void replay_share(replay_state<Key>& state, const std::vector<trace_operation<Key>>& trace,
+                  std::vector<std::uint64_t>& latencies, std::size_t first, std::size_t step,
+                  std::size_t check_every, const std::atomic<bool>& go)
+{
+  while (!go.load())
+    std::this_thread::yield();
+  for (std::size_t i = first; i < trace.size(); i += step)
+  {
+    const replay_clock::time_point start = replay_clock::now();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.failed)
+      return;
+    apply(state.tree, trace[i]);
+    latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(replay_clock::now() - start).count();
+    state.peak_size = std::max(state.peak_size, state.tree.size());
+    if (check_every != 0 && ++state.completed % check_every == 0)
+    {
+      ++state.checks;
+      if (!check_tree<Key>(state.tree))
+      {
+        std::cerr << "check failed after " << state.completed << " operations (trace operation " << i + 1
+                  << ", " << operation_names[trace[i].kind] << ")" << std::endl;
+        state.failed = true;
+      }
+    }
+  }
+}
+
+// The latency at or below which a fraction `p` of `sorted` lie (nearest rank).
+static std::uint64_t percentile(const std::vector<std::uint64_t>& sorted, double p)
+{
+  std::size_t rank = static_cast<std::size_t>(p * sorted.size() + 0.999999);
+  rank = std::max<std::size_t>(rank, 1);
+  return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+// Replay a trace and print the report. Returns false if a check failed.
+template <typename Key>
+bool replay(const std::vector<trace_operation<Key>>& trace, const replay_options& options)
+{
+  // Every latency is written before the tree is built, so the peak counts the tree and not them.
+  std::vector<std::uint64_t> latencies(trace.size(), 0);
+  replay_state<Key> state;
+  reset_peak_rss();
+  const double rss_start = rss_mb("VmRSS:");
+
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (std::size_t t = 1; t < options.threads; ++t)
+    threads.push_back(std::thread([&, t]() {
+      replay_share(state, trace, latencies, t, options.threads, options.check_every, go);
+    }));
+  go.store(true);
+  const replay_clock::time_point start = replay_clock::now();
+  replay_share(state, trace, latencies, 0, options.threads, options.check_every, go);
+  for (std::thread& thread : threads)
+    thread.join();
+  const double seconds = std::chrono::duration<double>(replay_clock::now() - start).count();
+  const double rss_peak = rss_mb("VmHWM:");
+
+  std::vector<std::uint64_t> by_kind[operation_kinds];
+  for (std::size_t i = 0; i < trace.size(); ++i)
+    by_kind[trace[i].kind].push_back(latencies[i]);
+
+  std::printf("%zu operations on %zu thread(s) in %.3f s\n", trace.size(), options.threads, seconds);
+  std::printf("%-10s %12s %12s %12s %12s %12s\n", "operation", "count", "p50 ns", "p99 ns", "p999 ns", "max ns");
+  for (int kind = 0; kind < operation_kinds; ++kind)
+  {
+    std::vector<std::uint64_t>& sorted = by_kind[kind];
+    if (sorted.empty())
+      continue;
+    std::sort(sorted.begin(), sorted.end());
+    std::printf("%-10s %12zu %12llu %12llu %12llu %12llu\n", operation_names[kind], sorted.size(),
+                static_cast<unsigned long long>(percentile(sorted, 0.5)),
+                static_cast<unsigned long long>(percentile(sorted, 0.99)),
+                static_cast<unsigned long long>(percentile(sorted, 0.999)),
+                static_cast<unsigned long long>(sorted.back()));
+  }
+  const avltree_stats stats = state.tree.stats();
+  std::printf("rotations: %zu single, %zu double\n", stats.single_rotations, stats.double_rotations);
+  std::printf("elements: %zu at the end, %zu at most\n", state.tree.size(), state.peak_size);
+  std::printf("RSS: %.1f MB at the start, %.1f MB at the peak\n", rss_start, rss_peak);
+  if (options.check_every != 0)
+    std::printf("checks: %zu, %s\n", state.checks, state.failed ? "FAILED" : "all passed");
+  return !state.failed;
+}
+
+template <typename Key>
+int run(std::istream& in, const replay_options& options)
+{
+  std::vector<trace_operation<Key>> trace;
+  if (!read_trace(in, trace))
+    return 1;
+  return replay(trace, options) ? 0 : 2;
+}
+
+int main(int argc, char** argv)
+{
+  replay_options options;
+  bool integer_keys = false;
+  const char* path = nullptr;
+  bool usage_error = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--keys=int") == 0)
+      integer_keys = true;
+    else if (std::strcmp(argv[i], "--keys=string") == 0)
+      integer_keys = false;
+    else if (std::strncmp(argv[i], "--threads=", 10) == 0)
+      options.threads = static_cast<std::size_t>(std::strtoull(argv[i] + 10, nullptr, 10));
+    else if (std::strncmp(argv[i], "--check-every=", 14) == 0)
+      options.check_every = static_cast<std::size_t>(std::strtoull(argv[i] + 14, nullptr, 10));
+    else if (!path && (argv[i][0] != '-' || argv[i][1] == '\0'))
+      path = argv[i];
+    else
+      usage_error = true;
+  }
+  if (usage_error || !path || options.threads == 0)
+  {
+    std::cerr << "usage: replay-avl [--keys=string|int] [--threads=N] [--check-every=N] TRACE" << std::endl;
+    return 1;
+  }
+
+  std::ifstream file;
+  if (std::strcmp(path, "-") != 0)
+  {
+    file.open(path);
+    if (!file)
+    {
+      std::cerr << "can't open " << path << std::endl;
+      return 1;
+    }
+  }
+  std::istream& in = file.is_open() ? file : std::cin;
+  return integer_keys ? run<std::int64_t>(in, options) : run<std::string>(in, options);
+}
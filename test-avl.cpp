@@ -8,6 +8,33 @@ Unit tests for AVL tree implementation in avltree.h.
 #include <assert.h>
 #include "avltree.h"
 #include "avltree-test-helper.h"
+#include "node-pool.h"
+#include "concurrent-avltree.h"
+#include "persistent-avltree.h"
+#include "compact-avltree.h"
+#include "frozen-avltree.h"
+#include "avltree-tracing.h"
+#include "parallel-avltree.h"
+#include "mapped-avltree.h"
+#include "checkpoint-avltree.h"
+#include "bounded-avltree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <compare>
+#endif
 
 #include <iostream>
 using std::cout;
@@ -20,6 +47,7 @@ using std::setw;
 using std::setfill;
 
 using tests = test_helper<int, double>;
+using string_tests = test_helper<std::string, int>;
 
 #define TEST_CASE(fn)\
 cout << "================================================================================" << endl;\
@@ -135,6 +163,1768 @@ void test_left_right_rotation()
   assert(tests::valid_balance_factors(tree));
 }
 
+// Test removals from every position keep the tree AVL with correct balance factors
+void test_removals()
+{
+  avltree<int, double> tree;
+  const static int n_insertions = 200;
+  for (int i = 0; i < n_insertions; ++i)
+    tree.insert((i * 37) % n_insertions, static_cast<double>(i));  // scattered insertion order
+  assert(tests::count_nodes(tree) == n_insertions);
+
+  // Remove in another scattered order, so leaves, inner nodes and the root are all removed.
+  for (int i = 0; i < n_insertions; ++i)
+  {
+    const int key = (i * 53) % n_insertions;
+    tree.remove(key);
+    assert(tree.get(key).has_value() == false);               // key should be gone
+    assert(tests::count_nodes(tree) == static_cast<unsigned int>(n_insertions - i - 1));
+    assert(tests::is_avl(tree));
+    assert(tests::valid_balance_factors(tree));
+    assert(tests::valid_parent_links(tree));
+  }
+  for (int i = 0; i < n_insertions; ++i)
+    assert(tree.get(i).has_value() == false);
+}
+
+// Test a tree of string keys stays AVL through mixed insertions and removals
+void test_string_keys()
+{
+  avltree<std::string, int> tree;
+  const static int n_keys = 300;
+  for (int i = 0; i < n_keys; ++i)
+    tree.insert("key/" + std::to_string((i * 131) % n_keys), i);
+  for (int i = 0; i < n_keys; i += 2)
+    tree.remove("key/" + std::to_string((i * 17) % n_keys));
+  assert(string_tests::count_nodes(tree) == n_keys / 2);
+  assert(string_tests::is_avl(tree));
+  assert(string_tests::valid_balance_factors(tree));
+  assert(string_tests::valid_parent_links(tree));
+  for (int i = 0; i < n_keys; ++i)
+    assert((tree.find("key/" + std::to_string((i * 17) % n_keys)) != nullptr) == (i % 2 == 1));
+}
+
+// Test find returns pointers into the tree, and null for missing keys
+void test_find()
+{
+  avltree<int, double> tree;
+  for (int i = 0; i < 10; ++i)
+    tree.insert(i, static_cast<double>(i));
+  assert(tree.find(10) == nullptr);           // missing key
+  double* value = tree.find(5);
+  assert(value && *value == 5.0);
+  *value = 50.0;                              // values can be updated in place
+  assert(tree.get(5).value() == 50.0);
+  const avltree<int, double>& const_tree = tree;
+  assert(const_tree.find(5) == value);        // same storage through a const tree
+
+  // Heterogeneous lookup, the key is never converted to a std::string.
+  avltree<std::string, int> strings;
+  strings.insert("ant", 1);
+  strings.insert("bee", 2);
+  strings.insert("cat", 3);
+  assert(strings.find("bee") && *strings.find("bee") == 2);
+  assert(strings.find("dog") == nullptr);
+#if __cplusplus >= 201703L
+  const std::string_view cat("cat");
+  assert(strings.find(cat) && *strings.find(cat) == 3);
+  assert(strings.find(std::string_view("eel")) == nullptr);
+#endif
+}
+
+// Comparison policies which count their calls
+struct counting_less
+{
+  static std::size_t calls;
+  bool operator()(const std::string& a, const std::string& b) const { ++calls; return a < b; }
+};
+std::size_t counting_less::calls = 0;
+
+struct counting_compare
+{
+  static std::size_t calls;
+  int operator()(const std::string& a, const std::string& b) const { ++calls; return a.compare(b); }
+};
+std::size_t counting_compare::calls = 0;
+
+struct reverse_order
+{
+  int operator()(int a, int b) const { return b - a; }
+};
+
+template <typename Compare>
+using compared_tree = avltree<std::string, int, std::allocator<std::pair<const std::string, int>>, no_augmentation,
+                              collect_stats, Compare>;
+
+// Test a three-way comparison is called once per level of a search, where a predicate can be
+// called twice, and that every operation follows the policy's order
+void test_compare()
+{
+  compared_tree<counting_less> by_less;
+  compared_tree<counting_compare> three_way;
+  for (int i = 0; i < 200; ++i)
+  {
+    by_less.insert(std::to_string(i * 7 % 200), i);
+    three_way.insert(std::to_string(i * 7 % 200), i);
+  }
+  by_less.reset_stats();
+  three_way.reset_stats();
+  counting_less::calls = counting_compare::calls = 0;
+  for (int i = 0; i < 200; ++i)
+  {
+    assert(by_less.get(std::to_string(i)).value() == three_way.get(std::to_string(i)).value());
+    assert(!three_way.get(std::to_string(i) + "x").has_value());
+  }
+  std::size_t levels = 0, less_levels = 0;
+  for (std::size_t length = 0; length < avltree_stats::max_length; ++length)
+  {
+    levels += length * three_way.stats().searches[length];
+    less_levels += length * by_less.stats().searches[length];
+  }
+  assert(counting_compare::calls == levels);
+  assert(counting_less::calls > less_levels);
+
+  avltree<std::string, int, std::allocator<std::pair<const std::string, int>>, no_augmentation, no_tracing,
+          member_compare> members;
+  members.insert("bee", 2);
+  members.insert("ant", 1);
+  members.remove("cat");
+  assert(members.find("ant") && *members.find("ant") == 1 && !members.get("cat").has_value());
+#if __cplusplus >= 201703L
+  assert(members.find(std::string_view("bee")) && members.size() == 2);
+#endif
+#if __cplusplus >= 202002L
+  avltree<std::string, int, std::allocator<std::pair<const std::string, int>>, no_augmentation, no_tracing,
+          std::compare_three_way> spaceship;
+  spaceship.insert(std::string("bee"), 2);
+  spaceship.insert(std::string("ant"), 1);
+  assert(spaceship.find(std::string("ant")) && *spaceship.find(std::string("ant")) == 1 && spaceship.begin()->first == "ant");
+#endif
+
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, no_tracing,
+          reverse_order> reversed;
+  for (int i = 0; i < 50; ++i)
+    reversed.insert(i, i);
+  std::vector<std::pair<int, double>> sorted = { { 9, 0.0 }, { 5, 0.0 }, { 5, 1.0 }, { 1, 0.0 } };
+  reversed.insert_batch(sorted.begin(), sorted.end());
+  std::vector<int> removed = { 40, 30, 20 };
+  reversed.erase_batch(removed.begin(), removed.end());
+  int previous = 50;
+  for (auto element : reversed)
+  {
+    assert(element.first < previous);
+    previous = element.first;
+  }
+  assert(reversed.size() == 47 && reversed.get(5).value() == 1.0 && reversed.lower_bound(45)->first == 45);
+  assert(tests::is_avl(reversed) && tests::valid_parent_links(reversed));
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, no_tracing,
+          reverse_order> top = reversed.split(10);  // the keys from 10 down
+  assert(top.size() == 11 && reversed.size() == 36 && !reversed.get(10).has_value() && top.get(0).has_value());
+}
+
+// Test hinted inserts and finds give the same results as unhinted ones from every hint, and that
+// increasing keys inserted after the previous one cost a single comparison each
+void test_hinted_insert()
+{
+  avltree<int, double> tree;
+  for (int i = 0; i < 40; i += 2)
+    tree.insert(i, i);
+  for (auto hint = tree.begin();; ++hint)
+  {
+    for (int key = -3; key < 43; ++key)
+    {
+      const double* found = tree.find(hint, key);
+      assert(found == tree.find(key));
+    }
+    if (hint == tree.end())
+      break;
+  }
+
+  std::map<int, double> reference;
+  avltree<int, double> hinted;
+  unsigned int state = 12345;
+  for (int i = 0; i < 2000; ++i)
+  {
+    state = state * 1103515245u + 12345u;
+    const int key = static_cast<int>((state >> 8) % 500);
+    auto hint = hinted.lower_bound(static_cast<int>((state >> 20) % 520));  // end() now and then
+    auto inserted = hinted.insert(hint, key, i);
+    assert(inserted->first == key && inserted->second == i);
+    reference[key] = i;
+  }
+  assert(tests::is_avl(hinted) && tests::valid_balance_factors(hinted) && tests::valid_parent_links(hinted));
+  assert(hinted.size() == reference.size());
+  auto expected = reference.begin();
+  for (auto element : hinted)
+  {
+    assert(element.first == expected->first && element.second == expected->second);
+    ++expected;
+  }
+
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, collect_stats> appended;
+  auto last = appended.end();
+  for (int i = 0; i < 1000; ++i)
+    last = appended.insert(last, i, i);
+  assert(appended.stats().searches[0] == 1 && appended.stats().searches[1] == 999);
+  assert(tests::is_avl(appended) && appended.size() == 1000);
+  appended.insert(appended.end(), 1000, 0.0);  // from the last element
+  assert(appended.stats().searches[1] == 1000);
+}
+
+// Test get_many gives the same results as get, in order, for groups of keys of several sizes
+void test_get_many()
+{
+  avltree<int, double> tree;
+  std::vector<optional<double>> results;
+  std::vector<int> keys = { 1, 2, 3 };
+  tree.get_many(keys.begin(), keys.end(), std::back_inserter(results));
+  assert(results.size() == 3 && !results[0].has_value() && !results[2].has_value());
+
+  for (int i = 0; i < 100; i += 2)
+    tree.insert(i, i + 0.5);
+  keys.clear();
+  for (int i = 0; i < 53; ++i)
+    keys.push_back((i * 37) % 110 - 5);  // present, missing, repeated and out of range keys
+  for (std::size_t count = 0; count <= keys.size(); count += 13)
+  {
+    results.clear();
+    tree.get_many(keys.begin(), keys.begin() + count, std::back_inserter(results));
+    assert(results.size() == count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      const optional<double> expected = tree.get(keys[i]);
+      assert(results[i].has_value() == expected.has_value());
+      assert(!expected.has_value() || results[i].value() == expected.value());
+    }
+  }
+}
+
+// A value type which counts how it was made, to check insertions don't copy
+struct counted
+{
+  static int constructions, copies, moves;
+  explicit counted(int id = 0) : id(id) { ++constructions; }
+  counted(const counted& other) : id(other.id) { ++copies; }
+  counted(counted&& other) : id(other.id) { ++moves; }
+  counted& operator=(const counted& other) { id = other.id; ++copies; return *this; }
+  counted& operator=(counted&& other) { id = other.id; ++moves; return *this; }
+  static void reset() { constructions = copies = moves = 0; }
+  int id;
+};
+int counted::constructions = 0;
+int counted::copies = 0;
+int counted::moves = 0;
+using counted_tests = test_helper<int, counted>;
+
+// Test move-aware insert, emplace and try_emplace construct values without copying them
+void test_emplace()
+{
+  avltree<int, counted> tree;
+  counted::reset();
+  for (int i = 0; i < 20; ++i)
+    tree.insert(i, counted(i));               // values are moved into new nodes
+  assert(counted::copies == 0);
+  assert(counted::moves == 20);
+  tree.insert(5, counted(50));                // update moves over the existing value
+  assert(counted::copies == 0 && counted::moves == 21);
+  assert(tree.find(5)->id == 50);
+
+  counted::reset();
+  std::pair<counted*, bool> result = tree.emplace(30, 30);  // built in place inside the node
+  assert(result.second && result.first->id == 30);
+  assert(counted::constructions == 1 && counted::copies == 0 && counted::moves == 0);
+  result = tree.emplace(30, 300);             // replaces the existing value
+  assert(!result.second && result.first->id == 300);
+  assert(counted::copies == 0);
+
+  counted::reset();
+  result = tree.try_emplace(30, 3000);        // key exists: nothing built, nothing changed
+  assert(!result.second && result.first->id == 300);
+  assert(counted::constructions == 0 && counted::copies == 0 && counted::moves == 0);
+  result = tree.try_emplace(31, 31);
+  assert(result.second && tree.find(31)->id == 31);
+  assert(counted::constructions == 1 && counted::copies == 0 && counted::moves == 0);
+
+  // Removing nodes relinks them rather than copying keys or values around.
+  counted::reset();
+  for (int i = 0; i < 20; i += 3)
+    tree.remove(i);
+  assert(counted::copies == 0 && counted::moves == 0);
+  assert(counted_tests::is_avl(tree));
+  assert(counted_tests::valid_balance_factors(tree));
+  assert(counted_tests::valid_parent_links(tree));
+  for (int i = 0; i < 20; ++i)
+    assert((tree.find(i) != nullptr) == (i % 3 != 0));
+
+  // A key of another type is converted before searching, so the search finds the key stored.
+  avltree<int, int> converted;
+  converted.insert(3, 1);
+  converted.insert(3.5, 2);
+  assert(converted.size() == 1 && *converted.find(3) == 2);
+  assert(!converted.try_emplace(3.9, 3).second && converted.size() == 1);
+  converted.insert(converted.end(), 3.2, 4);
+  assert(converted.size() == 1 && *converted.find(3) == 4);
+  avltree<unsigned char, int> wrapped;
+  wrapped.insert(255, 1);
+  wrapped.insert(256, 2);
+  assert(wrapped.size() == 2 && wrapped.begin()->first == 0 && *wrapped.find(0) == 2);
+  assert((test_helper<unsigned char, int>::is_avl(wrapped)));
+}
+
+// A value type without a default constructor
+struct no_default
+{
+  explicit no_default(int id) : id(id) {}
+  int id;
+};
+
+// Test optional constructs a value only when it holds one, destroys it when emptied, and that
+// get_ref refers to the value in the tree
+void test_optional()
+{
+  avltree<int, counted> tree;
+  tree.insert(1, counted(1));
+  counted::reset();
+  const optional<counted> missing = tree.get(2);
+  assert(!missing.has_value() && !missing);
+  assert(counted::constructions == 0 && counted::copies == 0 && counted::moves == 0);
+  optional<counted> found = tree.get(1);
+  assert(found && found->id == 1 && counted::copies == 1 && counted::constructions == 0);
+
+  optional<counted> copy = found;
+  optional<counted> moved = std::move(copy);
+  assert(moved.value().id == 1 && counted::copies == 2 && counted::moves == 1);
+  copy = missing;
+  assert(!copy.has_value());
+  copy = found;
+  assert(copy.has_value() && (*copy).id == 1);
+  copy.emplace(7);
+  assert(copy->id == 7 && counted::constructions == 1);
+  copy.reset();
+  assert(!copy && copy.value_or(counted(3)).id == 3);
+
+  avltree<int, no_default> no_defaults;
+  no_defaults.emplace(1, 10);
+  assert(no_defaults.get(1).value().id == 10 && !no_defaults.get(2).has_value());
+
+  avltree<std::string, std::string> strings;
+  strings.insert("key", std::string(40, 'a'));
+  optional<std::string> value = strings.get("key");
+  value = strings.get("missing");
+  assert(!value.has_value() && strings.get("missing").value_or("none") == "none");
+
+  counted::reset();
+  optional<const counted&> referred = tree.get_ref(1);
+  assert(referred && &referred.value() == tree.find(1) && counted::copies == 0);
+  tree.insert(1, counted(5));
+  assert(referred->id == 5);
+  assert(!tree.get_ref(2).has_value() && tree.get_ref(2).value_or(counted(4)).id == 4);
+  referred = tree.get_ref(2);
+  assert(!referred);
+}
+
+// Test building a tree from sorted input gives a valid AVL tree with all the keys
+void test_assign_sorted()
+{
+  for (int n = 0; n <= 64; ++n)                 // every shape of small tree
+  {
+    std::vector<std::pair<int, double>> sorted;
+    for (int i = 0; i < n; ++i)
+      sorted.push_back(std::make_pair(i * 2, static_cast<double>(i)));
+    avltree<int, double> tree(sorted.begin(), sorted.end());
+    assert(tests::count_nodes(tree) == static_cast<unsigned int>(n));
+    assert(tests::is_avl(tree));
+    assert(tests::valid_balance_factors(tree));
+    assert(tests::valid_parent_links(tree));
+    for (int i = 0; i < n; ++i)
+      assert(tree.get(i * 2).value() == static_cast<double>(i));
+    tree.insert(-1, -1.0);                      // tree is still usable afterwards
+    tree.remove(0);
+    assert(tests::is_avl(tree));
+    assert(tests::valid_balance_factors(tree));
+  }
+
+  // Repeated keys keep the last value, and assigning replaces what was there before.
+  std::vector<std::pair<int, double>> repeated = { {1, 1.0}, {2, 2.0}, {2, 2.5}, {3, 3.0} };
+  avltree<int, double> tree;
+  tree.insert(100, 100.0);
+  tree.assign_sorted(repeated.begin(), repeated.end());
+  assert(tests::count_nodes(tree) == 3);
+  assert(tree.get(2).value() == 2.5);
+  assert(tree.get(100).has_value() == false);
+
+  // Input that isn't sorted after all still ends up with every key.
+  std::vector<std::pair<int, double>> unsorted = { {1, 1.0}, {5, 5.0}, {3, 3.0}, {4, 4.0} };
+  tree.assign_sorted(unsorted.begin(), unsorted.end());
+  assert(tests::count_nodes(tree) == 4);
+  assert(tests::is_avl(tree));
+  assert(tests::valid_balance_factors(tree));
+  assert(tree.get(3).value() == 3.0);
+
+  // A pooled tree gets its nodes from a single block.
+  std::vector<std::pair<int, double>> sorted;
+  for (int i = 0; i < 10000; ++i)
+    sorted.push_back(std::make_pair(i, static_cast<double>(i)));
+  node_pool_allocator<int> alloc;
+  avltree<int, double, node_pool_allocator<int>> pooled(sorted.begin(), sorted.end(), alloc);
+  assert(alloc.pool()->block_count() == 1);
+  assert(tests::count_nodes(pooled) == 10000);
+  assert(tests::valid_balance_factors(pooled));
+}
+
+// Check a tree holds exactly the same keys and values as a reference map, and is valid
+bool matches(const avltree<int, double>& tree, const std::map<int, double>& reference)
+{
+  if (tests::count_nodes(tree) != reference.size())
+    return false;
+  for (const std::pair<const int, double>& element : reference)
+  {
+    const double* value = tree.find(element.first);
+    if (!value || *value != element.second)
+      return false;
+  }
+  return tests::is_avl(tree) && tests::valid_balance_factors(tree) && tests::valid_parent_links(tree);
+}
+
+// Test batched insertion and removal, sorted (big and small batches) and unsorted
+void test_batches()
+{
+  avltree<int, double> tree;
+  std::map<int, double> reference;
+  std::vector<std::pair<int, double>> batch;
+
+  // Big sorted batch into an empty tree, with a repeated key.
+  for (int i = 0; i < 1000; i += 2)
+    batch.push_back(std::make_pair(i, static_cast<double>(i)));
+  batch.insert(batch.begin() + 10, std::make_pair(18, -18.0));
+  for (const std::pair<int, double>& element : batch)
+    reference[element.first] = element.second;
+  tree.insert_batch(batch.begin(), batch.end());
+  assert(matches(tree, reference));
+
+  // Big sorted batch overlapping existing keys.
+  batch.clear();
+  for (int i = 500; i < 1500; ++i)
+    batch.push_back(std::make_pair(i, static_cast<double>(-i)));
+  for (const std::pair<int, double>& element : batch)
+    reference[element.first] = element.second;
+  tree.insert_batch(batch.begin(), batch.end());
+  assert(matches(tree, reference));
+
+  // Small sorted batch spread over the tree and past both ends, with a repeated key.
+  batch.clear();
+  for (int i = -5; i < 2000; i += 97)
+    batch.push_back(std::make_pair(i, 0.5 * i));
+  batch.push_back(std::make_pair(batch.back().first, 1.0));
+  for (const std::pair<int, double>& element : batch)
+    reference[element.first] = element.second;
+  tree.insert_batch(batch.begin(), batch.end());
+  assert(matches(tree, reference));
+
+  // Unsorted batch.
+  batch.clear();
+  for (int i = 0; i < 50; ++i)
+    batch.push_back(std::make_pair((i * 37) % 3000, 2.0 * i));
+  for (const std::pair<int, double>& element : batch)
+    reference[element.first] = element.second;
+  tree.insert_batch(batch.begin(), batch.end());
+  assert(matches(tree, reference));
+
+  // Big sorted erase, including keys which aren't in the tree.
+  std::vector<int> keys;
+  for (int i = -10; i < 1200; i += 1)
+    keys.push_back(i);
+  for (int key : keys)
+    reference.erase(key);
+  tree.erase_batch(keys.begin(), keys.end());
+  assert(matches(tree, reference));
+
+  // Small and unsorted erase.
+  keys.clear();
+  for (int i = 0; i < 20; ++i)
+    keys.push_back(1200 + (i * 7) % 400);
+  for (int key : keys)
+    reference.erase(key);
+  tree.erase_batch(keys.begin(), keys.end());
+  assert(matches(tree, reference));
+
+  // Runs of consecutive keys in one part of the tree, which make the subtrees being joined back
+  // together differ a lot in height.
+  for (int round = 0; round < 40; ++round)
+  {
+    const int start = (round * 7919) % 5000;
+    const int length = 1 + (round * 131) % 700;
+    batch.clear();
+    for (int i = start; i < start + length; ++i)
+      batch.push_back(std::make_pair(i, static_cast<double>(round)));
+    for (const std::pair<int, double>& element : batch)
+      reference[element.first] = element.second;
+    tree.insert_batch(batch.begin(), batch.end());
+    assert(matches(tree, reference));
+
+    keys.clear();
+    for (int i = start + length / 3; i < start + length / 3 + (round * 53) % 900; ++i)
+      keys.push_back(i);
+    for (int key : keys)
+      reference.erase(key);
+    tree.erase_batch(keys.begin(), keys.end());
+    assert(matches(tree, reference));
+  }
+}
+
+// Test relaxed balance: updates rotate less than in a strict tree, the balance factors stay exact
+// and within the slack, and the tree is back to AVL after `rebalance`, or before a split, join or
+// sorted batch
+void test_relaxed_balance()
+{
+  using relaxed_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics,
+                               collect_stats>;
+  relaxed_tree tree;
+  tree.set_balance_slack(2);
+  assert(tree.balance_slack() == 2);
+  for (int i = 0; i < 1000; ++i)
+    tree.insert(i, static_cast<double>(i));
+  assert(tree.size() == 1000);
+  assert(tests::valid_balance_factors(tree) && tests::valid_parent_links(tree) && tests::valid_subtree_sizes(tree));
+  assert(tests::max_imbalance(tree) > 1 && tests::max_imbalance(tree) <= 3);
+
+  // Random updates, against a map and a strict tree
+  std::map<int, double> reference(tree.begin(), tree.end());
+  relaxed_tree strict(tree.begin(), tree.end());
+  tree.reset_stats();
+  const auto same_elements = [&reference](const relaxed_tree& relaxed) {
+    relaxed_tree::const_iterator element = relaxed.begin();
+    for (const std::pair<const int, double>& expected : reference)
+      if (element == relaxed.end() || element->first != expected.first || (element++)->second != expected.second)
+        return false;
+    return element == relaxed.end();
+  };
+  unsigned int random = 1;
+  for (int i = 0; i < 20000; ++i)
+  {
+    random = random * 1103515245u + 12345u;
+    const int key = static_cast<int>((random >> 8) % 2000);
+    if (random & (1u << 20))
+    {
+      tree.insert(key, static_cast<double>(i));
+      strict.insert(key, static_cast<double>(i));
+      reference[key] = static_cast<double>(i);
+    }
+    else
+    {
+      tree.remove(key);
+      strict.remove(key);
+      reference.erase(key);
+    }
+  }
+  assert(tree.stats().single_rotations + tree.stats().double_rotations
+         < (strict.stats().single_rotations + strict.stats().double_rotations) / 2);
+  assert(same_elements(tree));
+  assert(tests::valid_balance_factors(tree) && tests::valid_parent_links(tree) && tests::valid_subtree_sizes(tree));
+  assert(tests::max_imbalance(tree) <= 3);
+  assert(tree.rank(1000) == static_cast<std::size_t>(std::distance(reference.begin(), reference.lower_bound(1000))));
+
+  tree.rebalance();
+  assert(tests::is_avl(tree) && tests::valid_balance_factors(tree) && tests::valid_subtree_sizes(tree));
+  assert(same_elements(tree));
+
+  // Splits, joins and sorted batches rebalance first
+  for (int i = 2000; i < 3000; ++i)
+    tree.insert(i, 0.0);
+  relaxed_tree upper = tree.split(1500);
+  assert(tests::is_avl(tree) && tests::is_avl(upper) && tests::valid_subtree_sizes(upper));
+  assert(upper.balance_slack() == 2);
+  for (int i = 3000; i < 4000; ++i)
+    upper.insert(i, 0.0);
+  tree.join(std::move(upper));
+  assert(tests::is_avl(tree) && tests::valid_balance_factors(tree) && tree.size() == reference.size() + 2000);
+  const std::vector<std::pair<int, double>> batch = { { 5000, 1.0 }, { 5001, 1.0 } };
+  for (int i = 4000; i < 5000; ++i)
+    tree.insert(i, 0.0);
+  tree.insert_batch(batch.begin(), batch.end());
+  assert(tests::is_avl(tree) && tests::valid_subtree_sizes(tree));
+
+  // Back to strict balance
+  for (int i = 6000; i < 7000; ++i)
+    tree.insert(i, 0.0);
+  tree.set_balance_slack(0);
+  assert(tests::is_avl(tree) && tests::valid_balance_factors(tree));
+  const std::size_t rotations = tree.stats().single_rotations;
+  for (int i = 7000; i < 7100; ++i)
+    tree.insert(i, 0.0);
+  assert(tree.stats().single_rotations > rotations && tests::is_avl(tree));
+  tree.set_balance_slack(1000);
+  assert(tree.balance_slack() == relaxed_tree::max_balance_slack);
+}
+
+// Test iterating in both directions and the ordered queries, against a std::map
+void test_iterators()
+{
+  avltree<int, double> tree;
+  std::map<int, double> reference;
+  assert(tree.begin() == tree.end());
+  for (int i = 0; i < 200; ++i)
+  {
+    const int key = 2 * ((i * 61) % 200);  // the even keys in [0, 400), in a scattered order
+    tree.insert(key, 0.5 * key);
+    reference[key] = 0.5 * key;
+  }
+
+  // Forwards, then backwards from the end.
+  std::map<int, double>::const_iterator expected = reference.begin();
+  for (avltree<int, double>::iterator it = tree.begin(); it != tree.end(); ++it, ++expected)
+  {
+    assert(it->first == expected->first);
+    assert((*it).second == expected->second);
+  }
+  assert(expected == reference.end());
+  std::map<int, double>::const_reverse_iterator reversed = reference.rbegin();
+  for (avltree<int, double>::iterator it = tree.end(); it != tree.begin(); ++reversed)
+  {
+    --it;
+    assert(it.key() == reversed->first);
+  }
+  assert(reversed == reference.rend());
+
+  // Values can be updated through an iterator; a const tree hands out const_iterators.
+  for (std::pair<const int&, double&> element : tree)
+    element.second += 1.0;
+  const avltree<int, double>& const_tree = tree;
+  avltree<int, double>::const_iterator first = const_tree.begin();
+  assert(first == tree.begin());
+  assert(first.value() == 1.0);
+
+  // Bounds for keys in the tree, between keys, and past both ends.
+  const int probes[] = { -5, 0, 1, 2, 199, 200, 397, 398, 399, 1000 };
+  for (int probe : probes)
+  {
+    std::map<int, double>::const_iterator lower = reference.lower_bound(probe);
+    std::map<int, double>::const_iterator upper = reference.upper_bound(probe);
+    assert(lower == reference.end() ? tree.lower_bound(probe) == tree.end()
+                                    : tree.lower_bound(probe).key() == lower->first);
+    assert(upper == reference.end() ? const_tree.upper_bound(probe) == const_tree.end()
+                                    : const_tree.upper_bound(probe).key() == upper->first);
+    std::pair<avltree<int, double>::iterator, avltree<int, double>::iterator> equal = tree.equal_range(probe);
+    assert((equal.first != equal.second) == (reference.count(probe) == 1));
+  }
+
+  // Ranges are half open, and empty unless lo < hi.
+  int count = 0;
+  int previous = 99;
+  for (std::pair<const int&, double&> element : tree.range(100, 201))
+  {
+    assert(element.first > previous && element.first < 201);
+    previous = element.first;
+    ++count;
+  }
+  assert(count == 51 && previous == 200);
+  assert(tree.range(201, 100).empty());
+  assert(const_tree.range(-10, 0).empty());
+  assert(!const_tree.range(-10, 1).empty());
+
+  // Iterators stay valid across other insertions and removals.
+  avltree<int, double>::iterator kept = tree.lower_bound(250);
+  for (int i = 0; i < 400; i += 4)
+    if (i != 250)
+      tree.remove(i);
+  for (int i = 1; i < 400; i += 2)
+    tree.insert(i, 0.0);
+  assert(kept.key() == 250);
+  assert((++kept).key() == 251);
+
+  // `erase` removes the element at an iterator and steps past it.
+  kept = tree.erase(kept);
+  assert(kept.key() == 253 && !tree.find(251));
+  assert(tests::is_avl(tree) && tests::valid_parent_links(tree));
+  while (kept != tree.end())
+    kept = tree.erase(kept);
+  assert(std::prev(tree.end()).key() == 250 && tests::is_avl(tree) && tests::valid_parent_links(tree));
+}
+
+// Test the order_statistics augmentation keeps subtree sizes right through every kind of update,
+// and rank and select agree with the position of keys in a std::map
+void test_order_statistics()
+{
+  using ranked_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics>;
+  ranked_tree tree;
+  std::map<int, double> reference;
+  assert(tree.size() == 0 && tree.empty() && tree.select(0) == tree.end());
+
+  auto check = [&]() {
+    assert(tree.size() == reference.size());
+    assert(tests::valid_subtree_sizes(tree));
+    assert(tests::is_avl(tree) && tests::valid_balance_factors(tree));
+    std::size_t index = 0;
+    for (const std::pair<const int, double>& element : reference)
+    {
+      assert(tree.rank(element.first) == index);
+      assert(tree.rank(element.first + 1) == index + 1);  // keys are never adjacent
+      assert(tree.select(index).key() == element.first);
+      ++index;
+    }
+    assert(tree.select(index) == tree.end());
+  };
+
+  for (int i = 0; i < 300; ++i)
+  {
+    const int key = 3 * ((i * 89) % 300);
+    tree.insert(key, 1.0);
+    reference[key] = 1.0;
+  }
+  check();
+  for (int i = 0; i < 300; i += 3)
+  {
+    tree.remove(3 * ((i * 17) % 300));
+    reference.erase(3 * ((i * 17) % 300));
+  }
+  check();
+
+  std::vector<std::pair<int, double>> batch;
+  for (int i = 400; i < 1200; i += 3)
+    batch.push_back(std::make_pair(i, 2.0));  // new keys in one part of the tree
+  tree.insert_batch(batch.begin(), batch.end());
+  reference.insert(batch.begin(), batch.end());
+  check();
+  std::vector<int> keys;
+  for (int i = 0; i < 1000; i += 6)
+    keys.push_back(i);
+  tree.erase_batch(keys.begin(), keys.end());
+  for (int key : keys)
+    reference.erase(key);
+  check();
+
+  tree.assign_sorted(batch.begin(), batch.end());
+  reference.clear();
+  reference.insert(batch.begin(), batch.end());
+  check();
+}
+
+// A `subtree_aggregate` operation which lists the keys in order, to check elements are combined
+// in key order.
+struct key_list
+{
+  using value_type = std::string;
+  static std::string identity() { return std::string(); }
+  static std::string lift(int key, double) { return std::to_string(key) + ","; }
+  static std::string combine(const std::string& a, const std::string& b) { return a + b; }
+};
+
+// Check range_aggregate against combining the elements of a std::map one at a time
+template <typename Tree>
+bool aggregates_match(const Tree& tree, const std::map<int, double>& reference)
+{
+  using op = typename Tree::augment_type::op_type;
+  for (int lo = -3; lo < 130; lo += 7)
+  {
+    for (int hi = lo - 2; hi < 140; hi += 5)
+    {
+      typename op::value_type expected = op::identity();
+      for (std::map<int, double>::const_iterator it = reference.lower_bound(lo);
+           it != reference.end() && it->first < hi; ++it)
+        expected = op::combine(expected, op::lift(it->first, it->second));
+      if (tree.range_aggregate(lo, hi) != expected)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Test range aggregates over values and keys stay right through each kind of update
+template <typename Op>
+void test_aggregate_op()
+{
+  avltree<int, double, std::allocator<std::pair<const int, double>>, subtree_aggregate<Op>> tree;
+  std::map<int, double> reference;
+  assert(aggregates_match(tree, reference));
+  for (int i = 0; i < 120; ++i)
+  {
+    const int key = (i * 43) % 120;
+    tree.insert(key, 0.5 * i);
+    reference[key] = 0.5 * i;
+  }
+  assert(aggregates_match(tree, reference));
+  for (int i = 0; i < 120; i += 4)
+  {
+    tree.remove((i * 7) % 120);
+    reference.erase((i * 7) % 120);
+  }
+  assert(aggregates_match(tree, reference));
+  tree.insert(5, 100.0);     // overwriting values updates the aggregates
+  tree.emplace(9, -100.0);
+  reference[5] = 100.0;
+  reference[9] = -100.0;
+  assert(aggregates_match(tree, reference));
+
+  std::vector<std::pair<int, double>> batch;
+  for (int i = 30; i < 90; i += 2)
+    batch.push_back(std::make_pair(i, static_cast<double>(i)));
+  tree.insert_batch(batch.begin(), batch.end());
+  for (const std::pair<int, double>& element : batch)
+    reference[element.first] = element.second;
+  assert(aggregates_match(tree, reference));
+  std::vector<int> keys;
+  for (int i = 50; i < 110; i += 3)
+    keys.push_back(i);
+  tree.erase_batch(keys.begin(), keys.end());
+  for (int key : keys)
+    reference.erase(key);
+  assert(aggregates_match(tree, reference));
+}
+
+void test_range_aggregate()
+{
+  test_aggregate_op<value_sum<double>>();
+  test_aggregate_op<value_max<double>>();
+  test_aggregate_op<key_list>();
+}
+
+// Test readers running alongside a writer only ever see whole updates
+void test_concurrent()
+{
+  concurrent_avltree<int, double> tree;
+  std::atomic<bool> done(false);
+  std::atomic<bool> consistent(true);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; ++r)
+  {
+    readers.push_back(std::thread([&tree, &done, &consistent, r]() {
+      while (!done)
+      {
+        for (int key = r; key < 2000; key += 97)
+        {
+          const optional<double> value = tree.get(key);
+          if (value.has_value() && value.value() != 2.0 * key)
+            consistent = false;
+        }
+        // Keys are written in pairs, so a consistent view always has an even number of them.
+        const bool even = tree.read([](const avltree<int, double>& t) {
+          std::size_t count = 0;
+          for (avltree<int, double>::const_iterator it = t.begin(); it != t.end(); ++it)
+            ++count;
+          return count == t.size() && count % 2 == 0;
+        });
+        if (!even)
+          consistent = false;
+      }
+    }));
+  }
+  for (int key = 0; key < 2000; key += 2)
+  {
+    tree.write([key](avltree<int, double>& t) {
+      t.insert(key, 2.0 * key);
+      t.insert(key + 1, 2.0 * (key + 1));
+    });
+    if (key % 6 == 0 && key >= 100)
+      tree.write([key](avltree<int, double>& t) {  // remove an earlier pair (or none, if it's gone)
+        t.remove(key - 100);
+        t.remove(key - 99);
+      });
+  }
+  done = true;
+  for (std::thread& reader : readers)
+    reader.join();
+  assert(consistent);
+  assert(tree.read([](const avltree<int, double>& t) {
+    return tests::is_avl(t) && tests::valid_balance_factors(t) && tests::valid_parent_links(t);
+  }));
+}
+
+// Test versions of a persistent tree keep their contents as it changes, and the nodes of dropped
+// versions are freed
+void test_persistent()
+{
+  using shared_tests = test_helper<int, std::shared_ptr<int>>;
+  persistent_avltree<int, std::shared_ptr<int>> tree;
+  std::vector<persistent_avltree<int, std::shared_ptr<int>>::version> versions;
+  std::vector<std::weak_ptr<int>> values;
+  for (int i = 0; i < 100; ++i)
+  {
+    versions.push_back(tree.snapshot());
+    std::shared_ptr<int> value = std::make_shared<int>(i);
+    values.push_back(value);
+    tree.insert((i * 37) % 100, value);
+  }
+  for (int i = 0; i < 100; i += 2)
+    tree.remove((i * 37) % 100);
+  tree.remove(1000);  // not there
+  assert(tree.size() == 50 && shared_tests::valid_version(tree.snapshot()));
+  assert(tree.get(1).has_value() && !tree.get(0).has_value());
+
+  // Version i holds the first i insertions, whatever happened later.
+  for (int i = 0; i < 100; ++i)
+  {
+    assert(versions[i].size() == static_cast<std::size_t>(i));
+    assert(shared_tests::valid_version(versions[i]));
+    for (int j = 0; j < 100; ++j)
+    {
+      const std::shared_ptr<int>* value = versions[i].find((j * 37) % 100);
+      assert((value != nullptr) == (j < i));
+      assert(!value || **value == j);
+    }
+    int previous = -1;
+    std::size_t count = 0;
+    for (persistent_avltree<int, std::shared_ptr<int>>::version::const_iterator it = versions[i].begin();
+         it != versions[i].end(); ++it, ++count)
+    {
+      assert(it->first > previous);
+      previous = it.key();
+    }
+    assert(count == versions[i].size());
+  }
+
+  // The values removed from the tree are freed once the versions holding them are dropped.
+  versions.clear();
+  for (int i = 0; i < 100; ++i)
+    assert(values[i].expired() == (i % 2 == 0));
+}
+
+// The keys of a tree, in order, checking it's a valid AVL tree with the right size on the way
+template <typename Tree>
+std::vector<int> checked_keys(const Tree& tree)
+{
+  assert(tests::is_avl(tree) && tests::valid_balance_factors(tree) && tests::valid_parent_links(tree));
+  assert(tests::count_nodes(tree) == tree.size());
+  std::vector<int> keys;
+  for (auto element : tree)
+    keys.push_back(element.first);
+  return keys;
+}
+
+// A tree of the keys first, first + step, ... below last, each with the value key + offset
+template <typename Tree>
+Tree stepped_tree(int first, int last, int step, double offset = 0.0)
+{
+  Tree tree;
+  for (int key = first; key < last; key += step)
+    tree.insert(key, key + offset);
+  return tree;
+}
+
+// Test joining trees of many relative heights, and splitting trees at keys which are in them,
+// between them and outside them
+void test_join_split()
+{
+  for (int left_size = 0; left_size < 40; left_size += 3)
+    for (int right_size = 0; right_size < 300; right_size += 23)
+    {
+      avltree<int, double> left = stepped_tree<avltree<int, double>>(0, left_size, 1);
+      avltree<int, double> right = stepped_tree<avltree<int, double>>(1000, 1000 + right_size, 1);
+      if (right_size % 2)
+        left.join(500, 0.5, std::move(right));
+      else
+        left.join(std::move(right));
+      assert(right.empty() && right.size() == 0);
+      const std::vector<int> keys = checked_keys(left);
+      assert(keys.size() == static_cast<std::size_t>(left_size + right_size + right_size % 2));
+      assert(std::is_sorted(keys.begin(), keys.end()));
+      assert(left.get(500).has_value() == (right_size % 2 == 1));
+    }
+
+  for (int split_key = -1; split_key <= 201; split_key += 3)
+  {
+    using ranked_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics>;
+    ranked_tree tree = stepped_tree<ranked_tree>(0, 200, 2);
+    ranked_tree upper = tree.split(split_key);
+    assert(tests::valid_subtree_sizes(tree) && tests::valid_subtree_sizes(upper));
+    const std::vector<int> lower_keys = checked_keys(tree);
+    const std::vector<int> upper_keys = checked_keys(upper);
+    assert(lower_keys.size() + upper_keys.size() == 100);
+    assert(lower_keys.empty() || lower_keys.back() < split_key);
+    assert(upper_keys.empty() || upper_keys.front() >= split_key);
+
+    avltree<int, double> plain = stepped_tree<avltree<int, double>>(0, 200, 2);
+    avltree<int, double> plain_upper = plain.split(split_key);
+    assert(checked_keys(plain) == lower_keys && checked_keys(plain_upper) == upper_keys);
+    // The plain trees count their elements again when asked, whatever has happened since.
+    avltree<int, double> changed = stepped_tree<avltree<int, double>>(0, 200, 2);
+    avltree<int, double> changed_upper = changed.split(split_key);
+    changed.insert(1001, 1.0);
+    changed_upper.remove(split_key + 1);  // there, or just above
+    changed_upper.remove(split_key + 2);
+    const std::size_t upper_size = upper_keys.size() - (split_key >= -1 && split_key < 198 ? 1 : 0);
+    assert(changed.size() == lower_keys.size() + 1);
+    assert(changed_upper.size() == upper_size);
+    avltree<int, double> rest = changed_upper.split(split_key + 50);
+    changed_upper.join(std::move(rest));
+    avltree<int, double> copied(changed_upper);
+    assert(copied.size() == upper_size && checked_keys(changed_upper).size() == upper_size);
+    changed.clear();
+    assert(changed.size() == 0);
+    tree.join(std::move(upper));  // and back together
+    assert(checked_keys(tree).size() == 100 && tests::valid_subtree_sizes(tree));
+  }
+}
+
+// Test the set operations against std::set_union and friends, over overlapping key ranges with
+// different densities, and with trees whose nodes come from different pools
+void test_set_operations()
+{
+  for (int step = 1; step < 12; step += 2)
+    for (int shift = -60; shift <= 60; shift += 30)
+    {
+      const std::vector<int> a_keys = checked_keys(stepped_tree<avltree<int, double>>(0, 120, 2));
+      const std::vector<int> b_keys = checked_keys(stepped_tree<avltree<int, double>>(shift, shift + 120, step));
+      std::vector<int> expected;
+
+      avltree<int, double> united = stepped_tree<avltree<int, double>>(0, 120, 2);
+      united.set_union(stepped_tree<avltree<int, double>>(shift, shift + 120, step, 0.5));
+      std::set_union(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+      assert(checked_keys(united) == expected && united.size() == expected.size());
+      for (int key : expected)  // ties keep this tree's value
+        assert(united.get(key).value() == (key % 2 == 0 && key >= 0 && key < 120 ? key : key + 0.5));
+
+      expected.clear();
+      avltree<int, double> common = stepped_tree<avltree<int, double>>(0, 120, 2);
+      common.set_intersection(stepped_tree<avltree<int, double>>(shift, shift + 120, step, 0.5));
+      std::set_intersection(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+      assert(checked_keys(common) == expected && common.size() == expected.size());
+
+      expected.clear();
+      avltree<int, double> rest = stepped_tree<avltree<int, double>>(0, 120, 2);
+      rest.set_difference(stepped_tree<avltree<int, double>>(shift, shift + 120, step, 0.5));
+      std::set_difference(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+      assert(checked_keys(rest) == expected && rest.size() == expected.size());
+    }
+
+  // Joins can leave the root pointing into a subtree which is then destroyed, which mustn't reset
+  // the count.
+  avltree<int, double> small;
+  avltree<int, double> other;
+  for (int key : { 17, 19, 4, 14 })
+    small.insert(key, key);
+  for (int key : { 3, 16, 19, 12 })
+    other.insert(key, key);
+  small.set_intersection(std::move(other));
+  assert(small.size() == 1 && checked_keys(small).size() == 1 && small.get(19).has_value());
+
+  unsigned int state = 54321;
+  for (int round = 0; round < 200; ++round)
+  {
+    std::set<int> a_set, b_set;
+    avltree<int, double> a, b;
+    for (int i = 0; i < 40; ++i)
+    {
+      state = state * 1103515245u + 12345u;
+      const int a_key = static_cast<int>((state >> 8) % 50);
+      state = state * 1103515245u + 12345u;
+      const int b_key = static_cast<int>((state >> 8) % 50);
+      a.insert(a_key, a_key);
+      b.insert(b_key, b_key);
+      a_set.insert(a_key);
+      b_set.insert(b_key);
+    }
+    std::vector<int> expected;
+    avltree<int, double> a_copy(a);
+    if (round % 2 == 0)
+    {
+      a.set_intersection(std::move(b));
+      std::set_intersection(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    }
+    else
+    {
+      a.set_difference(std::move(b));
+      std::set_difference(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    }
+    assert(a.size() == expected.size() && checked_keys(a) == expected);
+    a_copy.set_union(std::move(a));
+    assert(a_copy.size() == a_set.size() && checked_keys(a_copy).size() == a_set.size());
+  }
+
+  using pooled_tree = avltree<int, double, node_pool_allocator<int>>;
+  pooled_tree pooled = stepped_tree<pooled_tree>(0, 50, 1);
+  pooled.set_union(stepped_tree<pooled_tree>(25, 100, 1));  // separate pools, so copied
+  assert(checked_keys(pooled).size() == 100 && pooled.size() == 100);
+  pooled.set_difference(stepped_tree<pooled_tree>(0, 100, 2));
+  assert(checked_keys(pooled).size() == 50 && pooled.size() == 50 && !pooled.get(2).has_value() && pooled.get(3).has_value());
+}
+
+// Test the parallel build and set operations against their single-threaded versions, on trees big
+// enough to be split between threads
+void test_parallel()
+{
+  using ranked_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics>;
+  std::vector<std::pair<int, double>> unsorted;
+  unsigned int state = 12345;
+  for (int i = 0; i < 100000; ++i)
+  {
+    state = state * 1103515245u + 12345u;
+    unsorted.push_back(std::make_pair(static_cast<int>((state >> 8) % 60000), static_cast<double>(i)));
+  }
+  std::map<int, double> reference;
+  for (auto element : unsorted)
+    reference[element.first] = element.second;  // repeated keys keep their last value
+
+  for (unsigned threads = 1; threads <= 5; threads += 2)
+  {
+    ranked_tree built;
+    built.insert(-1, 0.0);  // replaced
+    parallel_assign(built, unsorted.begin(), unsorted.end(), threads);
+    assert(tests::valid_subtree_sizes(built) && checked_keys(built).size() == reference.size());
+    assert(built.size() == reference.size());
+    auto expected = reference.begin();
+    for (auto element : built)
+    {
+      assert(element.first == expected->first && element.second == expected->second);
+      ++expected;
+    }
+  }
+  avltree<int, double> empty;
+  parallel_assign(empty, unsorted.end(), unsorted.end(), 4);
+  assert(empty.empty());
+
+  const std::vector<int> a_keys = checked_keys(stepped_tree<avltree<int, double>>(0, 200000, 2));
+  const std::vector<int> b_keys = checked_keys(stepped_tree<avltree<int, double>>(50000, 250000, 3));
+  std::vector<int> expected;
+  avltree<int, double> united = stepped_tree<avltree<int, double>>(0, 200000, 2);
+  parallel_set_union(united, stepped_tree<avltree<int, double>>(50000, 250000, 3, 0.5), 4);
+  std::set_union(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+  assert(checked_keys(united) == expected && united.size() == expected.size());
+  assert(united.get(60000).value() == 60000);
+
+  expected.clear();
+  avltree<int, double> common = stepped_tree<avltree<int, double>>(0, 200000, 2);
+  parallel_set_intersection(common, stepped_tree<avltree<int, double>>(50000, 250000, 3, 0.5), 3);
+  std::set_intersection(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+  assert(checked_keys(common) == expected && common.size() == expected.size());
+
+  expected.clear();
+  avltree<int, double> rest = stepped_tree<avltree<int, double>>(0, 200000, 2);
+  parallel_set_difference(rest, stepped_tree<avltree<int, double>>(50000, 250000, 3, 0.5), 4);
+  std::set_difference(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+  assert(checked_keys(rest) == expected && rest.size() == expected.size());
+
+  // Random trees, so the workers are handed subtrees of every shape.
+  for (int round = 0; round < 8; ++round)
+  {
+    std::set<int> a_set, b_set;
+    avltree<int, double> a, b;
+    for (int i = 0; i < 40000; ++i)
+    {
+      state = state * 1103515245u + 12345u;
+      const int a_key = static_cast<int>((state >> 8) % 60000);
+      state = state * 1103515245u + 12345u;
+      const int b_key = static_cast<int>((state >> 8) % 60000);
+      a.insert(a_key, a_key);
+      b.insert(b_key, b_key);
+      a_set.insert(a_key);
+      b_set.insert(b_key);
+    }
+    expected.clear();
+    if (round % 2 == 0)
+    {
+      parallel_set_intersection(a, std::move(b), 4);
+      std::set_intersection(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    }
+    else
+    {
+      parallel_set_difference(a, std::move(b), 4);
+      std::set_difference(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    }
+    assert(a.size() == expected.size() && checked_keys(a) == expected);
+    a.clear();
+    assert(a.empty());
+  }
+
+  // A pool can't be shared between threads, so this runs on one.
+  using pooled_tree = avltree<int, double, node_pool_allocator<int>>;
+  pooled_tree pooled;
+  parallel_assign(pooled, unsorted.begin(), unsorted.end(), 4);
+  assert(checked_keys(pooled).size() == reference.size() && pooled.size() == reference.size());
+}
+
+// Test a compact tree against std::map through random inserts, overwrites and removals, which move
+// nodes between slots
+void test_compact()
+{
+  compact_avltree<int, std::string> tree;
+  std::map<int, std::string> reference;
+  assert(tree.empty() && !tree.get(1).has_value() && tests::valid_compact(tree));
+  tree.remove(1);  // not there
+
+  unsigned int state = 12345;
+  for (int i = 0; i < 4000; ++i)
+  {
+    state = state * 1103515245u + 12345u;
+    const int key = static_cast<int>((state >> 8) % 500);
+    if ((state >> 20) % 3 == 0)
+    {
+      tree.remove(key);
+      reference.erase(key);
+    }
+    else
+    {
+      tree.insert(key, std::to_string(i));
+      reference[key] = std::to_string(i);
+    }
+    if (i % 100 == 0)
+      assert(tests::valid_compact(tree));
+  }
+  assert(tests::valid_compact(tree) && tree.size() == reference.size());
+  for (int key = 0; key < 500; ++key)
+  {
+    const std::string* value = tree.find(key);
+    assert((value != nullptr) == (reference.count(key) == 1));
+    assert(!value || *value == reference[key]);
+  }
+
+  // Ascending and descending runs exercise every rotation.
+  compact_avltree<int, int> runs;
+  runs.reserve(2000);
+  for (int i = 0; i < 1000; ++i)
+    runs.insert(i, i);
+  for (int i = 2000; i > 1000; --i)
+    runs.insert(i, i);
+  assert(tests::valid_compact(runs) && runs.size() == 2000);
+  for (int i = 0; i <= 2000; i += 2)
+    runs.remove(i);
+  assert(tests::valid_compact(runs) && runs.size() == 1000);
+  for (int i = 0; i <= 2000; ++i)
+    assert(runs.get(i).has_value() == (i % 2 == 1));
+
+  // String keys are stored apart, sharing prefixes. Keys which are prefixes of each other, or
+  // differ only after the bytes held in the nodes, need the stored keys to tell them apart.
+  compact_avltree<std::string, int> urls;
+  std::map<std::string, int> url_reference;
+  const std::string site = "https://www.example.com/";
+  for (int i = 0; i < 6000; ++i)
+  {
+    state = state * 1103515245u + 12345u;
+    const unsigned int pick = (state >> 8) % 400;
+    std::string key = site + std::to_string(pick % 7) + "/items/" + std::to_string(pick);
+    if (pick % 5 == 0)
+      key.resize(site.size() + pick % 13);
+    if (pick % 11 == 0)
+      key += std::string(1, '\0') + "\xff";
+    if ((state >> 20) % 3 == 0)
+    {
+      urls.remove(key);
+      url_reference.erase(key);
+    }
+    else
+    {
+      urls.insert(key, i);
+      url_reference[key] = i;
+    }
+    if (i % 200 == 0)
+      assert(string_tests::valid_compact(urls));
+  }
+  assert(string_tests::valid_compact(urls) && urls.size() == url_reference.size());
+  for (const std::pair<const std::string, int>& element : url_reference)
+  {
+    const int* value = urls.find(element.first);
+    assert(value && *value == element.second);
+  }
+  assert(!urls.find(site + "1/items/1x") && !urls.find(site + "1/items/10000") && !urls.find(""));
+  assert(urls.find("https://www.example.com/") && !urls.find("https://www.example.com"));
+  urls.insert("", 1);
+  assert(urls.get("").value() == 1 && string_tests::valid_compact(urls));
+#if __cplusplus >= 201703L
+  assert(urls.find(std::string_view(site).substr(0, site.size() - 1)) == nullptr);
+#endif
+
+  // Removed keys are reclaimed once they take up half the space.
+  compact_avltree<std::string, int> churn;
+  for (int round = 0; round < 8; ++round)
+  {
+    for (int i = 0; i < 2000; ++i)
+      churn.insert(site + "path/" + std::to_string(i), round);
+    assert(string_tests::valid_compact(churn));
+    for (int i = 0; i < 2000; ++i)
+      if (i % 10 != round)
+        churn.remove(site + "path/" + std::to_string(i));
+  }
+  assert(string_tests::valid_compact(churn) && churn.size() == 200);
+  for (int i = 0; i < 2000; ++i)
+    assert((churn.find(site + "path/" + std::to_string(i)) != nullptr) == (i % 10 == 7));
+}
+
+// Test freezing trees of every shape up to a few full levels, and searching for keys which are in
+// them, between them and outside them
+void test_frozen()
+{
+  for (int count = 0; count < 70; ++count)
+  {
+    avltree<int, double> tree;
+    for (int i = 0; i < count; ++i)
+      tree.insert(2 * i, i + 0.5);
+    const frozen_avltree<int, double> frozen = freeze(tree);
+    assert(frozen.size() == static_cast<std::size_t>(count) && frozen.empty() == (count == 0));
+    for (int key = -2; key <= 2 * count + 1; ++key)
+    {
+      const double* value = frozen.find(key);
+      assert((value != nullptr) == (key >= 0 && key < 2 * count && key % 2 == 0));
+      assert(!value || *value == key / 2 + 0.5);
+    }
+  }
+
+  std::vector<std::pair<std::string, int>> sorted = { {"ant", 1}, {"bee", 2}, {"cat", 3} };
+  const frozen_avltree<std::string, int> words(sorted.begin(), sorted.end());
+  assert(words.get("bee").has_value() && words.get("bee").value() == 2);
+  assert(!words.get("dog").has_value() && !words.get("a").has_value());
+
+  // A copy of a tree in another order is searched in that order.
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, no_tracing,
+          reverse_order> reversed;
+  for (int i = 0; i < 50; ++i)
+    reversed.insert(2 * i, i + 0.5);
+  const frozen_avltree<int, double, reverse_order> frozen_reversed = freeze(reversed);
+  assert(frozen_reversed.size() == 50);
+  for (int key = -2; key <= 101; ++key)
+  {
+    const double* value = frozen_reversed.find(key);
+    assert((value != nullptr) == (key >= 0 && key < 100 && key % 2 == 0));
+    assert(!value || *value == key / 2 + 0.5);
+  }
+  compared_tree<member_compare> members;
+  for (const auto& word : sorted)
+    members.insert(word.first, word.second);
+  const frozen_avltree<std::string, int, member_compare> frozen_members = freeze(members);
+  assert(frozen_members.find("cat") && *frozen_members.find("cat") == 3 && !frozen_members.find("cow"));
+}
+
+// Ascending or descending order, chosen at run time
+struct ordered_by_sign
+{
+  explicit ordered_by_sign(int sign = 1) : sign(sign) {}
+  bool operator()(int a, int b) const { return sign * a < sign * b; }
+  int sign;
+};
+
+// Test a saved snapshot opens with the same elements, in order, for trees of many shapes, and that
+// files which aren't snapshots of the right types are refused
+void test_mapped()
+{
+  const std::string path = "test-avl-snapshot.tmp";
+  for (int count = 0; count < 70; count += 3)
+  {
+    avltree<int, double> tree;
+    for (int i = 0; i < count; ++i)
+      tree.insert(2 * i, i + 0.5);
+    assert(save_mapped(tree, path));
+    const mapped_avltree<int, double> mapped = open_mapped<int, double>(path);
+    assert(mapped.is_open() && mapped.size() == static_cast<std::size_t>(count));
+    for (int key = -2; key <= 2 * count + 1; ++key)
+    {
+      const double* value = mapped.find(key);
+      assert((value != nullptr) == (key >= 0 && key < 2 * count && key % 2 == 0));
+      assert(!value || (*value == key / 2 + 0.5 && mapped.get(key).value() == *value));
+    }
+    int expected = 0;
+    for (auto element : mapped)
+    {
+      assert(element.first == expected && element.second == expected / 2 + 0.5);
+      expected += 2;
+    }
+    assert(expected == 2 * count);
+    std::size_t in_range = 0;
+    for (auto element : mapped.range(5, 21))
+    {
+      assert(element.first >= 5 && element.first < 21);
+      ++in_range;
+    }
+    assert(in_range == static_cast<std::size_t>(std::max(0, std::min(count, 11) - 3)));
+  }
+
+  mapped_avltree<int, double> mapped;
+  assert(!mapped.open("no-such-snapshot.tmp") && !mapped.is_open() && mapped.empty());
+  using float_snapshot = mapped_avltree<int, float>;
+  using wide_snapshot = mapped_avltree<long long, double>;
+  assert(!float_snapshot().open(path.c_str()));  // saved with double values
+  assert(!wide_snapshot().open(path.c_str()));
+  std::FILE* junk = std::fopen(path.c_str(), "wb");
+  std::fputs("not a snapshot, though long enough to hold a header", junk);
+  std::fclose(junk);
+  assert(!mapped.open(path.c_str()));
+
+  // A new snapshot replaces the file while an open one keeps its contents.
+  avltree<int, double> tree;
+  tree.insert(1, 1.0);
+  assert(save_mapped(tree, path) && mapped.open(path.c_str()));
+  tree.insert(2, 2.0);
+  assert(save_mapped(tree, path));
+  const mapped_avltree<int, double> reopened = open_mapped<int, double>(path);
+  assert(mapped.size() == 1 && mapped.get(1).value() == 1.0 && reopened.size() == 2);
+  mapped_avltree<int, double> moved(std::move(mapped));
+  assert(!mapped.is_open() && moved.find(1) && *moved.find(1) == 1.0);
+
+  // A snapshot of a tree in another order only opens for that order, and is searched in it.
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, no_tracing,
+          reverse_order> reversed;
+  for (int i = 0; i < 40; ++i)
+    reversed.insert(2 * i, i + 0.5);
+  assert(save_mapped(reversed, path));
+  assert((!open_mapped<int, double>(path).is_open()));
+  const mapped_avltree<int, double, reverse_order> mapped_reversed = open_mapped<int, double, reverse_order>(path);
+  assert(mapped_reversed.is_open() && mapped_reversed.size() == 40);
+  for (int key = -2; key <= 81; ++key)
+  {
+    const double* value = mapped_reversed.find(key);
+    assert((value != nullptr) == (key >= 0 && key < 80 && key % 2 == 0));
+    assert(!value || *value == key / 2 + 0.5);
+  }
+  int expected_key = 70;
+  for (auto element : mapped_reversed.range(70, 59))  // from 70 down to 60
+  {
+    assert(element.first == expected_key);
+    expected_key -= 2;
+  }
+  assert(expected_key == 58);
+
+  // Keys saved in one order don't open for a policy of the same type ordering them differently.
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, no_tracing,
+          ordered_by_sign> ascending;  // ordered_by_sign(1), by default
+  for (int i = 0; i < 10; ++i)
+    ascending.insert(i, i);
+  assert(save_mapped(ascending, path));
+  assert((open_mapped<int, double, ordered_by_sign>(path, ordered_by_sign(1)).is_open()));
+  assert((!open_mapped<int, double, ordered_by_sign>(path, ordered_by_sign(-1)).is_open()));
+  std::remove(path.c_str());
+}
+
+// Test for_each_changed visits just the elements changed since the last visit, however they
+// changed, and that a stream of checkpoints restores the tree
+void test_checkpoint()
+{
+  using tracked_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, dirty_tracking>;
+  tracked_tree tracked;
+  std::vector<int> visited;
+  const auto record = [&](const int& key, const double&) { visited.push_back(key); };
+  for (int i = 0; i < 100; ++i)
+    tracked.insert(i, i);
+  tracked.for_each_changed(record);
+  assert(visited.size() == 100 && std::is_sorted(visited.begin(), visited.end()));
+  visited.clear();
+  tracked.for_each_changed(record);
+  assert(visited.empty());
+
+  tracked.insert(50, 0.5);                       // overwritten
+  tracked.emplace(150, 1.5);                     // new, and rotates the tree
+  tracked.remove(20);
+  std::vector<std::pair<int, double>> batch = { { 10, 1.0 }, { 120, 1.0 } };
+  tracked.insert_batch(batch.begin(), batch.end());
+  tracked.for_each_changed(record);
+  assert((visited == std::vector<int>{ 10, 50, 120, 150 }));
+  assert(tests::is_avl(tracked) && tests::valid_parent_links(tracked));
+
+  checkpointed_avltree<int, double> tree;
+  std::stringstream stream;
+  for (int i = 0; i < 10000; ++i)
+    tree.insert(i, i);
+  assert(tree.checkpoint(stream));
+  const std::size_t full_size = stream.str().size();
+  tree.insert(5, 0.5);
+  tree.insert(20000, 2.0);
+  tree.remove(7);
+  tree.remove(8);
+  tree.insert(8, 8.5);   // removed and inserted again
+  tree.remove(123456);   // not there
+  assert(tree.checkpoint(stream));
+  assert(stream.str().size() - full_size < 200 && tree.checkpoints_applied() == 2);
+  tree.remove(9);
+  assert(tree.checkpoint(stream));
+
+  checkpointed_avltree<int, double> restored;
+  std::stringstream copy(stream.str());
+  assert(restored.restore(copy) && restored.size() == 10000);
+  assert(restored.restore(copy) && restored.restore(copy) && !restored.restore(copy));  // then past the end
+  assert(restored.size() == tree.size() && restored.checkpoints_applied() == 3);
+  auto expected = tree.tree().begin();
+  for (auto element : restored.tree())
+  {
+    assert(element.first == expected->first && element.second == expected->second);
+    ++expected;
+  }
+  assert(!restored.get(7).has_value() && restored.get(8).value() == 8.5 && !restored.get(9).has_value());
+
+  std::stringstream skipped(stream.str().substr(full_size));
+  checkpointed_avltree<int, double> fresh;
+  assert(!fresh.restore(skipped));  // the second checkpoint needs the first
+  std::stringstream wrong_types(stream.str());
+  checkpointed_avltree<int, float> floats;
+  assert(!floats.restore(wrong_types));
+}
+
+// Test a moved-from tree is left empty and the nodes belong to the destination
+void test_move()
+{
+  avltree<int, double> tree;
+  for (int i = 0; i < 10; ++i)
+    tree.insert(i, static_cast<double>(i));
+  avltree<int, double> moved(std::move(tree));
+  assert(tests::count_nodes(tree) == 0);
+  assert(tests::count_nodes(moved) == 10);
+  tree = std::move(moved);
+  assert(tests::count_nodes(tree) == 10);
+  assert(tree.get(9).value() == 9.0);
+}
+
+// Test a copy has the same elements, shape and augmented data without comparing any keys, and that
+// it is independent of the original
+void test_copy()
+{
+  using ranked_tree = avltree<int, double, std::allocator<std::pair<const int, double>>, order_statistics>;
+  ranked_tree tree;
+  for (int i = 0; i < 500; ++i)
+    tree.insert(i * 7919 % 500, static_cast<double>(i * 7919 % 500));  // all of 0..499, shuffled
+  for (int i = 0; i < 500; i += 3)
+    tree.remove(i);
+
+  ranked_tree copy(tree);
+  assert(copy.size() == tree.size());
+  assert(tests::is_avl(copy) && tests::valid_balance_factors(copy) && tests::valid_parent_links(copy));
+  assert(tests::valid_subtree_sizes(copy));
+  ranked_tree::const_iterator original = tree.cbegin();
+  for (const auto& element : copy)
+  {
+    assert(element.first == original->first && element.second == original->second);
+    ++original;
+  }
+  assert(original == tree.cend());
+  assert(copy.rank(250) == tree.rank(250));
+
+  copy.insert(0, -1.0);
+  copy.remove(1);
+  assert(!tree.find(0) && tree.get(1).value() == 1.0);
+  assert(copy.get(0).value() == -1.0 && !copy.find(1));
+
+  tree = copy;
+  assert(tree.size() == copy.size() && tree.get(0).value() == -1.0);
+  const ranked_tree& same = tree;
+  tree = same;
+  assert(tree.size() == copy.size() && tests::valid_subtree_sizes(tree));
+  ranked_tree empty_copy((ranked_tree()));
+  assert(empty_copy.empty());
+
+  compared_tree<counting_less> words;
+  for (int i = 0; i < 100; ++i)
+    words.insert(std::to_string(i), i);
+  counting_less::calls = 0;
+  const compared_tree<counting_less> copied_words(words);
+  assert(counting_less::calls == 0);
+  assert(copied_words.size() == 100 && *copied_words.find("42") == 42);
+  assert(string_tests::is_avl(copied_words));
+
+  // A pooled copy gets a pool of its own, with its nodes in one block
+  avltree<int, double, node_pool_allocator<int>> pooled(tree.begin(), tree.end());
+  const avltree<int, double, node_pool_allocator<int>> pooled_copy(pooled);
+  assert(pooled_copy.get_allocator().pool() != pooled.get_allocator().pool());
+  assert(pooled_copy.get_allocator().pool()->block_count() == 1);
+  assert(pooled_copy.size() == pooled.size() && tests::is_avl(pooled_copy));
+  const node_pool_allocator<int> shared(pooled.get_allocator());
+  const avltree<int, double, node_pool_allocator<int>> sharing_copy(pooled, shared);
+  assert(sharing_copy.get_allocator() == pooled.get_allocator());
+}
+
+// Test clear empties a tree for reuse, releasing a pool only this tree uses in one go and freeing
+// the nodes one by one otherwise
+void test_clear()
+{
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, collect_stats> counted_tree;
+  for (int i = 0; i < 100; ++i)
+    counted_tree.insert(i, static_cast<double>(i));
+  counted_tree.clear();
+  assert(counted_tree.empty() && counted_tree.size() == 0 && counted_tree.begin() == counted_tree.end());
+  assert(counted_tree.stats().deallocations == 100);
+  counted_tree.insert(1, 1.0);
+  assert(counted_tree.get(1).value() == 1.0);
+
+  avltree<int, double, node_pool_allocator<int>> pooled;
+  for (int i = 0; i < 1000; ++i)
+    pooled.insert(i, static_cast<double>(i));
+  assert(pooled.get_allocator().pool()->block_count() > 0);
+  pooled.clear();
+  assert(pooled.empty() && pooled.get_allocator().pool()->block_count() == 0);
+  for (int i = 0; i < 10; ++i)
+    pooled.insert(i, static_cast<double>(i));
+  assert(pooled.size() == 10 && tests::is_avl(pooled) && pooled.get(9).value() == 9.0);
+
+  // Another allocator shares this pool, so the slots are freed one by one for reuse
+  node_pool_allocator<int> alloc;
+  avltree<int, double, node_pool_allocator<int>> sharing(alloc);
+  for (int i = 0; i < 1000; ++i)
+    sharing.insert(i, static_cast<double>(i));
+  const std::size_t blocks = alloc.pool()->block_count();
+  sharing.clear();
+  assert(sharing.empty() && alloc.pool()->block_count() == blocks);
+
+  // Strings need destroying, so they are freed one by one too
+  avltree<int, std::string, node_pool_allocator<int>> strings;
+  for (int i = 0; i < 100; ++i)
+    strings.insert(i, std::string(40, 'a' + i % 26));
+  strings.clear();
+  assert(strings.empty() && strings.get_allocator().pool()->block_count() > 0);
+}
+
+// A tracing policy which counts the rotations it hears about
+struct counting_tracer : no_tracing
+{
+  static int rotations;
+  template <typename... Details>
+  static void trace(const char* what, const Details&...)
+  {
+    if (std::string(what).find("rotate to side") == 0)
+      ++rotations;
+  }
+};
+int counting_tracer::rotations = 0;
+
+// Counts the characters of a string value against a `bounded_avltree`'s byte limit.
+struct string_length
+{
+  std::size_t operator()(int, const std::string& value) const { return value.size(); }
+};
+
+void test_bounded()
+{
+  // Finding or overwriting an element makes it the most recently used; peeking doesn't.
+  bounded_avltree<int, double> cache(3);
+  cache.insert(1, 10);
+  cache.insert(2, 20);
+  cache.insert(3, 30);
+  assert(cache.get(1).value() == 10);
+  cache.insert(4, 40);
+  assert(cache.size() == 3 && !cache.peek(2) && cache.evictions() == 1);
+  assert(cache.oldest() == 3 && cache.newest() == 4);
+  cache.insert(3, 33);
+  assert(*cache.peek(1) == 10);
+  cache.insert(5, 50);
+  assert(!cache.peek(1) && *cache.peek(3) == 33 && cache.oldest() == 4);
+  cache.remove(3);
+  cache.remove(100);
+  cache.insert(6, 60);
+  assert(cache.size() == 3 && cache.oldest() == 4 && cache.evictions() == 2);
+  cache.set_limits(1);
+  assert(cache.size() == 1 && cache.oldest() == 6 && cache.newest() == 6);
+  assert(tests::is_avl(cache.tree()) && tests::valid_parent_links(cache.tree()));
+
+  // The byte limit counts each node and what `Weigh` adds for it.
+  using sized_cache = bounded_avltree<int, std::string, string_length>;
+  sized_cache empty_values(sized_cache::unlimited);
+  empty_values.insert(0, "");
+  const std::size_t node_bytes = empty_values.bytes();
+  sized_cache sized(100, 4 * node_bytes + 16);
+  for (int i = 0; i < 4; ++i)
+    sized.insert(i, "12345");
+  assert(sized.size() == 3 && !sized.peek(0) && sized.bytes() == 3 * (node_bytes + 5));
+  sized.insert(1, "");  // shrinks, making room
+  sized.insert(4, "12345");
+  assert(sized.size() == 4 && sized.bytes() == 4 * node_bytes + 15);
+  sized.insert(5, std::string(4 * node_bytes + 17, 'x'));  // too big to keep, on its own
+  assert(sized.empty() && sized.bytes() == 0);
+
+  // Expiry visits only the subtrees holding expired elements, and leaves a valid tree and list.
+  using clock = std::chrono::steady_clock;
+  const clock::time_point start = clock::now();
+  bounded_avltree<int, double> timed(bounded_avltree<int, double>::unlimited);
+  for (int i = 0; i < 1000; ++i)
+  {
+    const int key = i * 7919 % 1000;
+    if (key % 10 == 9)
+      timed.insert(key, key);  // never expires
+    else
+      timed.insert(key, key, start + std::chrono::seconds(key % 10));
+  }
+  assert(timed.expire_before(start) == 0 && timed.size() == 1000);
+  assert(timed.expire_before(start + std::chrono::seconds(5)) == 500 && timed.size() == 500);
+  assert(tests::is_avl(timed.tree()) && tests::valid_parent_links(timed.tree()));
+  for (std::pair<const int&, const double&> element : timed.tree())
+    assert(element.first % 10 >= 5);
+  timed.insert(2000, 0, start);
+  assert(timed.expire_before(start + std::chrono::hours(1)) == 401 && timed.size() == 100);
+  assert(tests::is_avl(timed.tree()) && tests::valid_parent_links(timed.tree()));
+  assert(timed.expire() == 0);
+  timed.set_limits(1);
+  assert(timed.size() == 1 && timed.evictions() == 99);
+  timed.clear();
+  assert(timed.empty() && timed.bytes() == 0);
+
+  // Moving takes the elements and the limits.
+  bounded_avltree<int, double> moved(std::move(cache));
+  assert(moved.size() == 1 && moved.max_entries() == 1 && cache.empty() && cache.max_entries() == 0);
+}
+
+// Test tracing policies hear about rebalancing, and that stream_tracing prints the rotated keys
+void test_tracing()
+{
+  avltree<int, counted, std::allocator<std::pair<const int, counted>>, no_augmentation, counting_tracer> counted_tree;
+  for (int i = 0; i < 3; ++i)
+    counted_tree.insert(i, counted(i));  // one rotation; counted values can't be printed
+  assert(counting_tracer::rotations == 1);
+  counted_tree.insert(-1, counted());
+  counted_tree.insert(-2, counted());   // another
+  counted_tree.remove(2);
+  counted_tree.remove(1);               // and one from the removal
+  assert(counting_tracer::rotations == 3);
+
+  std::ostringstream log;
+  std::streambuf* const clog_buffer = std::clog.rdbuf(log.rdbuf());
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, stream_tracing> traced;
+  traced.insert(1, 1.0);
+  traced.insert(2, 2.0);
+  traced.insert(3, 3.0);
+  std::clog.rdbuf(clog_buffer);
+  assert(log.str().find("rotate to side, old subtree root, new subtree root 0 1 2\n") != std::string::npos);
+}
+
+// Test collect_stats counts what the tree does, and that other trees have no stats
+void test_stats()
+{
+  avltree<int, double, std::allocator<std::pair<const int, double>>, no_augmentation, collect_stats> tree;
+  tree.insert(1, 1.0);
+  tree.insert(2, 2.0);
+  tree.insert(3, 3.0);  // rotates, the tree's left with 2 at the root
+  tree.insert(0, 0.0);
+  tree.insert(-1, 0.0); // rotates, 1 moves down to the right of 0
+  avltree_stats stats = tree.stats();
+  assert(stats.single_rotations == 2 && stats.double_rotations == 0);
+  assert(stats.allocations == 5 && stats.deallocations == 0);
+  assert(stats.searches[0] == 1 && stats.searches[1] == 1 && stats.searches[2] == 2 && stats.searches[3] == 1);
+  assert(stats.insertion_retraces[1] == 1 && stats.insertion_retraces[2] == 3);
+
+  tree.reset_stats();
+  tree.insert(6, 0.0);
+  tree.insert(5, 0.0);  // 5 under 6 under 3: double rotation
+  assert(tree.find(5) && tree.find(7) == nullptr);
+  tree.remove(6);
+  stats = tree.stats();
+  assert(stats.single_rotations == 0 && stats.double_rotations == 1);
+  assert(stats.allocations == 2 && stats.deallocations == 1);
+  std::size_t searches = 0, deletion_retraces = 0;
+  for (std::size_t length = 0; length < avltree_stats::max_length; ++length)
+  {
+    searches += stats.searches[length];
+    deletion_retraces += stats.deletion_retraces[length];
+  }
+  assert(searches == 5 && deletion_retraces == 1);
+  assert(tests::is_avl(tree) && tests::valid_balance_factors(tree));
+}
+
+// Test a tree drawing its nodes from a pool reuses the slots freed by removals
+void test_pool_allocator()
+{
+  node_pool_allocator<int> alloc;
+  avltree<int, double, node_pool_allocator<int>> tree(alloc);
+  const static int n_insertions = 1000;
+  for (int i = 0; i < n_insertions; ++i)
+    tree.insert(i, static_cast<double>(i));
+  assert(tests::is_avl(tree));
+  assert(tests::count_nodes(tree) == n_insertions);
+
+  const std::size_t blocks = alloc.pool()->block_count();
+  assert(blocks > 0);                             // Nodes came from the pool
+
+  avltree<int, double, node_pool_allocator<int>> scratch(alloc);  // Shares the same pool
+  for (int i = 0; i < n_insertions; ++i)
+  {
+    scratch.insert(i, static_cast<double>(i));    // Take a slot...
+    scratch.remove(i);                            // ...and free it again
+  }
+  assert(alloc.pool()->block_count() == blocks);  // Freed slots were reused, no new blocks
+  assert(tests::count_nodes(scratch) == 0);
+  assert(tests::count_nodes(tree) == n_insertions);
+  assert(tests::valid_balance_factors(tree));
+}
+
 // Call all the above cases
 int main()
 {
@@ -145,5 +1935,35 @@ int main()
   TEST_CASE(test_multiple_left_insertions);
   TEST_CASE(test_right_left_rotation);
   TEST_CASE(test_left_right_rotation);
+  TEST_CASE(test_removals);
+  TEST_CASE(test_string_keys);
+  TEST_CASE(test_find);
+  TEST_CASE(test_get_many);
+  TEST_CASE(test_hinted_insert);
+  TEST_CASE(test_compare);
+  TEST_CASE(test_emplace);
+  TEST_CASE(test_optional);
+  TEST_CASE(test_assign_sorted);
+  TEST_CASE(test_batches);
+  TEST_CASE(test_relaxed_balance);
+  TEST_CASE(test_iterators);
+  TEST_CASE(test_order_statistics);
+  TEST_CASE(test_range_aggregate);
+  TEST_CASE(test_concurrent);
+  TEST_CASE(test_persistent);
+  TEST_CASE(test_join_split);
+  TEST_CASE(test_set_operations);
+  TEST_CASE(test_parallel);
+  TEST_CASE(test_compact);
+  TEST_CASE(test_frozen);
+  TEST_CASE(test_mapped);
+  TEST_CASE(test_checkpoint);
+  TEST_CASE(test_bounded);
+  TEST_CASE(test_tracing);
+  TEST_CASE(test_stats);
+  TEST_CASE(test_move);
+  TEST_CASE(test_copy);
+  TEST_CASE(test_clear);
+  TEST_CASE(test_pool_allocator);
   return 0;
 }